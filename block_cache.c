@@ -15,173 +15,2307 @@
 #include <string.h>
 #include <time.h>
 #include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 // Project includes
 #include <block_cache.h>
 #include <cmpsc311_log.h>
 
+// A list of entries a replacement policy keeps
+struct cache_list {
+    int32_t head; // Entry most recently put on the list
+    int32_t tail; // Entry at the other end, where the policy looks for its victim
+    uint32_t size; // Number of entries on the list
+};
+
+// Keys of frames a replacement policy evicted, kept so that a frame that comes back soon is recognized
+struct cache_ghost {
+    uint32_t *keys; // Keys of frames evicted recently, kept in a ring
+    int32_t *chain; // Next position in the same hash bucket, -1 ends the chain, BLOCK_CACHE_GHOST_FORGOTTEN if empty
+    int32_t *buckets; // First position of each hash bucket
+    uint32_t bucket_bits; // The table has 1 << bucket_bits buckets
+    uint32_t capacity; // Most keys the ring holds, 0 if the policy has no use for the list
+    uint32_t next_key; // Ring position the next key is written to, the oldest key
+    uint32_t size; // Number of keys remembered
+};
+
+// How often the frames of a shard were used lately, counted for admission
+struct cache_sketch {
+    uint64_t *table; // BLOCK_CACHE_SKETCH_DEPTH rows of 4-bit counters, 16 to a word, NULL if admission is off
+    uint32_t width; // Counters in a row, a power of two
+    uint32_t samples; // Uses counted since the counters were last halved
+    uint32_t sample_size; // Uses after which every counter is halved
+};
+
+// One independently locked part of the cache
+struct cache_shard {
+    pthread_mutex_t lock; // Guards everything in the shard, including its entries' frames
+    struct cache_frame *entries; // The entries of the shard
+    uint32_t first_entry; // Index of the shard's first entry in the cache, and of its first frame in the arena
+    uint32_t max_items; // Maximum number of entries in the shard
+    uint32_t indeces_used; // Entries handed out so far, each has a frame allocated
+    int32_t *buckets; // First entry of each hash bucket, chained through hash_next
+    uint32_t bucket_bits; // The table has 1 << bucket_bits buckets
+    struct cache_list lists[BLOCK_CACHE_POLICY_LISTS]; // The replacement policy's lists of entries
+    struct cache_ghost ghosts[BLOCK_CACHE_POLICY_LISTS]; // The replacement policy's lists of evicted keys
+    uint32_t target; // Entries the policy aims to keep on its first list (2Q, ARC, S3-FIFO)
+    struct cache_sketch sketch; // How often frames of the shard have been used lately, for admission
+    int32_t free_slots; // Entries dropped by invalidate_block_cache, chained through hash_next
+    uint64_t *dirty_map; // Write-back mode: a bit per entry whose frame changed since it was last written to the device
+    uint32_t num_dirty; // Bits set in dirty_map
+};
+
+// A replacement policy, the hooks find_cache_slot and the lookups call and how it sizes its lists
+struct cache_policy {
+    const char *name; // The name set_block_cache_policy knows the policy by
+    void (*hit)(struct cache_shard *shard, int slot); // An entry was used
+    void (*insert)(struct cache_shard *shard, int slot); // An entry was filled with a frame that missed
+    int (*victim)(struct cache_shard *shard, uint32_t key); // Pick the entry to evict for the frame with this key
+    uint32_t target_percent; // Starting target of the shards, as a share of their entries
+    uint32_t ghost_percent[BLOCK_CACHE_POLICY_LISTS]; // Size of each ghost list, as a share of the shard's entries
+    int8_t ghost_of_list[BLOCK_CACHE_POLICY_LISTS]; // Ghost list an entry evicted from each list is remembered in, -1 for none
+};
+
 uint32_t block_cache_max_items = DEFAULT_BLOCK_FRAME_CACHE_SIZE; // Maximum number of items in cache
 int init = 0;
 
-struct cache_frame *cache; // Declare structure
-uint32_t cache_indeces_used;
+// The cache is split into shards by a hash of (block, frame). Each shard has its own lock, entries, hash table and
+// replacement policy lists, so threads working on different frames rarely wait on each other
+struct cache_shard *cache_shards; // Declare structure
+uint32_t cache_num_shards; // A power of two, so a shard is picked by masking the hash
+
+// Every frame the cache can hold is laid out in one page-aligned arena mapped at init, entry i of the cache owns
+// frame i of the arena, so nothing is allocated after init and entries need no pointer to their frame
+struct cache_frame *cache_entries; // The entries of all of the shards, each shard has a run of them
+char *cache_arena; // The frames of all of the entries
+size_t cache_arena_size; // Bytes mapped for the arena
+int cache_huge_pages = 0; // Back the arena with huge pages if the system has them
+
+// With admission on, a frame that misses only takes the place of the policy's victim if the shard's frequency
+// sketch says it is used more often, so frames touched once by a scan or a bulk write do not push out the working set
+int cache_admission = 0;
+
+int cache_write_back = 0; // Modified frames stay in the cache until they are flushed or evicted
+int (*cache_flusher)(BlockIndex blk, BlockFrameIndex frm, void* frame); // Writes a dirty frame to the device
+
+// The dirty count and the flusher's state are shared by all of the shards. dirty_lock is only ever taken inside a
+// shard's lock (or with no shard locked), never the other way around
+pthread_mutex_t dirty_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t flusher_wake = PTHREAD_COND_INITIALIZER; // Dirty frames passed the low watermark, or the flusher should stop
+pthread_cond_t writers_wake = PTHREAD_COND_INITIALIZER; // Dirty frames dropped below the high watermark
+uint32_t cache_dirty_frames; // Number of entries with the dirty bit set
+pthread_t flusher_thread;
+int flusher_running = 0;
+int flusher_stalled = 0; // The flusher's last write failed, writers are not held back until it retries
+uint32_t dirty_low_watermark; // The flusher starts writing above this many dirty frames
+uint32_t dirty_high_watermark; // Writers wait for the flusher at this many dirty frames
+
+// Sweeps over the dirty frames of every shard run one at a time, taken before any shard lock. A sweep works through
+// a sorted snapshot of the dirty frames' addresses, which is only taken again from the shards' dirty maps once it
+// has been used up
+pthread_mutex_t flush_lock = PTHREAD_MUTEX_INITIALIZER;
+uint32_t flush_cursor; // (block << 16) | frame the flusher's sweep continues from
+uint32_t *flush_order; // The snapshot, room for every entry of the cache is allocated at init
+uint32_t flush_order_size; // Addresses in the snapshot
+uint32_t flush_order_start; // Position of the first address at or after flush_cursor when the snapshot was taken
+uint32_t flush_order_next; // Addresses of the snapshot swept so far, counting from flush_order_start
+
+// What the unit test's flusher was handed
+uint32_t cache_unit_flushed; // Frames written
+uint32_t cache_unit_last_key; // Key of the last frame written
+int cache_unit_out_of_order; // A frame was written before one with a lower key in the same flush
+
+//
+// Functional Prototypes
+
+static char *map_cache_arena(size_t bytes); // Map the page-aligned frame arena
+static char *cache_slot_frame(struct cache_shard *shard, int slot); // Find an entry's frame in the arena
+static uint64_t cache_hash(BlockIndex block, BlockFrameIndex frm); // Hash a frame for its shard and bucket
+static struct cache_shard *cache_shard_of(BlockIndex block, BlockFrameIndex frm); // Find the shard a frame belongs to
+static int lookup_cache_slot(struct cache_shard *shard, BlockIndex block, BlockFrameIndex frm); // Find the entry holding a frame
+static void unhash_cache_slot(struct cache_shard *shard, int slot); // Take an entry out of the hash table
+static void list_unlink(struct cache_shard *shard, int slot); // Take an entry off its policy list
+static void list_push_front(struct cache_shard *shard, int which, int slot); // Put an entry at the head of a policy list
+static void list_move_front(struct cache_shard *shard, int which, int slot); // Move an entry to the head of a policy list
+static int ghost_init(struct cache_ghost *ghost, uint32_t capacity); // Allocate a ghost list
+static int ghost_find(struct cache_ghost *ghost, uint32_t key, int forget); // Look a key up in a ghost list
+static void ghost_remember(struct cache_ghost *ghost, uint32_t key); // Add an evicted frame's key to a ghost list
+static void ghost_forget_oldest(struct cache_ghost *ghost); // Drop the oldest key of a ghost list
+static void policy_remove(struct cache_shard *shard, int slot, int evicted); // Take an entry out of the policy
+static int sketch_init(struct cache_sketch *sketch, uint32_t max_items); // Allocate a shard's frequency sketch
+static uint32_t sketch_counter(struct cache_sketch *sketch, uint32_t key, int row); // Find a key's counter in a row
+static void sketch_record(struct cache_sketch *sketch, uint32_t key); // Count a use of a frame
+static uint32_t sketch_estimate(struct cache_sketch *sketch, uint32_t key); // Estimate how often a frame is used
+static void lru_hit(struct cache_shard *shard, int slot); // LRU: an entry was used
+static void lru_insert(struct cache_shard *shard, int slot); // LRU: an entry was filled
+static int lru_victim(struct cache_shard *shard, uint32_t key); // LRU: pick the entry to evict
+static void clock_hit(struct cache_shard *shard, int slot); // CLOCK: an entry was used
+static void clock_insert(struct cache_shard *shard, int slot); // CLOCK: an entry was filled
+static int clock_victim(struct cache_shard *shard, uint32_t key); // CLOCK: pick the entry to evict
+static void twoq_hit(struct cache_shard *shard, int slot); // 2Q: an entry was used
+static void twoq_insert(struct cache_shard *shard, int slot); // 2Q: an entry was filled
+static int twoq_victim(struct cache_shard *shard, uint32_t key); // 2Q: pick the entry to evict
+static void arc_hit(struct cache_shard *shard, int slot); // ARC: an entry was used
+static void arc_insert(struct cache_shard *shard, int slot); // ARC: an entry was filled
+static int arc_victim(struct cache_shard *shard, uint32_t key); // ARC: pick the entry to evict
+static void s3fifo_hit(struct cache_shard *shard, int slot); // S3-FIFO: an entry was used
+static void s3fifo_insert(struct cache_shard *shard, int slot); // S3-FIFO: an entry was filled
+static int s3fifo_victim(struct cache_shard *shard, uint32_t key); // S3-FIFO: pick the entry to evict
+static int find_cache_slot(struct cache_shard *shard, BlockIndex block, BlockFrameIndex frm); // Find or make room for a frame in the cache
+static void count_dirty_frames(int32_t change); // Adjust the dirty count and wake the flusher or writers
+static int cache_slot_dirty(struct cache_shard *shard, int slot); // Check an entry's dirty bit
+static void mark_cache_slot(struct cache_shard *shard, int slot, int dirty); // Set or clear an entry's dirty bit
+static int clean_cache_slot(struct cache_shard *shard, int slot); // Write a dirty entry to the device
+static int compare_dirty_keys(const void *a, const void *b); // Order dirty entries by device address
+static uint32_t snapshot_dirty_frames(void); // Collect and sort the addresses of the dirty frames
+static int flush_dirty_frames(uint32_t max_frames); // Write dirty frames in device order from the sweep cursor
+static void *flusher_main(void *arg); // Body of the background flusher
+static int cache_unit_check(int ok, const char *what); // Log a failed check of the unit test
+static int cache_unit_start(const char *policy, int write_back, int admission, uint32_t size); // Start a cache for a check
+static int cache_unit_flusher(BlockIndex blk, BlockFrameIndex frm, void* frame); // Count the frames the cache writes
+static int cache_unit_test_flusher(void); // Unit test: the flusher keeps to the watermarks
+static int cache_unit_test_lru(void); // Unit test: LRU evicts the least recently used frame
+static void *cache_unit_thread(void *arg); // Put and read back the frames of one block
+static int cache_unit_test_shards(void); // Unit test: keys include the block, shards are thread-safe
+static int cache_unit_test_arena(void); // Unit test: entries are compact and frames page-aligned
+static int cache_unit_test_policies(void); // Unit test: every policy caches, scan-resistant ones keep hot frames
+static int cache_unit_test_admission(void); // Unit test: admission keeps cold frames out of a full cache
+
+// The replacement policies, each shard runs the one set_block_cache_policy picked before init
+static const struct cache_policy cache_policies[] = {
+    // name      hit          insert          victim          target share                       ghost shares                                    ghost of list
+    { "lru",     lru_hit,     lru_insert,     lru_victim,     0,                                 { 0, 0 },                                       { -1, -1 } },
+    { "clock",   clock_hit,   clock_insert,   clock_victim,   0,                                 { 0, 0 },                                       { -1, -1 } },
+    { "2q",      twoq_hit,    twoq_insert,    twoq_victim,    BLOCK_CACHE_2Q_IN_PERCENT,         { BLOCK_CACHE_2Q_OUT_PERCENT, 0 },              { 0, -1 } },
+    { "arc",     arc_hit,     arc_insert,     arc_victim,     0,                                 { 100, 100 },                                   { 0, 1 } },
+    { "s3fifo",  s3fifo_hit,  s3fifo_insert,  s3fifo_victim,  BLOCK_CACHE_S3FIFO_SMALL_PERCENT,  { BLOCK_CACHE_S3FIFO_GHOST_PERCENT, 0 },        { 0, -1 } },
+};
+const struct cache_policy *block_cache_policy = &cache_policies[0]; // The policy the shards run
+
+//
+// Functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : set_block_cache_size
+// Description  : Set the size of the cache (must be called before init)
+//
+// Inputs       : max_frames - the maximum number of items your cache can hold
+// Outputs      : 0 if successful, -1 if failure
+
+int set_block_cache_size(uint32_t max_frames)
+{
+    // If the cache has already been initialized, then return an error
+    if (init) {
+	    return (-1);
+    }
+
+    // Set the cache length equal to max_frames
+    block_cache_max_items = max_frames;
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : init_block_cache
+// Description  : Initialize the cache and note maximum frames, and start the
+//                background flusher in write-back mode
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int init_block_cache(void)
+{
+    struct cache_shard *shard;
+    uint32_t buckets;
+    uint32_t first_entry = 0;
+
+    // Small caches keep a single shard, so LRU stays exact where it matters most; large ones get up to
+    // BLOCK_CACHE_MAX_SHARDS shards of at least BLOCK_CACHE_MIN_SHARD_FRAMES frames
+    cache_num_shards = BLOCK_CACHE_MAX_SHARDS;
+    while ((cache_num_shards > 1) && (block_cache_max_items / cache_num_shards < BLOCK_CACHE_MIN_SHARD_FRAMES)) {
+	    cache_num_shards /= 2;
+    }
+
+    // Initialize the cache, the entries and their frames are all allocated up front
+    cache_shards = calloc(cache_num_shards, sizeof(struct cache_shard));
+    cache_entries = malloc(block_cache_max_items * sizeof(struct cache_frame));
+    cache_arena = map_cache_arena((size_t) block_cache_max_items * BLOCK_FRAME_SIZE);
+    flush_order = malloc(block_cache_max_items * sizeof(uint32_t));
+    if ((cache_shards == NULL) || (((cache_entries == NULL) || (cache_arena == NULL) || (flush_order == NULL)) &&
+	(block_cache_max_items > 0))) {
+	    // None of the shards have been set up yet
+	    cache_num_shards = 0;
+	    close_block_cache();
+	    return (-1);
+    }
+
+    for (uint32_t i = 0; i < cache_num_shards; i++) {
+	    shard = &cache_shards[i];
+	    pthread_mutex_init(&shard->lock, NULL);
+
+	    // The frames are dealt out evenly, the first shards take the remainder
+	    shard->max_items = block_cache_max_items / cache_num_shards + (i < block_cache_max_items % cache_num_shards);
+	    shard->first_entry = first_entry;
+	    shard->entries = cache_entries + first_entry;
+	    first_entry += shard->max_items;
+	    shard->free_slots = -1;
+
+	    // Size the hash table to the next power of two of the shard, so chains stay short
+	    shard->bucket_bits = 1;
+	    while (((uint32_t) 1 << shard->bucket_bits) < shard->max_items) {
+		    shard->bucket_bits++;
+	    }
+	    buckets = (uint32_t) 1 << shard->bucket_bits;
+
+	    // Each policy list starts out empty, a policy with a target share of the shard starts with that share
+	    for (int l = 0; l < BLOCK_CACHE_POLICY_LISTS; l++) {
+		    shard->lists[l].head = -1;
+		    shard->lists[l].tail = -1;
+	    }
+	    shard->target = shard->max_items * block_cache_policy->target_percent / 100;
+	    if ((shard->target == 0) && (block_cache_policy->target_percent > 0)) {
+		    shard->target = 1;
+	    }
+
+	    shard->buckets = malloc(buckets * sizeof(int32_t));
+	    shard->dirty_map = calloc((shard->max_items + 63) / 64, sizeof(uint64_t));
+	    if ((shard->buckets == NULL) || ((shard->dirty_map == NULL) && (shard->max_items > 0)) ||
+		(ghost_init(&shard->ghosts[0], shard->max_items * block_cache_policy->ghost_percent[0] / 100) == -1) ||
+		(ghost_init(&shard->ghosts[1], shard->max_items * block_cache_policy->ghost_percent[1] / 100) == -1) ||
+		(cache_admission && (sketch_init(&shard->sketch, shard->max_items) == -1))) {
+		    // Only the shards up to this one have been set up
+		    cache_num_shards = i + 1;
+		    close_block_cache();
+		    return (-1);
+	    }
+	    memset(shard->buckets, 0xff, buckets * sizeof(int32_t));
+    }
+
+    cache_dirty_frames = 0;
+    flush_cursor = 0;
+    flush_order_size = 0;
+    flush_order_next = 0;
+    init = 1;
+
+    // Dirty frames are trickled out between the watermarks, so evictions and poweroff rarely have to write them
+    dirty_low_watermark = block_cache_max_items * BLOCK_CACHE_DIRTY_LOW_PERCENT / 100;
+    dirty_high_watermark = block_cache_max_items * BLOCK_CACHE_DIRTY_HIGH_PERCENT / 100;
+    if (dirty_high_watermark <= dirty_low_watermark) {
+	    dirty_high_watermark = dirty_low_watermark + 1;
+    }
+
+    if (cache_write_back && !flusher_running) {
+	    flusher_running = 1;
+	    if (pthread_create(&flusher_thread, NULL, flusher_main, NULL) != 0) {
+		    // Without the thread dirty frames still go out on eviction and flush
+		    flusher_running = 0;
+	    }
+    }
+
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : close_block_cache
+// Description  : Clear all of the contents of the cache, cleanup
+//
+// Inputs       : none
+// Outputs      : o if successful, -1 if failure
+
+int close_block_cache(void)
+{
+    struct cache_shard *shard;
+
+    // Stop the flusher first, it must not be writing out of the frames freed below
+    if (flusher_running) {
+	    pthread_mutex_lock(&dirty_lock);
+	    flusher_running = 0;
+	    pthread_cond_signal(&flusher_wake);
+	    pthread_mutex_unlock(&dirty_lock);
+	    pthread_join(flusher_thread, NULL);
+    }
+
+    for (uint32_t i = 0; (cache_shards != NULL) && (i < cache_num_shards); i++) {
+	    shard = &cache_shards[i];
+	    free(shard->buckets);
+	    free(shard->dirty_map);
+	    free(shard->sketch.table);
+	    for (int l = 0; l < BLOCK_CACHE_POLICY_LISTS; l++) {
+		    free(shard->ghosts[l].keys);
+		    free(shard->ghosts[l].chain);
+		    free(shard->ghosts[l].buckets);
+	    }
+	    pthread_mutex_destroy(&shard->lock);
+    }
+
+    free(cache_shards);
+    cache_shards = NULL;
+    cache_num_shards = 0;
+    free(cache_entries);
+    cache_entries = NULL;
+    free(flush_order);
+    flush_order = NULL;
+    if (cache_arena != NULL) {
+	    munmap(cache_arena, cache_arena_size);
+	    cache_arena = NULL;
+    }
+    cache_dirty_frames = 0;
+
+    init = 0;
+    
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : map_cache_arena
+// Description  : Map the arena the cache's frames live in. With huge pages
+//                asked for, it is first mapped from the huge page pool, then
+//                left to transparent huge pages if the pool is empty
+//
+// Inputs       : bytes - the size of the frames together
+// Outputs      : pointer to the page-aligned arena, NULL if failure (or if
+//                the cache holds no frames)
+
+static char *map_cache_arena(size_t bytes)
+{
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    size_t huge_size;
+    void *arena;
+
+    if (bytes == 0) {
+	    return (NULL);
+    }
+
+    // Whole pages are mapped, so every frame of a page-multiple size starts on a page boundary
+    cache_arena_size = (bytes + page - 1) / page * page;
+
+#ifdef MAP_HUGETLB
+    // A huge page mapping has to be a whole number of huge pages, only worth it when the cache fills one
+    if (cache_huge_pages && (bytes >= BLOCK_CACHE_HUGE_PAGE_SIZE)) {
+	    huge_size = (bytes + BLOCK_CACHE_HUGE_PAGE_SIZE - 1) / BLOCK_CACHE_HUGE_PAGE_SIZE * BLOCK_CACHE_HUGE_PAGE_SIZE;
+	    arena = mmap(NULL, huge_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	    if (arena != MAP_FAILED) {
+		    cache_arena_size = huge_size;
+		    return ((char *) arena);
+	    }
+    }
+#endif
+
+    arena = mmap(NULL, cache_arena_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (arena == MAP_FAILED) {
+	    return (NULL);
+    }
+
+#ifdef MADV_HUGEPAGE
+    if (cache_huge_pages) {
+	    madvise(arena, cache_arena_size, MADV_HUGEPAGE);
+    }
+#endif
+
+    return ((char *) arena);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_slot_frame
+// Description  : Find the frame of an entry in the arena
+//
+// Inputs       : shard - the shard of the entry
+//                slot - the index of the entry in the shard
+// Outputs      : pointer to the frame
+
+static char *cache_slot_frame(struct cache_shard *shard, int slot)
+{
+    return (cache_arena + (size_t) (shard->first_entry + slot) * BLOCK_FRAME_SIZE);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_hash
+// Description  : Hash a frame, bits 32 and up pick its shard and the top bits
+//                its bucket within the shard
+//
+// Inputs       : block - the block number of the frame
+//                frm - the frame number of the frame
+// Outputs      : the hash
+
+static uint64_t cache_hash(BlockIndex block, BlockFrameIndex frm)
+{
+    // Fibonacci hashing spreads frames of one block, which only differ in the low bits, over the whole table
+    return ((((uint64_t) block << 16) | frm) * 0x9E3779B97F4A7C15ull);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_shard_of
+// Description  : Find the shard a frame belongs to
+//
+// Inputs       : block - the block number of the frame
+//                frm - the frame number of the frame
+// Outputs      : pointer to the shard
+
+static struct cache_shard *cache_shard_of(BlockIndex block, BlockFrameIndex frm)
+{
+    return (&cache_shards[(cache_hash(block, frm) >> 32) & (cache_num_shards - 1)]);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lookup_cache_slot
+// Description  : Find the entry holding a frame (the caller holds the shard's
+//                lock)
+//
+// Inputs       : shard - the shard the frame belongs to
+//                block - the block number of the frame
+//                frm - the frame number of the frame
+// Outputs      : index of the entry, -1 if the frame is not cached
+
+static int lookup_cache_slot(struct cache_shard *shard, BlockIndex block, BlockFrameIndex frm)
+{
+    int32_t slot;
+
+    if (shard->max_items == 0) {
+	    return (-1);
+    }
+
+    slot = shard->buckets[cache_hash(block, frm) >> (64 - shard->bucket_bits)];
+    for (; slot != -1; slot = shard->entries[slot].hash_next) {
+	    if ((shard->entries[slot].block_number == block) && (shard->entries[slot].frame_number == frm)) {
+		    return (slot);
+	    }
+    }
+
+    return (-1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unhash_cache_slot
+// Description  : Take an entry out of its hash bucket (the caller holds the
+//                shard's lock)
+//
+// Inputs       : shard - the shard of the entry
+//                slot - the index of the entry
+// Outputs      : none
+
+static void unhash_cache_slot(struct cache_shard *shard, int slot)
+{
+    struct cache_frame *entry = &shard->entries[slot];
+    int32_t *bucket = &shard->buckets[cache_hash(entry->block_number, entry->frame_number) >> (64 - shard->bucket_bits)];
+    int32_t prev = *bucket;
+
+    if (prev == slot) {
+	    *bucket = entry->hash_next;
+    }
+    else {
+	    while (shard->entries[prev].hash_next != slot) {
+		    prev = shard->entries[prev].hash_next;
+	    }
+	    shard->entries[prev].hash_next = entry->hash_next;
+    }
+    entry->hash_next = -1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : list_unlink
+// Description  : Take an entry off the policy list it is on (the caller holds
+//                the shard's lock)
+//
+// Inputs       : shard - the shard of the entry
+//                slot - the index of the entry
+// Outputs      : none
+
+static void list_unlink(struct cache_shard *shard, int slot)
+{
+    struct cache_frame *entry = &shard->entries[slot];
+    struct cache_list *list = &shard->lists[entry->list];
+
+    if (entry->list_prev != -1) {
+	    shard->entries[entry->list_prev].list_next = entry->list_next;
+    }
+    else {
+	    list->head = entry->list_next;
+    }
+
+    if (entry->list_next != -1) {
+	    shard->entries[entry->list_next].list_prev = entry->list_prev;
+    }
+    else {
+	    list->tail = entry->list_prev;
+    }
+    list->size--;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : list_push_front
+// Description  : Put an entry at the head of a policy list (the caller holds
+//                the shard's lock)
+//
+// Inputs       : shard - the shard of the entry
+//                which - the list to put it on
+//                slot - the index of the entry, not on any list
+// Outputs      : none
+
+static void list_push_front(struct cache_shard *shard, int which, int slot)
+{
+    struct cache_list *list = &shard->lists[which];
+
+    shard->entries[slot].list = which;
+    shard->entries[slot].list_prev = -1;
+    shard->entries[slot].list_next = list->head;
+    if (list->head != -1) {
+	    shard->entries[list->head].list_prev = slot;
+    }
+    else {
+	    list->tail = slot;
+    }
+    list->head = slot;
+    list->size++;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : list_move_front
+// Description  : Move an entry to the head of a policy list (the caller holds
+//                the shard's lock)
+//
+// Inputs       : shard - the shard of the entry
+//                which - the list to move it to
+//                slot - the index of the entry
+// Outputs      : none
+
+static void list_move_front(struct cache_shard *shard, int which, int slot)
+{
+    list_unlink(shard, slot);
+    list_push_front(shard, which, slot);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : ghost_init
+// Description  : Allocate a ghost list, the keys of frames evicted recently
+//
+// Inputs       : ghost - the ghost list
+//                capacity - the most keys it remembers
+// Outputs      : 0 if successful, -1 if failure
+
+static int ghost_init(struct cache_ghost *ghost, uint32_t capacity)
+{
+    uint32_t buckets;
+
+    ghost->capacity = capacity;
+    if (capacity == 0) {
+	    return (0);
+    }
+
+    ghost->bucket_bits = 1;
+    while (((uint32_t) 1 << ghost->bucket_bits) < capacity) {
+	    ghost->bucket_bits++;
+    }
+    buckets = (uint32_t) 1 << ghost->bucket_bits;
+
+    ghost->keys = malloc(capacity * sizeof(uint32_t));
+    ghost->chain = malloc(capacity * sizeof(int32_t));
+    ghost->buckets = malloc(buckets * sizeof(int32_t));
+    if ((ghost->keys == NULL) || (ghost->chain == NULL) || (ghost->buckets == NULL)) {
+	    return (-1);
+    }
+
+    // Every position starts out forgotten
+    for (uint32_t i = 0; i < capacity; i++) {
+	    ghost->chain[i] = BLOCK_CACHE_GHOST_FORGOTTEN;
+    }
+    memset(ghost->buckets, 0xff, buckets * sizeof(int32_t));
+
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : ghost_find
+// Description  : Find a key in a ghost list, and optionally unlink it from its
+//                bucket (the caller holds the shard's lock)
+//
+// Inputs       : ghost - the ghost list
+//                key - (block << 16) | frame
+//                forget - non-zero to take the key out of the list
+// Outputs      : 1 if the key was in the list, 0 if not
+
+static int ghost_find(struct cache_ghost *ghost, uint32_t key, int forget)
+{
+    int32_t *link;
+
+    if (ghost->capacity == 0) {
+	    return (0);
+    }
+
+    link = &ghost->buckets[(key * 2654435769u) >> (32 - ghost->bucket_bits)];
+    while ((*link != -1) && (ghost->keys[*link] != key)) {
+	    link = &ghost->chain[*link];
+    }
+    if (*link == -1) {
+	    return (0);
+    }
+
+    if (forget) {
+	    int32_t pos = *link;
+
+	    *link = ghost->chain[pos];
+	    ghost->chain[pos] = BLOCK_CACHE_GHOST_FORGOTTEN;
+	    ghost->size--;
+    }
+
+    return (1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : ghost_remember
+// Description  : Add the key of an evicted frame to a ghost list, dropping the
+//                oldest key if the list is full (the caller holds the shard's
+//                lock)
+//
+// Inputs       : ghost - the ghost list
+//                key - (block << 16) | frame
+// Outputs      : none
+
+static void ghost_remember(struct cache_ghost *ghost, uint32_t key)
+{
+    uint32_t pos = ghost->next_key;
+    int32_t *bucket;
+
+    if (ghost->capacity == 0) {
+	    return;
+    }
+
+    // The keys are kept in a ring, the position written next holds the oldest key
+    if (ghost->chain[pos] != BLOCK_CACHE_GHOST_FORGOTTEN) {
+	    ghost_find(ghost, ghost->keys[pos], 1);
+    }
+
+    ghost->keys[pos] = key;
+    bucket = &ghost->buckets[(key * 2654435769u) >> (32 - ghost->bucket_bits)];
+    ghost->chain[pos] = *bucket;
+    *bucket = pos;
+    ghost->size++;
+    ghost->next_key = (pos + 1) % ghost->capacity;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : ghost_forget_oldest
+// Description  : Drop the oldest key a ghost list still remembers (the caller
+//                holds the shard's lock)
+//
+// Inputs       : ghost - the ghost list
+// Outputs      : none
+
+static void ghost_forget_oldest(struct cache_ghost *ghost)
+{
+    uint32_t pos = ghost->next_key;
+
+    if (ghost->size == 0) {
+	    return;
+    }
+
+    // Keys forgotten out of order leave gaps in the ring, skip over them
+    while (ghost->chain[pos] == BLOCK_CACHE_GHOST_FORGOTTEN) {
+	    pos = (pos + 1) % ghost->capacity;
+    }
+    ghost_find(ghost, ghost->keys[pos], 1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : policy_remove
+// Description  : Take an entry out of the replacement policy, remembering its
+//                key in the ghost list of its policy list if it was evicted
+//                (the caller holds the shard's lock)
+//
+// Inputs       : shard - the shard of the entry
+//                slot - the index of the entry
+//                evicted - non-zero if the entry makes room for another frame,
+//                          zero if its frame was dropped
+// Outputs      : none
+
+static void policy_remove(struct cache_shard *shard, int slot, int evicted)
+{
+    struct cache_frame *entry = &shard->entries[slot];
+    int ghost = block_cache_policy->ghost_of_list[entry->list];
+
+    if (evicted && (ghost != -1)) {
+	    ghost_remember(&shard->ghosts[ghost], CACHE_KEY(entry->block_number, entry->frame_number));
+    }
+    list_unlink(shard, slot);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : sketch_init
+// Description  : Allocate the frequency sketch of a shard, the admission
+//                filter estimates how often frames are used from it
+//
+// Inputs       : sketch - the sketch
+//                max_items - the entries of the shard
+// Outputs      : 0 if successful, -1 if failure
+
+static int sketch_init(struct cache_sketch *sketch, uint32_t max_items)
+{
+    // A row has a counter for every entry of the shard, rounded up to a whole word of counters
+    sketch->width = 16;
+    while (sketch->width < max_items) {
+	    sketch->width *= 2;
+    }
+    sketch->samples = 0;
+    sketch->sample_size = (max_items > 0) ? max_items * BLOCK_CACHE_SKETCH_SAMPLE_FACTOR : 1;
+
+    sketch->table = calloc(BLOCK_CACHE_SKETCH_DEPTH * sketch->width / 16, sizeof(uint64_t));
+    return ((sketch->table == NULL) ? -1 : 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : sketch_counter
+// Description  : Find the 4-bit counter of a key in one row of a sketch
+//
+// Inputs       : sketch - the sketch
+//                key - (block << 16) | frame
+//                row - the row of the sketch
+// Outputs      : index of the counter in the table
+
+static uint32_t sketch_counter(struct cache_sketch *sketch, uint32_t key, int row)
+{
+    // Each row probes with a different multiple of a second hash, so keys colliding in one row rarely collide in all
+    uint64_t hash = key * 0x9E3779B97F4A7C15ull;
+    uint32_t h1 = (uint32_t) (hash >> 32);
+    uint32_t h2 = (uint32_t) (hash >> 16) | 1;
+
+    return (row * sketch->width + ((h1 + row * h2) & (sketch->width - 1)));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : sketch_record
+// Description  : Count a use of a frame in the sketch, halving every counter
+//                once enough uses have been counted so the sketch follows
+//                changes in the working set (the caller holds the shard's
+//                lock)
+//
+// Inputs       : sketch - the sketch, with no table if admission is off
+//                key - (block << 16) | frame
+// Outputs      : none
+
+static void sketch_record(struct cache_sketch *sketch, uint32_t key)
+{
+    uint32_t counter;
+    uint32_t words;
+
+    if (sketch->table == NULL) {
+	    return;
+    }
+
+    for (int row = 0; row < BLOCK_CACHE_SKETCH_DEPTH; row++) {
+	    counter = sketch_counter(sketch, key, row);
+	    if (((sketch->table[counter / 16] >> (counter % 16 * 4)) & 0xf) < BLOCK_CACHE_SKETCH_MAX) {
+		    sketch->table[counter / 16] += (uint64_t) 1 << (counter % 16 * 4);
+	    }
+    }
+
+    // Shift every counter of a word right at once, masking off the bit each one takes from its neighbour
+    if (++sketch->samples >= sketch->sample_size) {
+	    words = BLOCK_CACHE_SKETCH_DEPTH * sketch->width / 16;
+	    for (uint32_t i = 0; i < words; i++) {
+		    sketch->table[i] = (sketch->table[i] >> 1) & 0x7777777777777777ull;
+	    }
+	    sketch->samples /= 2;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : sketch_estimate
+// Description  : Estimate how often a frame has been used lately, the
+//                smallest of its counters (the caller holds the shard's lock)
+//
+// Inputs       : sketch - the sketch
+//                key - (block << 16) | frame
+// Outputs      : the estimate, 0 to BLOCK_CACHE_SKETCH_MAX
+
+static uint32_t sketch_estimate(struct cache_sketch *sketch, uint32_t key)
+{
+    uint32_t estimate = BLOCK_CACHE_SKETCH_MAX;
+    uint32_t counter;
+    uint32_t count;
+
+    for (int row = 0; row < BLOCK_CACHE_SKETCH_DEPTH; row++) {
+	    counter = sketch_counter(sketch, key, row);
+	    count = (sketch->table[counter / 16] >> (counter % 16 * 4)) & 0xf;
+	    estimate = (count < estimate) ? count : estimate;
+    }
+
+    return (estimate);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lru_hit
+// Description  : LRU: a used entry becomes the most recently used
+//
+// Inputs       : shard - the shard of the entry
+//                slot - the index of the entry
+// Outputs      : none
+
+static void lru_hit(struct cache_shard *shard, int slot)
+{
+    list_move_front(shard, 0, slot);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lru_insert
+// Description  : LRU: a new entry is the most recently used
+//
+// Inputs       : shard - the shard of the entry
+//                slot - the index of the entry
+// Outputs      : none
+
+static void lru_insert(struct cache_shard *shard, int slot)
+{
+    list_push_front(shard, 0, slot);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lru_victim
+// Description  : LRU: evict the least recently used entry
+//
+// Inputs       : shard - the shard to evict from
+//                key - the frame that needs the room
+// Outputs      : index of the entry to evict
+
+static int lru_victim(struct cache_shard *shard, uint32_t key)
+{
+    (void) key;
+    return (shard->lists[0].tail);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : clock_hit
+// Description  : CLOCK: a used entry gets its reference bit set, it does not
+//                move
+//
+// Inputs       : shard - the shard of the entry
+//                slot - the index of the entry
+// Outputs      : none
+
+static void clock_hit(struct cache_shard *shard, int slot)
+{
+    shard->entries[slot].ref = 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : clock_insert
+// Description  : CLOCK: a new entry goes in just behind the hand, unreferenced
+//
+// Inputs       : shard - the shard of the entry
+//                slot - the index of the entry
+// Outputs      : none
+
+static void clock_insert(struct cache_shard *shard, int slot)
+{
+    shard->entries[slot].ref = 0;
+    list_push_front(shard, 0, slot);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : clock_victim
+// Description  : CLOCK: sweep the hand (the tail of the list), clearing the
+//                reference bits it passes, and evict the first entry without
+//                one
+//
+// Inputs       : shard - the shard to evict from
+//                key - the frame that needs the room
+// Outputs      : index of the entry to evict
+
+static int clock_victim(struct cache_shard *shard, uint32_t key)
+{
+    int32_t slot;
+
+    (void) key;
+
+    while (shard->entries[slot = shard->lists[0].tail].ref) {
+	    shard->entries[slot].ref = 0;
+	    list_move_front(shard, 0, slot);
+    }
+
+    return (slot);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : twoq_hit
+// Description  : 2Q: a used entry of the main LRU list becomes its most
+//                recently used, entries still in the FIFO stay where they are
+//
+// Inputs       : shard - the shard of the entry
+//                slot - the index of the entry
+// Outputs      : none
+
+static void twoq_hit(struct cache_shard *shard, int slot)
+{
+    if (shard->entries[slot].list == 1) {
+	    list_move_front(shard, 1, slot);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : twoq_insert
+// Description  : 2Q: a frame evicted from the FIFO not long ago has been used
+//                twice and goes on the main LRU list, any other goes in the
+//                FIFO, so a scan only ever passes through the FIFO
+//
+// Inputs       : shard - the shard of the entry
+//                slot - the index of the entry
+// Outputs      : none
+
+static void twoq_insert(struct cache_shard *shard, int slot)
+{
+    struct cache_frame *entry = &shard->entries[slot];
+
+    if (ghost_find(&shard->ghosts[0], CACHE_KEY(entry->block_number, entry->frame_number), 1)) {
+	    list_push_front(shard, 1, slot);
+    }
+    else {
+	    list_push_front(shard, 0, slot);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : twoq_victim
+// Description  : 2Q: evict from the FIFO while it is over its share of the
+//                shard, from the main LRU list otherwise
+//
+// Inputs       : shard - the shard to evict from
+//                key - the frame that needs the room
+// Outputs      : index of the entry to evict
+
+static int twoq_victim(struct cache_shard *shard, uint32_t key)
+{
+    (void) key;
+    if ((shard->lists[0].size > 0) && ((shard->lists[0].size > shard->target) || (shard->lists[1].size == 0))) {
+	    return (shard->lists[0].tail);
+    }
+
+    return (shard->lists[1].tail);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : arc_hit
+// Description  : ARC: a used entry has been seen at least twice, so it becomes
+//                the most recently used of T2
+//
+// Inputs       : shard - the shard of the entry
+//                slot - the index of the entry
+// Outputs      : none
+
+static void arc_hit(struct cache_shard *shard, int slot)
+{
+    list_move_front(shard, 1, slot);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : arc_insert
+// Description  : ARC: a frame found in a ghost list goes in T2 and moves the
+//                target size of T1 towards the list it was found in, any
+//                other frame goes in T1
+//
+// Inputs       : shard - the shard of the entry
+//                slot - the index of the entry
+// Outputs      : none
+
+static void arc_insert(struct cache_shard *shard, int slot)
+{
+    struct cache_frame *entry = &shard->entries[slot];
+    uint32_t key = CACHE_KEY(entry->block_number, entry->frame_number);
+    uint32_t delta;
+
+    if (ghost_find(&shard->ghosts[0], key, 1)) {
+	    // Evicted from T1 too soon, give T1 more of the shard
+	    delta = shard->ghosts[1].size / (shard->ghosts[0].size + 1);
+	    delta = (delta > 1) ? delta : 1;
+	    shard->target = (shard->target + delta < shard->max_items) ? shard->target + delta : shard->max_items;
+	    list_push_front(shard, 1, slot);
+    }
+    else if (ghost_find(&shard->ghosts[1], key, 1)) {
+	    // Evicted from T2 too soon, give T2 more of the shard
+	    delta = shard->ghosts[0].size / (shard->ghosts[1].size + 1);
+	    delta = (delta > 1) ? delta : 1;
+	    shard->target = (shard->target > delta) ? shard->target - delta : 0;
+	    list_push_front(shard, 1, slot);
+    }
+    else {
+	    // T1 and its ghosts together cover no more frames than the shard holds
+	    if (shard->lists[0].size + shard->ghosts[0].size >= shard->max_items) {
+		    ghost_forget_oldest(&shard->ghosts[0]);
+	    }
+	    list_push_front(shard, 0, slot);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : arc_victim
+// Description  : ARC: evict from T1 while it is over its target size, from T2
+//                otherwise
+//
+// Inputs       : shard - the shard to evict from
+//                key - the frame that needs the room
+// Outputs      : index of the entry to evict
+
+static int arc_victim(struct cache_shard *shard, uint32_t key)
+{
+    uint32_t t1 = shard->lists[0].size;
+
+    if ((t1 > 0) && ((t1 > shard->target) || (shard->lists[1].size == 0) ||
+	((t1 == shard->target) && ghost_find(&shard->ghosts[1], key, 0)))) {
+	    return (shard->lists[0].tail);
+    }
+
+    return (shard->lists[1].tail);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : s3fifo_hit
+// Description  : S3-FIFO: count the use, entries do not move on a hit
+//
+// Inputs       : shard - the shard of the entry
+//                slot - the index of the entry
+// Outputs      : none
+
+static void s3fifo_hit(struct cache_shard *shard, int slot)
+{
+    if (shard->entries[slot].ref < BLOCK_CACHE_S3FIFO_MAX_FREQ) {
+	    shard->entries[slot].ref++;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : s3fifo_insert
+// Description  : S3-FIFO: a frame found in the ghost list goes straight in the
+//                main FIFO, any other goes in the small FIFO
+//
+// Inputs       : shard - the shard of the entry
+//                slot - the index of the entry
+// Outputs      : none
+
+static void s3fifo_insert(struct cache_shard *shard, int slot)
+{
+    struct cache_frame *entry = &shard->entries[slot];
+
+    entry->ref = 0;
+    if (ghost_find(&shard->ghosts[0], CACHE_KEY(entry->block_number, entry->frame_number), 1)) {
+	    list_push_front(shard, 1, slot);
+    }
+    else {
+	    list_push_front(shard, 0, slot);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : s3fifo_victim
+// Description  : S3-FIFO: the small FIFO is drained while it is over its share
+//                of the shard, an entry used while in it moves to the main
+//                FIFO, one that was not is evicted. The main FIFO gives each
+//                use a pass around it before evicting
+//
+// Inputs       : shard - the shard to evict from
+//                key - the frame that needs the room
+// Outputs      : index of the entry to evict
+
+static int s3fifo_victim(struct cache_shard *shard, uint32_t key)
+{
+    int32_t slot;
+
+    (void) key;
+
+    while (1) {
+	    if ((shard->lists[0].size > 0) && ((shard->lists[0].size >= shard->target) || (shard->lists[1].size == 0))) {
+		    slot = shard->lists[0].tail;
+		    if (shard->entries[slot].ref == 0) {
+			    return (slot);
+		    }
+		    shard->entries[slot].ref = 0;
+		    list_move_front(shard, 1, slot);
+	    }
+	    else {
+		    slot = shard->lists[1].tail;
+		    if (shard->entries[slot].ref == 0) {
+			    return (slot);
+		    }
+		    shard->entries[slot].ref--;
+		    list_move_front(shard, 1, slot);
+	    }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : find_cache_slot
+// Description  : Find the entry holding a frame, or give the frame an entry,
+//                evicting the entry the replacement policy picks if the shard
+//                is full. Either way the policy counts it as a use. The caller
+//                holds the shard's lock and has already counted the use in the
+//                shard's sketch
+//
+// Inputs       : shard - the shard the frame belongs to
+//                block - the block number of the frame
+//                frm - the frame number of the frame
+// Outputs      : index of the entry, -1 if failure or the admission filter
+//                turned the frame away
+
+static int find_cache_slot(struct cache_shard *shard, BlockIndex block, BlockFrameIndex frm)
+{
+    struct cache_frame *entry;
+    int32_t *bucket;
+    int32_t slot;
+
+    // Frames are identified by their block and their frame number within the block
+    if ((slot = lookup_cache_slot(shard, block, frm)) != -1) {
+	    // We found this frame in the cache!
+	    block_cache_policy->hit(shard, slot);
+	    return (slot);
+    }
+
+    // The frame is not in the cache, so it needs an entry: a dropped one, a new one, or the one the policy evicts
+    if (shard->free_slots != -1) {
+	    slot = shard->free_slots;
+	    shard->free_slots = shard->entries[slot].hash_next;
+    }
+    else if (shard->indeces_used < shard->max_items) {
+	    // There's room at the indeces_usedth index! Its frame is already in the arena
+	    slot = shard->indeces_used++;
+    }
+    else if (shard->max_items == 0) {
+	    return (-1);
+    }
+
+    // There is no free room, so the policy picks the victim
+    // A dirty frame has to reach the device before its entry can be reused
+    else {
+	    slot = block_cache_policy->victim(shard, CACHE_KEY(block, frm));
+	    entry = &shard->entries[slot];
+
+	    // The admission filter keeps the victim unless the new frame looks more popular, before it is written out
+	    if (cache_admission && (sketch_estimate(&shard->sketch, CACHE_KEY(block, frm)) <=
+		sketch_estimate(&shard->sketch, CACHE_KEY(entry->block_number, entry->frame_number)))) {
+		    return (-1);
+	    }
+
+	    if (clean_cache_slot(shard, slot) == -1) {
+		    return (-1);
+	    }
+	    policy_remove(shard, slot, 1);
+	    unhash_cache_slot(shard, slot);
+    }
+
+    entry = &shard->entries[slot];
+    entry->block_number = block;
+    entry->frame_number = frm;
+    bucket = &shard->buckets[cache_hash(block, frm) >> (64 - shard->bucket_bits)];
+    entry->hash_next = *bucket;
+    *bucket = slot;
+    block_cache_policy->insert(shard, slot);
+
+    return (slot);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : count_dirty_frames
+// Description  : Adjust the number of dirty frames, waking the flusher past
+//                the low watermark and writers below the high one
+//
+// Inputs       : change - +1 when an entry turns dirty, -1 when it turns clean
+// Outputs      : none
+
+static void count_dirty_frames(int32_t change)
+{
+    pthread_mutex_lock(&dirty_lock);
+    cache_dirty_frames += change;
+
+    // Past the low watermark the flusher starts trickling frames out
+    if ((change > 0) && flusher_running && (cache_dirty_frames > dirty_low_watermark)) {
+	    pthread_cond_signal(&flusher_wake);
+    }
+
+    // Writers waiting on the high watermark may be able to go on
+    if ((change < 0) && (cache_dirty_frames < dirty_high_watermark)) {
+	    pthread_cond_broadcast(&writers_wake);
+    }
+    pthread_mutex_unlock(&dirty_lock);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_slot_dirty
+// Description  : Check whether the frame of an entry changed since it was last
+//                written to the device (the caller holds the shard's lock)
+//
+// Inputs       : shard - the shard of the entry
+//                slot - the index of the entry
+// Outputs      : 1 if the entry is dirty, 0 if not
+
+static int cache_slot_dirty(struct cache_shard *shard, int slot)
+{
+    return ((shard->dirty_map[slot / 64] >> (slot % 64)) & 1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : mark_cache_slot
+// Description  : Set or clear the dirty bit of an entry, counting the change
+//                (the caller holds the shard's lock)
+//
+// Inputs       : shard - the shard of the entry
+//                slot - the index of the entry
+//                dirty - 1 if the entry turns dirty, 0 if it turns clean
+// Outputs      : none
+
+static void mark_cache_slot(struct cache_shard *shard, int slot, int dirty)
+{
+    if (cache_slot_dirty(shard, slot) == dirty) {
+	    return;
+    }
+
+    shard->dirty_map[slot / 64] ^= (uint64_t) 1 << (slot % 64);
+    shard->num_dirty += dirty ? 1 : -1;
+    count_dirty_frames(dirty ? 1 : -1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : clean_cache_slot
+// Description  : Write the frame of an entry to the device if it is dirty
+//                (the caller holds the shard's lock)
+//
+// Inputs       : shard - the shard of the entry
+//                slot - the index of the entry
+// Outputs      : 0 if successful, -1 if failure
+
+static int clean_cache_slot(struct cache_shard *shard, int slot)
+{
+    struct cache_frame *entry = &shard->entries[slot];
+
+    if (!cache_slot_dirty(shard, slot)) {
+	    return (0);
+    }
+
+    if ((cache_flusher == NULL) ||
+	(cache_flusher(entry->block_number, entry->frame_number, cache_slot_frame(shard, slot)) == -1)) {
+	    return (-1);
+    }
+
+    mark_cache_slot(shard, slot, 0);
+
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : compare_dirty_keys
+// Description  : qsort comparison of two (block << 16) | frame keys
+//
+// Inputs       : a, b - pointers to the keys
+// Outputs      : <0, 0 or >0 as a is before, at or after b
+
+static int compare_dirty_keys(const void *a, const void *b)
+{
+    uint32_t ka = *(const uint32_t *) a;
+    uint32_t kb = *(const uint32_t *) b;
+
+    return ((ka > kb) - (ka < kb));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : snapshot_dirty_frames
+// Description  : Collect the device addresses of the dirty frames from the
+//                shards' dirty maps and sort them, the sweep starts from the
+//                first address at or after flush_cursor (the caller holds
+//                flush_lock)
+//
+// Inputs       : none
+// Outputs      : the number of addresses in the snapshot
+
+static uint32_t snapshot_dirty_frames(void)
+{
+    struct cache_shard *shard;
+    uint64_t bits;
+    int slot;
+
+    flush_order_size = 0;
+    for (uint32_t i = 0; i < cache_num_shards; i++) {
+	    shard = &cache_shards[i];
+	    pthread_mutex_lock(&shard->lock);
+	    for (uint32_t word = 0; (shard->num_dirty > 0) && (word * 64 < shard->indeces_used); word++) {
+		    for (bits = shard->dirty_map[word]; bits != 0; bits &= bits - 1) {
+			    slot = word * 64 + __builtin_ctzll(bits);
+			    flush_order[flush_order_size++] =
+				CACHE_KEY(shard->entries[slot].block_number, shard->entries[slot].frame_number);
+		    }
+	    }
+	    pthread_mutex_unlock(&shard->lock);
+    }
+    qsort(flush_order, flush_order_size, sizeof(uint32_t), compare_dirty_keys);
+
+    // Pick the sweep up where it left off, wrapping around to the lowest address
+    flush_order_start = 0;
+    while ((flush_order_start < flush_order_size) && (flush_order[flush_order_start] < flush_cursor)) {
+	    flush_order_start++;
+    }
+    flush_order_next = 0;
+
+    return (flush_order_size);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : flush_dirty_frames
+// Description  : Write up to max_frames dirty frames in the order they sit on
+//                the device, continuing the sweep from flush_cursor so the
+//                writes within a block stay together. Only the shard of the
+//                frame being written is locked while it is written
+//
+// Inputs       : max_frames - the most frames to write
+// Outputs      : 0 if successful, -1 if failure
+
+static int flush_dirty_frames(uint32_t max_frames)
+{
+    struct cache_shard *shard;
+    int snapshots = 0;
+    uint32_t key;
+    int slot;
+    int ret = 0;
+
+    pthread_mutex_lock(&flush_lock);
+    for (uint32_t n = 0; n < max_frames; n++) {
+	    // A used up snapshot is taken again at most once per call, so a flush ends while frames keep turning dirty
+	    if ((flush_order_next == flush_order_size) && ((snapshots++ > 0) || (snapshot_dirty_frames() == 0))) {
+		    break;
+	    }
+
+	    // A frame may have been written or dropped since the snapshot, then there is nothing to do for it
+	    key = flush_order[(flush_order_start + flush_order_next) % flush_order_size];
+	    shard = cache_shard_of(key >> 16, key & 0xffff);
+	    pthread_mutex_lock(&shard->lock);
+	    if ((slot = lookup_cache_slot(shard, key >> 16, key & 0xffff)) != -1) {
+		    ret = clean_cache_slot(shard, slot);
+	    }
+	    pthread_mutex_unlock(&shard->lock);
+	    if (ret == -1) {
+		    break;
+	    }
+	    flush_order_next++;
+	    flush_cursor = key + 1;
+    }
+
+    pthread_mutex_unlock(&flush_lock);
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : flusher_main
+// Description  : Background flusher, sleeps until dirty frames pass the low
+//                watermark, then writes them in batches until they are back
+//                under it
+//
+// Inputs       : arg - unused
+// Outputs      : NULL
+
+static void *flusher_main(void *arg)
+{
+    int ret;
+
+    (void) arg;
+    pthread_mutex_lock(&dirty_lock);
+    while (flusher_running) {
+	    if (cache_dirty_frames <= dirty_low_watermark) {
+		    pthread_cond_wait(&flusher_wake, &dirty_lock);
+		    continue;
+	    }
+
+	    // The batch locks one shard at a time, so the driver keeps using the rest of the cache meanwhile
+	    pthread_mutex_unlock(&dirty_lock);
+	    ret = flush_dirty_frames(BLOCK_CACHE_FLUSH_BATCH);
+	    pthread_mutex_lock(&dirty_lock);
+
+	    // A failed write leaves the frame dirty, so release the writers and wait for the next write to retry
+	    if ((ret == -1) && flusher_running) {
+		    flusher_stalled = 1;
+		    pthread_cond_broadcast(&writers_wake);
+		    pthread_cond_wait(&flusher_wake, &dirty_lock);
+		    flusher_stalled = 0;
+	    }
+    }
+    pthread_mutex_unlock(&dirty_lock);
+
+    return (NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : put_block_cache
+// Description  : Put an object into the frame cache, the frame matches what
+//                is on the device
+//
+// Inputs       : block - the block number of the frame to cache
+//                frm - the frame number of the frame to cache
+//                buf - the buffer to insert into the cache
+// Outputs      : 0 if successful, -1 if failure
+
+int put_block_cache(BlockIndex block, BlockFrameIndex frm, void* buf)
+{
+    struct cache_shard *shard = cache_shard_of(block, frm);
+    int slot;
+
+    pthread_mutex_lock(&shard->lock);
+    sketch_record(&shard->sketch, CACHE_KEY(block, frm));
+    if ((slot = find_cache_slot(shard, block, frm)) == -1) {
+	    pthread_mutex_unlock(&shard->lock);
+	    return (-1);
+    }
+
+    // Copy memory from buf to frames
+    memcpy(cache_slot_frame(shard, slot), buf, BLOCK_FRAME_SIZE);
+
+    // The device has this version of the frame, so it is clean
+    mark_cache_slot(shard, slot, 0);
+    pthread_mutex_unlock(&shard->lock);
+
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : write_block_cache
+// Description  : Put a modified frame into the cache. In write-back mode the
+//                frame is marked dirty and reaches the device when it is
+//                flushed or evicted, rewrites of it are absorbed in memory
+//
+// Inputs       : block - the block number of the frame
+//                frm - the frame number of the frame
+//                buf - the new contents of the frame
+// Outputs      : 1 if the cache will write the frame, 0 if the caller has to
+//                (write-through mode, or no room)
+
+int write_block_cache(BlockIndex block, BlockFrameIndex frm, void* buf)
+{
+    struct cache_shard *shard = cache_shard_of(block, frm);
+    int slot;
+
+    if (!cache_write_back) {
+	    return (0);
+    }
+
+    // Writers are held back while the flusher catches up to the high watermark
+    pthread_mutex_lock(&dirty_lock);
+    while (flusher_running && !flusher_stalled && (cache_dirty_frames >= dirty_high_watermark)) {
+	    pthread_cond_signal(&flusher_wake);
+	    pthread_cond_wait(&writers_wake, &dirty_lock);
+    }
+    pthread_mutex_unlock(&dirty_lock);
+
+    // If the cache can not make room the caller writes the frame through, without offering it to the cache again
+    pthread_mutex_lock(&shard->lock);
+    sketch_record(&shard->sketch, CACHE_KEY(block, frm));
+    if ((slot = find_cache_slot(shard, block, frm)) == -1) {
+	    pthread_mutex_unlock(&shard->lock);
+	    return (0);
+    }
+
+    memcpy(cache_slot_frame(shard, slot), buf, BLOCK_FRAME_SIZE);
+    mark_cache_slot(shard, slot, 1);
+    pthread_mutex_unlock(&shard->lock);
+
+    return (1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : get_block_cache
+// Description  : Get an frame from the cache (and return it). The frame may be
+//                replaced once another thread uses its shard, so threads
+//                sharing the cache use read_block_cache instead
+//
+// Inputs       : block - the block number of the block to find
+//                frm - the  number of the frame to find
+// Outputs      : pointer to cached frame or NULL if not found
+
+void* get_block_cache(BlockIndex block, BlockFrameIndex frm)
+{
+    struct cache_shard *shard = cache_shard_of(block, frm);
+    void *frame = NULL;
+    int slot;
+
+    // Look the frame up, a hit counts as a use for the replacement policy
+    pthread_mutex_lock(&shard->lock);
+    sketch_record(&shard->sketch, CACHE_KEY(block, frm));
+    if ((slot = lookup_cache_slot(shard, block, frm)) != -1) {
+	    // We found the frame!
+	    // Return the pointer
+	    block_cache_policy->hit(shard, slot);
+	    frame = cache_slot_frame(shard, slot);
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    return (frame);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : read_block_cache
+// Description  : Copy a frame out of the cache while its shard is locked
+//
+// Inputs       : block - the block number of the frame
+//                frm - the frame number of the frame
+//                buf - where to copy the frame
+// Outputs      : 0 if the frame was cached, -1 if not
+
+int read_block_cache(BlockIndex block, BlockFrameIndex frm, void* buf)
+{
+    struct cache_shard *shard = cache_shard_of(block, frm);
+    int slot;
+
+    // Misses are counted too, a frame read often earns its place in the cache when it is next written
+    pthread_mutex_lock(&shard->lock);
+    sketch_record(&shard->sketch, CACHE_KEY(block, frm));
+    if ((slot = lookup_cache_slot(shard, block, frm)) != -1) {
+	    block_cache_policy->hit(shard, slot);
+	    memcpy(buf, cache_slot_frame(shard, slot), BLOCK_FRAME_SIZE);
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    return ((slot == -1) ? -1 : 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : peek_block_cache
+// Description  : Copy a frame out of the cache without counting it as a use,
+//                for the read half of a read-modify-write whose write counts
+//
+// Inputs       : block - the block number of the frame
+//                frm - the frame number of the frame
+//                buf - where to copy the frame
+// Outputs      : 0 if the frame was cached, -1 if not
+
+int peek_block_cache(BlockIndex block, BlockFrameIndex frm, void* buf)
+{
+    struct cache_shard *shard = cache_shard_of(block, frm);
+    int slot;
+
+    pthread_mutex_lock(&shard->lock);
+    if ((slot = lookup_cache_slot(shard, block, frm)) != -1) {
+	    memcpy(buf, cache_slot_frame(shard, slot), BLOCK_FRAME_SIZE);
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    return ((slot == -1) ? -1 : 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : match_block_cache
+// Description  : Check whether the cache holds exactly these bytes for a
+//                frame
+//
+// Inputs       : block - the block number of the frame
+//                frm - the frame number of the frame
+//                buf - the contents to compare with
+// Outputs      : 1 if the frame is cached with the same contents, 0 if not
+
+int match_block_cache(BlockIndex block, BlockFrameIndex frm, void* buf)
+{
+    struct cache_shard *shard = cache_shard_of(block, frm);
+    int match = 0;
+    int slot;
+
+    pthread_mutex_lock(&shard->lock);
+    if ((slot = lookup_cache_slot(shard, block, frm)) != -1) {
+	    match = (memcmp(cache_slot_frame(shard, slot), buf, BLOCK_FRAME_SIZE) == 0);
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    return (match);
+}
 
+////////////////////////////////////////////////////////////////////////////////
 //
-// Functions
+// Function     : set_block_cache_write_back
+// Description  : Choose between write-through and write-back (must be called
+//                before init)
+//
+// Inputs       : enable - non-zero for write-back, zero for write-through
+// Outputs      : 0 if successful, -1 if failure
+
+int set_block_cache_write_back(int enable)
+{
+    if (init) {
+	    return (-1);
+    }
+
+    cache_write_back = (enable != 0);
+    return (0);
+}
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : set_block_cache_size
-// Description  : Set the size of the cache (must be called before init)
+// Function     : set_block_cache_huge_pages
+// Description  : Ask for the cache's frames to be backed by huge pages (must
+//                be called before init)
 //
-// Inputs       : max_frames - the maximum number of items your cache can hold
+// Inputs       : enable - non-zero to use huge pages, zero for normal pages
 // Outputs      : 0 if successful, -1 if failure
 
-int set_block_cache_size(uint32_t max_frames)
+int set_block_cache_huge_pages(int enable)
 {
-    // If the cache has already been initialized, then return an error
     if (init) {
 	    return (-1);
     }
 
-    // Set the cache length equal to max_frames
-    block_cache_max_items = max_frames;
+    cache_huge_pages = (enable != 0);
     return (0);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : init_block_cache
-// Description  : Initialize the cache and note maximum frames
+// Function     : set_block_cache_policy
+// Description  : Choose the replacement policy by name (must be called before
+//                init)
 //
-// Inputs       : none
+// Inputs       : name - "lru", "clock", "2q", "arc" or "s3fifo"
 // Outputs      : 0 if successful, -1 if failure
 
-int init_block_cache(void)
+int set_block_cache_policy(const char *name)
 {
-    // Initialize the cache
-    cache = malloc(block_cache_max_items * sizeof(struct cache_frame));
-    cache_indeces_used = 0;
-    init = 1;
+    if (init) {
+	    return (-1);
+    }
+
+    for (size_t i = 0; i < sizeof(cache_policies) / sizeof(cache_policies[0]); i++) {
+	    if (strcmp(cache_policies[i].name, name) == 0) {
+		    block_cache_policy = &cache_policies[i];
+		    return (0);
+	    }
+    }
+
+    return (-1);
+}
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : set_block_cache_admission
+// Description  : Turn the frequency-based admission filter on or off (must be
+//                called before init)
+//
+// Inputs       : enable - non-zero to filter frames, zero to admit every one
+// Outputs      : 0 if successful, -1 if failure
+
+int set_block_cache_admission(int enable)
+{
+    if (init) {
+	    return (-1);
+    }
+
+    cache_admission = (enable != 0);
     return (0);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : close_block_cache
-// Description  : Clear all of the contents of the cache, cleanup
+// Function     : set_block_cache_flusher
+// Description  : Set the function the cache calls to write a dirty frame to
+//                the device
+//
+// Inputs       : flusher - the function, it returns 0 if successful, -1 if failure
+// Outputs      : none
+
+void set_block_cache_flusher(int (*flusher)(BlockIndex blk, BlockFrameIndex frm, void* frame))
+{
+    // Set before any frame turns dirty, so no shard can be calling it yet
+    pthread_mutex_lock(&flush_lock);
+    cache_flusher = flusher;
+    pthread_mutex_unlock(&flush_lock);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : flush_block_cache_frame
+// Description  : Write a frame to the device if it is dirty in the cache
+//
+// Inputs       : block - the block number of the frame
+//                frm - the frame number of the frame
+// Outputs      : 0 if successful, -1 if failure
+
+int flush_block_cache_frame(BlockIndex block, BlockFrameIndex frm)
+{
+    struct cache_shard *shard = cache_shard_of(block, frm);
+    int ret = 0;
+    int slot;
+
+    pthread_mutex_lock(&shard->lock);
+    if ((slot = lookup_cache_slot(shard, block, frm)) != -1) {
+	    ret = clean_cache_slot(shard, slot);
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : flush_block_cache_matching
+// Description  : Write the dirty frames a function picks to the device, in the
+//                order they sit on the device. Only the dirty frames are
+//                offered to the function
+//
+// Inputs       : match - returns non-zero for a frame that should be written
+//                arg - passed on to match
+// Outputs      : 0 if successful, -1 if failure
+
+int flush_block_cache_matching(int (*match)(BlockIndex blk, BlockFrameIndex frm, void *arg), void *arg)
+{
+    struct cache_shard *shard;
+    uint32_t key;
+    int slot;
+    int ret = 0;
+
+    // The flusher's snapshot is borrowed, its sweep takes a new one next time from where it left off
+    pthread_mutex_lock(&flush_lock);
+    snapshot_dirty_frames();
+    for (uint32_t i = 0; (i < flush_order_size) && (ret == 0); i++) {
+	    key = flush_order[i];
+	    if (!match(key >> 16, key & 0xffff, arg)) {
+		    continue;
+	    }
+	    shard = cache_shard_of(key >> 16, key & 0xffff);
+	    pthread_mutex_lock(&shard->lock);
+	    if ((slot = lookup_cache_slot(shard, key >> 16, key & 0xffff)) != -1) {
+		    ret = clean_cache_slot(shard, slot);
+	    }
+	    pthread_mutex_unlock(&shard->lock);
+    }
+    flush_order_next = flush_order_size;
+    pthread_mutex_unlock(&flush_lock);
+
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : flush_block_cache
+// Description  : Write every dirty frame in the cache to the device, in the
+//                order they sit on the device
 //
 // Inputs       : none
-// Outputs      : o if successful, -1 if failure
+// Outputs      : 0 if successful, -1 if failure
 
-int close_block_cache(void)
+int flush_block_cache(void)
+{
+    // Drain from the lowest address, the flusher has usually written most of them already. The snapshot the
+    // flusher is working through may miss frames that turned dirty since, so a new one is taken
+    pthread_mutex_lock(&flush_lock);
+    flush_cursor = 0;
+    flush_order_next = flush_order_size;
+    pthread_mutex_unlock(&flush_lock);
+
+    return (flush_dirty_frames(UINT32_MAX));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : invalidate_block_cache
+// Description  : Drop a frame from the cache without writing it, for frames
+//                that no longer hold file data
+//
+// Inputs       : block - the block number of the frame
+//                frm - the frame number of the frame
+// Outputs      : none
+
+void invalidate_block_cache(BlockIndex block, BlockFrameIndex frm)
 {
-    for (int i = 0; i < block_cache_max_items; i++) {
-	    cache[i].frame_number = 0;
-	    free(cache[i].frame);
-	    cache[i].frame = NULL;
-	    cache[i].calls_since_use = 0;
+    struct cache_shard *shard = cache_shard_of(block, frm);
+    int slot;
+
+    pthread_mutex_lock(&shard->lock);
+    if ((slot = lookup_cache_slot(shard, block, frm)) != -1) {
+	    mark_cache_slot(shard, slot, 0);
+
+	    // The entry goes on the free list for the next miss, a dropped frame is not worth remembering
+	    policy_remove(shard, slot, 0);
+	    unhash_cache_slot(shard, slot);
+	    shard->entries[slot].hash_next = shard->free_slots;
+	    shard->free_slots = slot;
     }
+    pthread_mutex_unlock(&shard->lock);
+}
 
-    free(cache);
-    cache = NULL;
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_cache_write_back
+// Description  : Whether the cache keeps modified frames and writes them later
+//
+// Inputs       : none
+// Outputs      : 1 in write-back mode, 0 in write-through mode
+
+int block_cache_write_back(void)
+{
+    return (cache_write_back);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_cache_dirty_frames
+// Description  : Number of dirty frames in the cache
+//
+// Inputs       : none
+// Outputs      : the number of dirty frames
+
+uint32_t block_cache_dirty_frames(void)
+{
+    uint32_t dirty;
+
+    pthread_mutex_lock(&dirty_lock);
+    dirty = cache_dirty_frames;
+    pthread_mutex_unlock(&dirty_lock);
+
+    return (dirty);
+}
+
+
+//
+// Unit test
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_unit_check
+// Description  : Log a check of the unit test that failed
+//
+// Inputs       : ok - non-zero if the check passed
+//                what - what was checked
+// Outputs      : 0 if the check passed, -1 if not
+
+static int cache_unit_check(int ok, const char *what)
+{
+    if (!ok) {
+	    logMessage(LOG_ERROR_LEVEL, "Cache unit test failed: %s", what);
+	    return (-1);
+    }
 
-    init = 0;
-    
     return (0);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : put_block_cache
-// Description  : Put an object into the frame cache
+// Function     : cache_unit_start
+// Description  : Close the cache and start it again configured for a check,
+//                with the unit test's flusher
 //
-// Inputs       : block - the block number of the frame to cache
-//                frm - the frame number of the frame to cache
-//                buf - the buffer to insert into the cache
+// Inputs       : policy - the replacement policy
+//                write_back - non-zero for write-back
+//                admission - non-zero for the admission filter
+//                size - the number of frames
 // Outputs      : 0 if successful, -1 if failure
 
-int put_block_cache(BlockIndex block, BlockFrameIndex frm, void* buf)
+static int cache_unit_start(const char *policy, int write_back, int admission, uint32_t size)
+{
+    close_block_cache();
+    if ((set_block_cache_policy(policy) == -1) || (set_block_cache_write_back(write_back) == -1) ||
+	(set_block_cache_admission(admission) == -1) || (set_block_cache_size(size) == -1)) {
+	    return (-1);
+    }
+    set_block_cache_flusher(cache_unit_flusher);
+    cache_unit_flushed = 0;
+    cache_unit_last_key = 0;
+    cache_unit_out_of_order = 0;
+
+    return (init_block_cache());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_unit_flusher
+// Description  : Flusher of the unit test, checks the frame it is handed and
+//                counts it instead of writing it
+//
+// Inputs       : blk - the block of the frame
+//                frm - the frame number of the frame
+//                frame - the contents of the frame
+// Outputs      : 0 if successful, -1 if the frame does not hold what the test wrote
+
+static int cache_unit_flusher(BlockIndex blk, BlockFrameIndex frm, void* frame)
+{
+    // The sweeps are serialized by flush_lock, so this runs on one thread at a time
+    if ((cache_unit_flushed > 0) && (CACHE_KEY(blk, frm) <= cache_unit_last_key)) {
+	    cache_unit_out_of_order = 1;
+    }
+    cache_unit_last_key = CACHE_KEY(blk, frm);
+    cache_unit_flushed++;
+
+    return ((((char *) frame)[0] == (char) frm) ? 0 : -1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_unit_test_flusher
+// Description  : Check that writers never get past the high watermark, that
+//                the background flusher brings the dirty frames down to the
+//                low watermark, and that a flush writes the rest in device
+//                order
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+static int cache_unit_test_flusher(void)
 {
-    // It's my understanding that block is irrelevant
+    char frame[BLOCK_FRAME_SIZE];
+    uint32_t dirty;
+    int ret = 0;
+    int waited;
+
+    ret |= cache_unit_check(cache_unit_start("lru", 1, 0, 100) == 0, "start a write-back cache");
+    for (int frm = 99; frm >= 0; frm--) {
+	    memset(frame, frm, BLOCK_FRAME_SIZE);
+	    ret |= cache_unit_check(write_block_cache(0, frm, frame) == 1, "write a frame to a write-back cache");
+	    ret |= cache_unit_check(block_cache_dirty_frames() <= dirty_high_watermark, "writers wait at the high watermark");
+    }
+
+    // The flusher trickles frames out until it is back at the low watermark
+    for (waited = 0; (waited < 1000) && (block_cache_dirty_frames() > dirty_low_watermark); waited++) {
+	    usleep(1000);
+    }
+    pthread_mutex_lock(&flush_lock);
+    dirty = block_cache_dirty_frames();
+    ret |= cache_unit_check((dirty <= dirty_low_watermark) && (cache_unit_flushed == 100 - dirty), "the flusher stops at the low watermark");
+    pthread_mutex_unlock(&flush_lock);
+
+    // A flush takes the rest, starting from the lowest address
+    cache_unit_flushed = 0;
+    cache_unit_out_of_order = 0;
+    ret |= cache_unit_check(flush_block_cache() == 0, "flush a write-back cache");
+    ret |= cache_unit_check(cache_unit_flushed == dirty, "a flush writes each dirty frame once");
+    ret |= cache_unit_check((block_cache_dirty_frames() == 0) && !cache_unit_out_of_order, "a flush writes every dirty frame in order");
+    ret |= cache_unit_check((read_block_cache(0, 0, frame) == 0) && (frame[0] == 0), "flushed frames stay cached");
+
+    close_block_cache();
+    return (ret);
+}
 
-    // Search through entire cache to see if frame #frm exists
-    // Meanwhile, also keep track of the index with the least recently used frame, just in case it's a miss
-    uint16_t least_recently_used = 0;
-    uint16_t least_recent_index = 0;
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_unit_test_lru
+// Description  : Check that a full LRU cache evicts the frame used least
+//                recently, and that a dropped frame's entry is used before
+//                anything is evicted
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
 
-    for (int i = 0; i < cache_indeces_used; i++) {
-		// Increment the number of calls since the current index's frame has been fetched
-		cache[i].calls_since_use++;
-		
-	    if (cache[i].frame_number == frm) {
-		    // We found this frame in the cache!
-		    // Set calls_since_use = 0
-		    cache[i].calls_since_use = 0;
+static int cache_unit_test_lru(void)
+{
+    char frame[BLOCK_FRAME_SIZE];
+    char *cached;
+    int ret = 0;
 
-		    // Copy memory from buf to frames
-		    memcpy(cache[i].frame, buf, BLOCK_FRAME_SIZE);
+    ret |= cache_unit_check(cache_unit_start("lru", 0, 0, 4) == 0, "start an LRU cache");
+    for (int frm = 1; frm <= 4; frm++) {
+	    memset(frame, frm, BLOCK_FRAME_SIZE);
+	    ret |= cache_unit_check(put_block_cache(0, frm, frame) == 0, "put a frame in an LRU cache");
+    }
 
-		    // Well, we wrote to the cache, so exit ok!
-		    return(0);
+    // Using frame 1 leaves frame 2 as the least recently used
+    ret |= cache_unit_check(get_block_cache(0, 1) != NULL, "get a frame from an LRU cache");
+    memset(frame, 5, BLOCK_FRAME_SIZE);
+    ret |= cache_unit_check(put_block_cache(0, 5, frame) == 0, "put a frame in a full LRU cache");
+    ret |= cache_unit_check(get_block_cache(0, 2) == NULL, "LRU evicts the least recently used frame");
+    for (int frm = 1; frm <= 5; frm++) {
+	    if (frm == 2) {
+		    continue;
 	    }
+	    cached = get_block_cache(0, frm);
+	    ret |= cache_unit_check((cached != NULL) && (cached[0] == frm) && (cached[BLOCK_FRAME_SIZE - 1] == frm), "LRU keeps the other frames");
+    }
+
+    // A dropped frame leaves room, so nothing else goes
+    invalidate_block_cache(0, 3);
+    memset(frame, 6, BLOCK_FRAME_SIZE);
+    ret |= cache_unit_check(put_block_cache(0, 6, frame) == 0, "put a frame where one was dropped");
+    ret |= cache_unit_check((get_block_cache(0, 3) == NULL) && (get_block_cache(0, 1) != NULL) && (get_block_cache(0, 4) != NULL) &&
+			    (get_block_cache(0, 5) != NULL) && (get_block_cache(0, 6) != NULL), "a dropped frame's entry is used first");
+
+    close_block_cache();
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_unit_thread
+// Description  : Put frames of one block in the cache over and over, and read
+//                each one back while other threads do the same with theirs
+//
+// Inputs       : arg - the block, cast to a pointer
+// Outputs      : the number of frames that did not read back, cast to a pointer
 
-	    // If the frame was not found, keep track of how many calls since this frame was referenced
-	    else if (cache[i].calls_since_use > least_recently_used) {
-			    least_recently_used = cache[i].calls_since_use;
-			    least_recent_index = i;
+static void *cache_unit_thread(void *arg)
+{
+    BlockIndex blk = (BlockIndex) (intptr_t) arg;
+    char frame[BLOCK_FRAME_SIZE];
+    char back[BLOCK_FRAME_SIZE];
+    intptr_t failures = 0;
+
+    for (int i = 0; i < CACHE_TEST_NUM_LOOPS; i++) {
+	    memset(frame, blk * 64 + i % 64, BLOCK_FRAME_SIZE);
+	    if ((put_block_cache(blk, i % 64, frame) == -1) || (read_block_cache(blk, i % 64, back) == -1) ||
+		(memcmp(frame, back, BLOCK_FRAME_SIZE) != 0)) {
+		    failures++;
 	    }
     }
 
-    // We searched all items in the cache and did not find the frame. Therefore, use replacement policy!
-    // First check to see if there is a blank index in the cache
-    if (cache_indeces_used < block_cache_max_items) {
-	    // There's room at the cache_indeces_usedth index!
-	    cache[cache_indeces_used].frame_number = frm;
-	    cache[cache_indeces_used].calls_since_use = 0;
-	    cache[cache_indeces_used].frame = malloc(BLOCK_FRAME_SIZE);
-	    memcpy(cache[cache_indeces_used].frame, buf, BLOCK_FRAME_SIZE);
-	    cache_indeces_used++;
+    return ((void *) failures);
+}
 
-	    // Exit ok!
-	    return (0);
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_unit_test_shards
+// Description  : Check that the same frame number in different blocks is two
+//                frames, and that threads working on a cache of several
+//                shards at the same time each get their own frames back
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+static int cache_unit_test_shards(void)
+{
+    pthread_t threads[CACHE_TEST_NUM_THREADS];
+    char frame[BLOCK_FRAME_SIZE];
+    char *cached;
+    void *failures;
+    int started;
+    int ret = 0;
+
+    ret |= cache_unit_check(cache_unit_start("lru", 0, 0, BLOCK_CACHE_MAX_SHARDS * BLOCK_CACHE_MIN_SHARD_FRAMES) == 0, "start a sharded cache");
+    ret |= cache_unit_check(cache_num_shards == BLOCK_CACHE_MAX_SHARDS, "a large cache is split into shards");
+
+    for (BlockIndex blk = 0; blk < 2; blk++) {
+	    memset(frame, 'a' + blk, BLOCK_FRAME_SIZE);
+	    ret |= cache_unit_check(put_block_cache(blk, 7, frame) == 0, "put the same frame number of two blocks");
+    }
+    for (BlockIndex blk = 0; blk < 2; blk++) {
+	    cached = get_block_cache(blk, 7);
+	    ret |= cache_unit_check((cached != NULL) && (cached[0] == 'a' + blk), "the same frame number of two blocks is two frames");
     }
 
-    // Frame does not exist in cache, and there is no free room. Use LRU policy.
-    cache[least_recent_index].frame_number = frm;
-    cache[least_recent_index].calls_since_use = 0;
-    memcpy(cache[least_recent_index].frame, buf, BLOCK_FRAME_SIZE);
+    for (started = 0; started < CACHE_TEST_NUM_THREADS; started++) {
+	    if (pthread_create(&threads[started], NULL, cache_unit_thread, (void *) (intptr_t) started) != 0) {
+		    ret |= cache_unit_check(0, "start a cache test thread");
+		    break;
+	    }
+    }
+    for (int t = 0; t < started; t++) {
+	    ret |= cache_unit_check((pthread_join(threads[t], &failures) == 0) && (failures == NULL), "threads get their own frames back");
+    }
 
-    return (0);
+    close_block_cache();
+    return (ret);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : get_block_cache
-// Description  : Get an frame from the cache (and return it)
+// Function     : cache_unit_test_arena
+// Description  : Check that entries stay compact, and that every frame the
+//                cache hands out is its own frame of the page-aligned arena,
+//                with and without huge pages
 //
-// Inputs       : block - the block number of the block to find
-//                frm - the  number of the frame to find
-// Outputs      : pointer to cached frame or NULL if not found
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
 
-void* get_block_cache(BlockIndex block, BlockFrameIndex frm)
+static int cache_unit_test_arena(void)
 {
-    // Search through the cache
-    for (int i = 0; i < cache_indeces_used; i++) {
-	    if (cache[i].frame_number == frm) {
-		    // We found the frame!
-		    // Return the pointer
-		    return (cache[i].frame);
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    char frame[BLOCK_FRAME_SIZE];
+    char *cached;
+    size_t offset;
+    int ret = 0;
+
+    ret |= cache_unit_check(sizeof(struct cache_frame) <= 16, "a cache entry fits in 16 bytes");
+
+    for (int huge = 0; huge < 2; huge++) {
+	    close_block_cache();
+	    ret |= cache_unit_check(set_block_cache_huge_pages(huge) == 0, "choose the page size of the arena");
+	    ret |= cache_unit_check(cache_unit_start("lru", 0, 0, 100) == 0, "start a cache for the arena");
+	    ret |= cache_unit_check(((uintptr_t) cache_arena % page) == 0, "the arena is page-aligned");
+
+	    for (int frm = 0; frm < 100; frm++) {
+		    memset(frame, frm, BLOCK_FRAME_SIZE);
+		    ret |= cache_unit_check(put_block_cache(0, frm, frame) == 0, "fill the arena");
+	    }
+
+	    // A full cache uses each frame of the arena once
+	    for (int frm = 0; frm < 100; frm++) {
+		    cached = get_block_cache(0, frm);
+		    offset = (size_t) (cached - cache_arena);
+		    ret |= cache_unit_check((cached != NULL) && (offset < 100 * BLOCK_FRAME_SIZE) && (offset % BLOCK_FRAME_SIZE == 0) &&
+					    (cached[0] == (char) frm), "a cached frame is a frame of the arena");
+		    cached[0] = ~frm;
+	    }
+	    for (int frm = 0; frm < 100; frm++) {
+		    cached = get_block_cache(0, frm);
+		    ret |= cache_unit_check((cached != NULL) && (cached[0] == (char) ~frm), "no two entries share a frame");
 	    }
     }
 
-    return (NULL);
+    close_block_cache();
+    return (ret);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_unit_test_policies
+// Description  : Check that every replacement policy keeps the cache full of
+//                the frames put in it, and that the scan-resistant ones keep
+//                frames used repeatedly through a scan of frames used once
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+static int cache_unit_test_policies(void)
+{
+    char frame[BLOCK_FRAME_SIZE];
+    char *cached;
+    uint32_t held, hot;
+    int ret = 0;
+
+    ret |= cache_unit_check(set_block_cache_policy("mru") == -1, "an unknown policy is rejected");
+
+    for (size_t p = 0; p < sizeof(cache_policies) / sizeof(cache_policies[0]); p++) {
+	    ret |= cache_unit_check(cache_unit_start(cache_policies[p].name, 0, 0, 64) == 0, "start a cache with each policy");
+	    ret |= cache_unit_check(set_block_cache_policy("lru") == -1, "the policy can not change while the cache runs");
+
+	    // 8 hot frames used again and again among frames used once
+	    for (int round = 0; round < 4; round++) {
+		    for (int frm = 0; frm < 8; frm++) {
+			    memset(frame, frm, BLOCK_FRAME_SIZE);
+			    if (get_block_cache(0, frm) == NULL) {
+				    ret |= cache_unit_check(put_block_cache(0, frm, frame) == 0, "put a hot frame");
+			    }
+		    }
+		    for (int frm = 1000 + round * 32; frm < 1000 + (round + 1) * 32; frm++) {
+			    memset(frame, frm, BLOCK_FRAME_SIZE);
+			    ret |= cache_unit_check(put_block_cache(0, frm, frame) == 0, "put a cold frame");
+		    }
+	    }
+
+	    // A scan of frames used once, far more of them than the cache holds
+	    for (int frm = 8; frm < 8 + 256; frm++) {
+		    memset(frame, frm, BLOCK_FRAME_SIZE);
+		    ret |= cache_unit_check(put_block_cache(0, frm, frame) == 0, "put a scanned frame");
+	    }
+
+	    held = 0;
+	    hot = 0;
+	    for (int frm = 0; frm < 8 + 256; frm++) {
+		    if ((cached = get_block_cache(0, frm)) != NULL) {
+			    ret |= cache_unit_check(cached[0] == (char) frm, "a cached frame holds what was put");
+			    held++;
+			    hot += (frm < 8);
+		    }
+	    }
+	    ret |= cache_unit_check(held == 64, "a policy keeps the cache full");
+
+	    // The policies that remember evicted frames are the scan-resistant ones
+	    if (cache_policies[p].ghost_of_list[0] != -1) {
+		    ret |= cache_unit_check(hot == 8, "a scan-resistant policy keeps the hot frames through a scan");
+	    }
+    }
+
+    close_block_cache();
+    return (ret);
+}
 
+////////////////////////////////////////////////////////////////////////////////
 //
-// Unit test
+// Function     : cache_unit_test_admission
+// Description  : Check that with admission on, a full cache turns away frames
+//                used less often than its victim, keeps its frames through a
+//                scan, and lets in a frame once it is used often enough
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+static int cache_unit_test_admission(void)
+{
+    char frame[BLOCK_FRAME_SIZE];
+    int admitted = 0;
+    int scanned = 0;
+    int held = 0;
+    int ret = 0;
+
+    ret |= cache_unit_check(cache_unit_start("lru", 0, 1, 64) == 0, "start a cache with admission");
+
+    // Fill the cache with frames used a few times each
+    for (int frm = 0; frm < 64; frm++) {
+	    memset(frame, frm, BLOCK_FRAME_SIZE);
+	    ret |= cache_unit_check(put_block_cache(0, frm, frame) == 0, "an empty cache admits every frame");
+	    for (int use = 0; use < 3; use++) {
+		    ret |= cache_unit_check(get_block_cache(0, frm) != NULL, "use a cached frame");
+	    }
+    }
+
+    // A scan of frames used once is turned away, but for the few the sketch overestimates
+    for (int frm = 64; frm < 64 + 256; frm++) {
+	    memset(frame, frm, BLOCK_FRAME_SIZE);
+	    if (put_block_cache(0, frm, frame) == 0) {
+		    scanned++;
+	    }
+	    else {
+		    ret |= cache_unit_check(peek_block_cache(0, frm, frame) == -1, "a frame turned away is not cached");
+	    }
+    }
+    for (int frm = 0; frm < 64; frm++) {
+	    held += (peek_block_cache(0, frm, frame) == 0);
+    }
+    ret |= cache_unit_check(scanned <= 256 / 16, "a full cache turns away frames used once");
+    ret |= cache_unit_check(held >= 64 - scanned, "the cached frames survive a scan");
+
+    // A frame that keeps coming back gets in
+    memset(frame, 0xff, BLOCK_FRAME_SIZE);
+    for (int use = 0; (use < BLOCK_CACHE_SKETCH_MAX) && !admitted; use++) {
+	    admitted = (put_block_cache(0, 1000, frame) == 0);
+    }
+    ret |= cache_unit_check(admitted && (get_block_cache(0, 1000) != NULL), "a frame used often is admitted");
+
+    close_block_cache();
+    return (ret);
+}
 
 ////////////////////////////////////////////////////////////////////////////////
 //
@@ -199,6 +2333,15 @@ int blockCacheUnitTest(void)
     // Create a buffer to store our randomized framedata in
     char *buf;
 
+    // The configuration the targeted checks change
+    const struct cache_policy *policy = block_cache_policy;
+    int (*flusher)(BlockIndex blk, BlockFrameIndex frm, void* frame) = cache_flusher;
+    uint32_t max_items = block_cache_max_items;
+    int write_back = cache_write_back;
+    int admission = cache_admission;
+    int huge_pages = cache_huge_pages;
+    int ret = 0;
+
     // Initialize the cache
     init_block_cache();
 
@@ -229,17 +2372,30 @@ int blockCacheUnitTest(void)
 	    printf("Address of struct data: %p\n", frame_test[frame_num].data);
 
 	    memcpy(frame_test[frame_num].data, buf, BLOCK_FRAME_SIZE);
-	    printf("Buf: %s\nStruct: %s\n", buf, frame_test[frame_num].data);
+	    // Frames are not NUL terminated, and the last frame of the arena ends at the end of its mapping
+	    printf("Buf: %.*s\nStruct: %.*s\n", BLOCK_FRAME_SIZE, buf, BLOCK_FRAME_SIZE, frame_test[frame_num].data);
 	    
-	    // Put in the cache
-	    put_block_cache(0, frame_num, buf);
+	    // Put in the cache, with admission on a full cache may turn the frame away, and then must not have it
+	    if (put_block_cache(0, frame_num, buf) == -1) {
+		    free(buf);
+		    if (!cache_admission || (get_block_cache(0, frame_num) != NULL)) {
+			    logMessage(LOG_ERROR_LEVEL, "Cache unit test failed: frame %d was not put in the cache", frame_num);
+			    return (-1);
+		    }
+		    printf("Frame not admitted.\n\n");
+		    continue;
+	    }
 
 	    free(buf);
 
 	    // Retrieve from the cache
 	    buf = get_block_cache(0, frame_num);
+	    if (buf == NULL) {
+		    logMessage(LOG_ERROR_LEVEL, "Cache unit test failed: frame %d is missing from the cache", frame_num);
+		    return (-1);
+	    }
 	    printf("Address of returned data: %p\n", buf);
-	    printf("Returned data: %s\n", buf);
+	    printf("Returned data: %.*s\n", BLOCK_FRAME_SIZE, buf);
 
 	    // Assert that the retrieved data is the same as the data stored in the array
 	    for (int j = 0; j < BLOCK_FRAME_SIZE; j++) {
@@ -252,8 +2408,30 @@ int blockCacheUnitTest(void)
 	    printf("Frame verified.\n\n");
     }
 
-    // Return successfully
     printf("Successfully tested %d gets and puts!\n", CACHE_TEST_NUM_LOOPS);
+
+    // The targeted checks each start a cache of their own, the configuration they change is put back after them.
+    // Every check runs even if an earlier one failed, so one run reports all of the failures
+    ret |= cache_unit_test_flusher();
+    ret |= cache_unit_test_lru();
+    ret |= cache_unit_test_shards();
+    ret |= cache_unit_test_arena();
+    ret |= cache_unit_test_policies();
+    ret |= cache_unit_test_admission();
+
+    close_block_cache();
+    block_cache_policy = policy;
+    cache_write_back = write_back;
+    cache_admission = admission;
+    cache_huge_pages = huge_pages;
+    block_cache_max_items = max_items;
+    set_block_cache_flusher(flusher);
+    if (ret == -1) {
+	    logMessage(LOG_ERROR_LEVEL, "Cache unit test failed.");
+	    return (-1);
+    }
+
+    // Return successfully
     logMessage(LOG_OUTPUT_LEVEL, "Cache unit test completed successfully.");
     return (0);
 }
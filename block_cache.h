@@ -18,6 +18,24 @@
 #define DEFAULT_BLOCK_FRAME_CACHE_SIZE 1024 // Default size for cache
 #define CACHE_TEST_NUM_FRAMES 20 // Number of frames we want to use for the unit test
 #define CACHE_TEST_NUM_LOOPS 10000 // Number of iterations of tests
+#define CACHE_TEST_NUM_THREADS 4 // Threads sharing the cache in the unit test, each on a block of its own
+#define BLOCK_CACHE_DIRTY_LOW_PERCENT 10 // Write-back: the background flusher starts above this share of dirty frames
+#define BLOCK_CACHE_DIRTY_HIGH_PERCENT 50 // Write-back: writers wait for the flusher at this share of dirty frames
+#define BLOCK_CACHE_FLUSH_BATCH 16 // Dirty frames the flusher writes before checking the watermarks again
+#define BLOCK_CACHE_MAX_SHARDS 16 // Most independently locked shards the cache is split into
+#define BLOCK_CACHE_MIN_SHARD_FRAMES 64 // Fewest frames per shard, smaller caches use fewer shards
+#define BLOCK_CACHE_HUGE_PAGE_SIZE (2 * 1024 * 1024) // Huge page size the frame arena is rounded up to
+#define BLOCK_CACHE_POLICY_LISTS 2 // Lists (and ghost lists) a replacement policy can keep per shard
+#define BLOCK_CACHE_GHOST_FORGOTTEN -2 // Chain value of a ghost list position that holds no key
+#define BLOCK_CACHE_2Q_IN_PERCENT 25 // 2Q: share of the shard the FIFO of new frames keeps
+#define BLOCK_CACHE_2Q_OUT_PERCENT 50 // 2Q: frames evicted from the FIFO that are remembered, as a share of the shard
+#define BLOCK_CACHE_S3FIFO_SMALL_PERCENT 10 // S3-FIFO: share of the shard the small FIFO keeps
+#define BLOCK_CACHE_S3FIFO_GHOST_PERCENT 90 // S3-FIFO: frames evicted from the small FIFO that are remembered
+#define BLOCK_CACHE_S3FIFO_MAX_FREQ 3 // S3-FIFO: uses counted per frame, at most 3 fit in an entry
+#define BLOCK_CACHE_SKETCH_DEPTH 4 // Admission: rows of counters in the frequency sketch
+#define BLOCK_CACHE_SKETCH_MAX 15 // Admission: counters are 4 bits and stop at this count
+#define BLOCK_CACHE_SKETCH_SAMPLE_FACTOR 10 // Admission: counters halve after this many uses per entry
+#define CACHE_KEY(blk, frm) (((uint32_t) (blk) << 16) | (frm)) // A frame's key, its device address
 
 ///
 // Cache Interfaces
@@ -37,10 +55,61 @@ int put_block_cache(BlockIndex blk, BlockFrameIndex frm, void* frame);
 void* get_block_cache(BlockIndex blk, BlockFrameIndex frm);
 // Get an object from the cache (and return it)
 
+int read_block_cache(BlockIndex blk, BlockFrameIndex frm, void* frame);
+// Copy a frame out of the cache, 0 if it was cached, -1 if not
+
+int peek_block_cache(BlockIndex blk, BlockFrameIndex frm, void* frame);
+// Copy a frame out of the cache without counting it as a use, 0 if it was cached, -1 if not
+
+int match_block_cache(BlockIndex blk, BlockFrameIndex frm, void* frame);
+// 1 if the cache holds exactly these bytes for a frame, 0 if not
+
+int set_block_cache_write_back(int enable);
+// Keep modified frames in the cache and write them to the device later (must be called before init)
+
+int set_block_cache_huge_pages(int enable);
+// Back the cache's frames with huge pages where the system allows it (must be called before init)
+
+int set_block_cache_policy(const char *name);
+// Choose the replacement policy, "lru", "clock", "2q", "arc" or "s3fifo" (must be called before init)
+
+int set_block_cache_admission(int enable);
+// Only admit a frame over the policy's victim if it is used more often (must be called before init)
+
+void set_block_cache_flusher(int (*flusher)(BlockIndex blk, BlockFrameIndex frm, void* frame));
+// Set the function that writes a dirty frame to the device
+
+int write_block_cache(BlockIndex blk, BlockFrameIndex frm, void* frame);
+// Put a modified frame into the cache, 1 if the cache now owns writing it, 0 if the caller has to
+
+int flush_block_cache_frame(BlockIndex blk, BlockFrameIndex frm);
+// Write a frame to the device if it is dirty in the cache
+
+int flush_block_cache_matching(int (*match)(BlockIndex blk, BlockFrameIndex frm, void *arg), void *arg);
+// Write the dirty frames match picks to the device, in the order they sit on the device
+
+int flush_block_cache(void);
+// Write every dirty frame in the cache to the device
+
+void invalidate_block_cache(BlockIndex blk, BlockFrameIndex frm);
+// Drop a frame from the cache without writing it
+
+int block_cache_write_back(void);
+// 1 if the cache is in write-back mode, 0 if not
+
+uint32_t block_cache_dirty_frames(void);
+// Number of dirty frames in the cache
+
+// An entry of the cache. The framedata of entry i is frame i of the cache's arena, and a shard has at most
+// 1 << 28 entries, so the links and the policy's bits fit in 16 bytes
 struct cache_frame {
+    uint16_t block_number; // The block of the frame at this entry in the cache
     uint16_t frame_number; // The frame number at this entry in the cache
-    uint16_t calls_since_use; // Due to LRU policy, keep track of how many cache calls have been made since this frame was referenced
-    void *frame; // Pointer to framedata
+    int32_t list_prev; // Entry before this one on its policy list, -1 at the head
+    int32_t list_next; // Entry after this one on its policy list, -1 at the tail
+    int32_t hash_next : 29; // Next entry in the same hash bucket (or on the free list), -1 ends the chain
+    uint32_t list : 1; // Which of its shard's policy lists the entry is on
+    uint32_t ref : 2; // Uses the policy counts for the entry (CLOCK's reference bit, S3-FIFO's frequency)
 } cache_frame;
 
 //
@@ -82,6 +82,9 @@ extern unsigned long BlockSimulatorLLevel; // Driver log level
 BlockXferRegister block_io_bus(BlockXferRegister regstate, void* buf);
 // This is the bus interface for communicating with controller
 
+int switch_block(BlockIndex blk);
+// Make blk the block that frame reads and writes act on
+
 // calculate cache performance
 int get_performance(uint32_t);
 
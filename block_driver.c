@@ -11,969 +11,4633 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
-#include <errno.h> // Try to debug malloc issue!
 #include <stdio.h>
+#include <pthread.h>
 
 // Project Includes
 #include <block_controller.h>
 #include <block_driver.h>
-#include <cmpsc311_util.h>
 #include <block_cache.h>
+#include <cmpsc311_log.h>
 
 // Create an array that will keep track of all files
 struct file *all_files;
 
 // Keep track of the number of frames used
-uint16_t num_frames_used;
+uint32_t num_frames_used;
+
+// Bitmap of the frames of each block (a set bit means the frame is in use), the number of frames used in
+// each block, where to continue looking for a free frame, and whether the map changed since the last checkpoint
+uint64_t frame_map[BLOCK_NUM_BLOCKS][BLOCK_FRAME_MAP_WORDS];
+uint32_t block_frames_used[BLOCK_NUM_BLOCKS];
+uint32_t frame_map_cursor[BLOCK_NUM_BLOCKS];
+uint8_t frame_map_dirty;
+
+// The block the controller is currently switched to
+BlockIndex current_block;
 
 // Keep track of the number of files in the list
 uint16_t num_files;
 
+// Number of entries allocated for all_files (grows geometrically)
+uint32_t files_capacity;
+
+// Hashed index over file paths: each bucket holds the index of the first file in its chain
+int32_t *path_index;
+uint32_t path_index_buckets;
+
+// Frames reserved for the metadata region, in the order the image is laid out across them
+BlockAddress metadata_frames[BLOCK_MAX_METADATA_FRAMES];
+uint16_t num_metadata_frames;
+
+// Copies of the superblock and the metadata region as they are on the device, and which region frames changed since
+char superblock_image[BLOCK_FRAME_SIZE];
+char *metadata_image;
+uint32_t metadata_length;
+uint8_t metadata_frame_dirty[BLOCK_MAX_METADATA_FRAMES];
+
+// Lowest index of a file whose record changed since the last checkpoint, -1 if none did
+int32_t first_dirty_file = -1;
+
+// File handle table, along with a FIFO ring of the slots that are free
+struct file_handle handle_table[BLOCK_MAX_OPEN_FILES];
+uint16_t free_handle_slots[BLOCK_MAX_OPEN_FILES];
+uint32_t first_free_handle_slot;
+uint32_t num_free_handle_slots;
+
+// The cache's background flusher writes frames too, so bus transfers (and the block they go to) are serialized
+pthread_mutex_t bus_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Transfer counters, updated under bus_lock
+struct block_stats driver_stats;
+
+// Files up to this many bytes are stored inline in their metadata record
+uint32_t inline_threshold = BLOCK_DEFAULT_INLINE_THRESHOLD;
+
+// Holes read as this frame, and the gap a write past the end of a file leaves is filled from it
+const char zero_frame[BLOCK_FRAME_SIZE];
+
+// Partial writes waiting to be merged with their frames, and the slot to give up next when the table is full
+struct pending_frame pending_frames[BLOCK_MAX_PENDING_FRAMES];
+uint16_t num_pending_frames;
+uint16_t pending_cursor;
+
+//
+// Functional Prototypes
+
+static uint32_t hash_path(const char *path); // Hash a path into a 32-bit value
+static int reserve_files(uint32_t count); // Make room for count entries in all_files
+static int rebuild_path_index(void); // Rebuild the path index from all_files
+static int index_file(int32_t index); // Add all_files[index] to the path index
+static void index_file_at(int32_t index); // Link all_files[index] into its bucket
+static int32_t find_file(const char *path); // Look up the index of a file by path
+static void reset_handles(void); // Free every slot in the handle table
+static int16_t acquire_handle(int32_t index); // Give an open file a handle
+static void release_handle(int16_t fd); // Invalidate a handle and free its slot
+static int32_t lookup_handle(int16_t fd); // Map a handle to the index of its open file
+static void rebind_handles(int32_t from, int32_t to); // Move or release every open of a file
+static int flush_write_buffer(uint16_t slot); // Write out the write buffer of a handle
+static int flush_file_buffers(int32_t index); // Write out every write buffer holding data for a file
+static int flush_all_buffers(void); // Write out every write buffer
+static int64_t buffer_write(uint16_t slot, const char *buf, uint64_t count); // Collect a write in a handle's write buffer
+static int frame_in_use(BlockAddress addr); // Check the frame map for a frame
+static int32_t pick_block(void); // Choose a block to allocate from
+static BlockAddress allocate_frame(BlockAddress hint); // Take a free frame from the frame map
+static BlockAddress allocate_run(BlockAddress hint, uint32_t want, uint32_t *got); // Take a run of free frames from the frame map
+static void mark_frame_used(BlockAddress addr); // Set a frame's bit in the frame map
+static void free_frame(BlockAddress addr); // Return a frame to the frame map
+static BlockAddress next_frame_hint(int32_t index); // The frame that would continue a file contiguously
+static int grow_file(int32_t index); // Add a newly allocated frame to the end of a file
+static int reserve_frames(int32_t index, uint32_t frames); // Grow a file to a number of frames in contiguous runs
+static void shrink_file(int32_t index, uint32_t keep); // Free frames off the end of a file
+static void unlink_file(int32_t index); // Remove a file from the path index
+static int reserve_extents(int32_t index, uint32_t count); // Make room for count extents in a file's list
+static int append_frame(int32_t index, BlockAddress addr); // Add a frame to the end of a file
+static int append_hole(int32_t index, uint32_t frames); // Add unwritten frames to the end of a file
+static uint32_t find_extent(int32_t index, uint32_t logical); // Find the extent holding a frame of a file
+static BlockAddress file_frame(int32_t index, uint32_t logical, uint32_t *run); // Map a frame of a file to the device
+static BlockAddress fill_hole(int32_t index, uint32_t logical); // Give a frame in a hole of a file a device frame
+static int extend_file(int32_t index, uint64_t pos); // Extend a file with zeroes up to a position
+static int64_t write_inline(int32_t index, const struct iovec *iov, int iovcnt, uint64_t pos, uint64_t count); // Write to an inline file
+static int promote_inline(int32_t index); // Move an inline file's data into frames
+static int select_block(BlockIndex blk); // Switch the controller to a block
+static int read_frame(BlockAddress addr, void *buf); // Read a frame, verifying its checksum
+static int write_frame(BlockAddress addr, void *buf); // Write a frame with its checksum
+static int load_frame(BlockAddress addr, void *buf); // Read a frame through the cache
+static int store_frame(BlockAddress addr, void *buf); // Hand a modified frame to the cache or the device
+static int writeback_frame(BlockIndex blk, BlockFrameIndex frm, void *buf); // Write a frame the cache evicts or flushes
+static int file_owns_frame(BlockIndex blk, BlockFrameIndex frm, void *arg); // Check whether a frame belongs to a file
+static int flush_file_frames(int32_t index); // Write out every frame of a file still waiting in memory
+static struct pending_frame *find_pending(BlockAddress addr); // Look up the partial writes waiting on a frame
+static struct pending_frame *new_pending(BlockAddress addr); // Start collecting partial writes to a frame
+static int add_pending_range(struct pending_frame *p, uint16_t start, uint16_t end); // Record a written byte range
+static int flush_pending(struct pending_frame *p); // Merge partial writes with the frame and write it
+static int flush_all_pending(void); // Write out every frame with partial writes waiting
+static void drop_pending(struct pending_frame *p); // Forget the partial writes to a frame
+static uint32_t file_record_size(int32_t index); // Size of a file's serialized record
+static int reserve_record_slots(int32_t index); // Grow a file's record to fit its frame list
+static uint32_t serialize_file_record(int32_t index, char *record); // Serialize a file's record
+static int deserialize_metadata(char *image, uint32_t length); // Restore the file table
+static void unload_files(int32_t count); // Free the files restored by a failed load
+static void unload_metadata_image(void); // Free the metadata image of a failed load
+static int load_metadata(void); // Read the superblock and metadata region
+static void mark_file_dirty(int32_t index); // Queue a file's record for the next checkpoint
+static void store_metadata_bytes(uint32_t offset, const char *bytes, uint32_t count); // Update the metadata image
+static int64_t iov_length(const struct iovec *iov, int iovcnt); // Total size of a scatter/gather list
+static void iov_scatter(const struct iovec *iov, int *seg, uint64_t *off, const char *src, uint32_t count); // Copy into a scatter/gather list
+static void iov_gather(const struct iovec *iov, int *seg, uint64_t *off, char *dst, uint32_t count); // Copy out of a scatter/gather list
+static char *iov_span(const struct iovec *iov, int *seg, uint64_t *off, uint32_t count); // Take a contiguous span of a scatter/gather list
+static int64_t file_readv(int32_t index, const struct iovec *iov, int iovcnt, uint64_t pos); // Read from a file at a position
+static int64_t file_writev(int32_t index, const struct iovec *iov, int iovcnt, uint64_t pos); // Write to a file at a position
+static int unit_check(int ok, const char *what); // Log a failed check of the unit test
+static int unit_make_files(const char *prefix, int count); // Make a set of test files that each hold their own path
+static int unit_delete_files(const char *prefix, int count); // Delete a set of test files
+static int unit_restart_cache(int write_back); // Flush and restart the cache in a mode for the unit test
+static int unit_test_paths(void); // Unit test: files are found by path
+static int unit_test_handles(void); // Unit test: handles are unique and go stale
+static int unit_test_metadata_region(void); // Unit test: the metadata region spans frames
+static int unit_test_incremental_checkpoint(void); // Unit test: checkpoints write only what changed
+static int unit_test_extents(void); // Unit test: frame maps are extents
+static int unit_test_free_frames(void); // Unit test: truncate and delete free frames
+static int unit_test_block_addresses(void); // Unit test: addresses and per-block counts
+static int unit_test_large_offsets(void); // Unit test: 64-bit offsets and lengths
+static int unit_test_positions(void); // Unit test: per-open positions and positional I/O
+static int unit_test_vectors(void); // Unit test: scatter/gather I/O
+static int unit_test_full_frames(void); // Unit test: whole frames skip the read
+static int unit_test_unwritten_frames(void); // Unit test: unwritten frames are not read
+static int unit_test_pending_frames(void); // Unit test: partial writes wait for their frame
+static int unit_test_write_buffer(void); // Unit test: small writes are buffered
+static int unit_test_write_back(void); // Unit test: write-back frames are held and flushed
+static int unit_test_write_elision(void); // Unit test: unchanged frames are not rewritten
+static int unit_test_fallocate(void); // Unit test: reserved frames and a full device
+static int unit_test_holes(void); // Unit test: sparse files
+static int unit_test_inline_files(void); // Unit test: small files live in their record
+
 
 //
 // Implementation
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function	: generate_register
-// Description	: Take in kr1, fm1, cs1, rt1 to generate the register to communicate with hardware device
+// Function	: hash_path
+// Description	: Hash a file path with 32-bit FNV-1a
 //
-// Inputs	: kr1, fm1, cs1, rt1
-// Outputs	: int64_t type register
+// Inputs	: path - the NUL terminated path to hash
+// Outputs	: the hash of the path
 
-uint64_t generate_register(uint8_t kr1, uint16_t fm1, uint32_t cs1, uint8_t rt1)
+static uint32_t hash_path(const char *path)
 {
-	uint64_t reg = 0x0, tempkr1, tempfm1, tempcs1, temprt1;
+    uint32_t hash = 2166136261u;
 
-	// Shift each variable to its designated spot in the 64-bit register
-	tempkr1 = ((uint64_t)kr1) << 56;
-	tempfm1 = ((uint64_t)fm1) << 40;
-	tempcs1 = ((uint64_t)cs1) << 32;
-	tempcs1 = tempcs1 >> 24;
-	tempcs1 = tempcs1 & 0x000000ffffffffff;
-	temprt1 = ((uint64_t)rt1);
-	
-	// Combine all variables into one 64-bit register
-	reg = tempkr1|tempfm1|tempcs1|temprt1;
+    while (*path != '\0') {
+	    hash ^= (uint8_t) *path++;
+	    hash *= 16777619u;
+    }
 
-	return reg;
+    return (hash);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : block_poweron
-// Description  : Startup up the BLOCK interface, initialize filesystem
+// Function	: reserve_files
+// Description	: Make sure all_files has room for at least count entries, doubling the allocation when it runs out
 //
-// Inputs       : none
-// Outputs      : 0 if successful, -1 if failure
+// Inputs	: count - the number of entries needed
+// Outputs	: 0 if successful, -1 if failure
 
-int32_t block_poweron(void)
+static int reserve_files(uint32_t count)
 {
-    // Specify init opcode
-    BlockOpCodes opcode = BLOCK_OP_INITMS;
-   
-    // Generate register
-    BlockXferRegister reg = generate_register(opcode, 0, 0, 0);
-    
-    // Create variable to store return reg
-    BlockXferRegister return_reg;
-
-    // Pass to hardware device
-    return_reg = block_io_bus(reg, 0);
+    uint32_t capacity;
+    struct file *grown;
 
-    // block_io_bus returns rt1 = -1 if there was an error
-    return_reg = return_reg << 56;
-    return_reg = return_reg >> 56;
-    int8_t rt1 = return_reg;
-    
-    if (rt1 == -1) {
-	    return (-1);
+    if (count <= files_capacity) {
+	    return (0);
     }
 
-    // Assign global variables
-    num_frames_used = 0;
-    num_files = 0;
-
-    // Create a FILE *file pointer to see if block_memsys.bck exists
-    FILE *file = fopen("block_memsys.bck", "r");
-
-    if (file != NULL) {
-	    // block_memsys.bck exists! Read frame 0 and extract relevant metadata for my data structures
+    // Double the capacity so creating N files costs O(N) copying overall instead of O(N^2)
+    capacity = (files_capacity == 0) ? BLOCK_FILES_MIN_CAPACITY : files_capacity;
+    while (capacity < count) {
+	    capacity *= 2;
+    }
 
-	    // Create a pointer to store the checksum of the received framedata
-            uint32_t *fr_checksum = malloc(sizeof(uint32_t));
+    grown = (struct file*) realloc(all_files, sizeof(struct file) * capacity);
+    if (grown == NULL) {
+	    return (-1);
+    }
 
-	    // Store the value of the pointer
-	    uint32_t fr_checksum_value = (uint32_t) *fr_checksum;
+    all_files = grown;
+    files_capacity = capacity;
+    return (0);
+}
 
-	    // Declare a variable to keep track of the checksum returned by the frame
-            uint32_t frame_checksum;
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: index_file
+// Description	: Add all_files[index] to the path index, growing the index to keep chains short
+//
+// Inputs	: index - the index of the file in all_files
+// Outputs	: 0 if successful, -1 if failure
 
-	    // Create a temporary buffer to read into
-	    char *temp_buf = malloc(BLOCK_FRAME_SIZE);
+static int index_file(int32_t index)
+{
+    // Keep the load factor at or below 1 so lookups stay O(1) expected
+    if (num_files > path_index_buckets) {
+	    return (rebuild_path_index());
+    }
 
-	    // Specify read opcode
-	    opcode = BLOCK_OP_RDFRME;
+    index_file_at(index);
+    return (0);
+}
 
-	    // Generate register
-	    reg = generate_register(opcode, 0, 0, 0);
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: index_file_at
+// Description	: Link all_files[index] into the bucket of its path
+//
+// Inputs	: index - the index of the file in all_files
+// Outputs	: none
 
-	    // Pass through io bus
-	    return_reg = block_io_bus(reg, temp_buf);
+static void index_file_at(int32_t index)
+{
+    uint32_t bucket;
 
-	    uint64_t rt_temp = return_reg << 56;
-	    rt_temp = rt_temp >> 56;
-	    rt1 = rt_temp;
+    bucket = hash_path(all_files[index].path) & (path_index_buckets - 1);
+    all_files[index].hash_next = path_index[bucket];
+    path_index[bucket] = index;
+}
 
-	    if (rt1 == -1) {
-		    return (-1);
-	    }
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: unlink_file
+// Description	: Remove all_files[index] from the chain of its bucket
+//
+// Inputs	: index - the index of the file in all_files
+// Outputs	: none
 
-	    // Observe the checksum of the frame returned by block_io_bus
-	    return_reg = return_reg << 24;
-	    return_reg = return_reg >> 32;
-	    frame_checksum = return_reg;
+static void unlink_file(int32_t index)
+{
+    int32_t *link;
 
-	    // Calculate the checksum of the received framedata
-	    compute_frame_checksum(temp_buf, fr_checksum);
-	    fr_checksum_value = (uint32_t) *fr_checksum;
+    link = &path_index[hash_path(all_files[index].path) & (path_index_buckets - 1)];
+    while (*link != index) {
+	    link = &all_files[*link].hash_next;
+    }
+    *link = all_files[index].hash_next;
+}
 
-	    while (frame_checksum != fr_checksum_value) {
-		    // Checksums do not match! Call block_io_bus until they match
-		    reg = generate_register(opcode, 0, 0, 0);
-		    return_reg = block_io_bus(reg, temp_buf);
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: rebuild_path_index
+// Description	: Throw away the path index and rebuild it from the first num_files entries of all_files
+//
+// Inputs	: none
+// Outputs	: 0 if successful, -1 if failure
 
-		    rt_temp = return_reg << 56;
-		    rt_temp = rt_temp >> 56;
-		    rt1 = rt_temp;
+static int rebuild_path_index(void)
+{
+    uint32_t buckets = BLOCK_PATH_INDEX_MIN_BUCKETS;
+    uint32_t bucket;
+    int32_t *index;
 
-		    if (rt1 == -1) {
-			    return (-1);
-		    }
+    // Size the index to a power of two with room to grow before the next rebuild
+    while (buckets < (uint32_t) num_files * 2) {
+	    buckets *= 2;
+    }
 
-		    compute_frame_checksum(temp_buf, fr_checksum);
-		    fr_checksum_value = (uint32_t) *fr_checksum;
-	    }
+    index = malloc(sizeof(int32_t) * buckets);
+    if (index == NULL) {
+	    return (-1);
+    }
 
-	    // Metadata is now extracted into temp_buf!
+    for (uint32_t i = 0; i < buckets; i++) {
+	    index[i] = -1;
+    }
 
-	    // Keep a variable to track how many bytes have been written from the metadata so far
-	    int bytes_read;
+    free(path_index);
+    path_index = index;
+    path_index_buckets = buckets;
 
-	    // The first uint16_t 2 bytes of the buffer signify how many files there are
-	    memcpy(&num_files, temp_buf, 2);
-	    bytes_read = 2;
+    for (int32_t i = 0; i < num_files; i++) {
+	    bucket = hash_path(all_files[i].path) & (path_index_buckets - 1);
+	    all_files[i].hash_next = path_index[bucket];
+	    path_index[bucket] = i;
+    }
 
-	    // Allocate memory for all_files based on num_files
-	    all_files = (struct file*) realloc(all_files, sizeof(struct file) * num_files);
+    return (0);
+}
 
-	    // For num_files files, go through each file
-	    for (int i = 0; i < num_files; i++) {
-		    // Copy over the file's path
-		    memcpy(&all_files[i].path, temp_buf+bytes_read, BLOCK_MAX_PATH_LENGTH);
-		    bytes_read += BLOCK_MAX_PATH_LENGTH;
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: find_file
+// Description	: Look up a file by its path using the path index
+//
+// Inputs	: path - the path of the file to find
+// Outputs	: index of the file in all_files, -1 if it does not exist
 
-		    // Copy over the file's handle
-		    memcpy(&all_files[i].handle, temp_buf+bytes_read, sizeof(int16_t));
-		    bytes_read += 2;
+static int32_t find_file(const char *path)
+{
+    int32_t index;
 
-		    // Copy over the file's length
-		    memcpy(&all_files[i].length, temp_buf+bytes_read, sizeof(uint32_t));
-		    bytes_read += 4;
+    if (path_index == NULL) {
+	    return (-1);
+    }
 
-		    // Set the file's status to open and its seek position to 0
-		    all_files[i].status = OPEN;
-		    all_files[i].seek_pos = 0;
+    index = path_index[hash_path(path) & (path_index_buckets - 1)];
+    while (index != -1) {
+	    if (strcmp(all_files[index].path, path) == 0) {
+		    return (index);
+	    }
+	    index = all_files[index].hash_next;
+    }
 
-		    // Specify the number of frames for the file
-		    memcpy(&all_files[i].num_frames, temp_buf+bytes_read, sizeof(uint16_t));
-		    bytes_read += 2;
+    return (-1);
+}
 
-		    // Allocate memory for all_files[i].frames based on num_frames
-		    all_files[i].frames = (uint16_t *) malloc(sizeof(uint16_t) * all_files[i].num_frames);
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: reset_handles
+// Description	: Free every slot in the handle table
+//
+// Inputs	: none
+// Outputs	: none
 
-		    // Jot down each of the frames that the file uses based off of num_frames
-		    for (int j = 0; j < all_files[i].num_frames; j++) {
-			    memcpy(&all_files[i].frames[j], temp_buf+bytes_read, sizeof(uint16_t));
-			    bytes_read += 2;
-		    }
+static void reset_handles(void)
+{
+    // Queue the slots in order so the lowest slots get handed out first. Generations carry over, so handles from
+    // before a poweroff stay stale
+    first_free_handle_slot = 0;
+    num_free_handle_slots = 0;
+    for (int32_t slot = 0; slot < BLOCK_MAX_OPEN_FILES; slot++) {
+	    handle_table[slot].file = -1;
+	    handle_table[slot].buffered = 0;
+	    handle_table[slot].wbuf_len = 0;
+	    free(handle_table[slot].wbuf);
+	    handle_table[slot].wbuf = NULL;
+	    free_handle_slots[num_free_handle_slots++] = slot;
+    }
+}
 
-		    // All data for the current file has been restored!
-	    }
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: acquire_handle
+// Description	: Take a free slot from the handle table and bind it to a file
+//
+// Inputs	: index - the index of the file in all_files
+// Outputs	: the new file handle, -1 if the table is full
 
-	    // All data for all files has been restored!
+static int16_t acquire_handle(int32_t index)
+{
+    uint16_t slot;
 
-	    free(fr_checksum);
-	    fr_checksum = NULL;
-	    free(temp_buf);
-	    temp_buf = NULL;
+    if (num_free_handle_slots == 0) {
+	    return (-1);
     }
 
-    // Initialize cache
-    init_block_cache();
+    slot = free_handle_slots[first_free_handle_slot];
+    first_free_handle_slot = (first_free_handle_slot + 1) % BLOCK_MAX_OPEN_FILES;
+    num_free_handle_slots--;
+    handle_table[slot].file = index;
+    handle_table[slot].seek_pos = 0;
+    handle_table[slot].buffered = 0;
+    handle_table[slot].wbuf_len = 0;
 
-    // Return successfully
-    return (0);
+    return ((int16_t) ((handle_table[slot].generation << BLOCK_HANDLE_SLOT_BITS) | slot));
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : block_poweroff
-// Description  : Shut down the BLOCK interface, close all files
+// Function	: release_handle
+// Description	: Free the slot of a handle and bump its generation so the handle goes stale
 //
-// Inputs       : none
-// Outputs      : 0 if successful, -1 if failure
+// Inputs	: fd - a handle returned by lookup_handle
+// Outputs	: none
 
-int32_t block_poweroff(void)
+static void release_handle(int16_t fd)
 {
-    // Declare opcode
-    BlockOpCodes opcode;
-
-    // Declare register
-    BlockXferRegister reg;
+    uint16_t slot = fd & (BLOCK_MAX_OPEN_FILES - 1);
 
-    // Create variable to hold return reg
-    BlockXferRegister return_reg;
+    // Anything still buffered is dropped, callers that want it kept flush first
+    if (handle_table[slot].wbuf_len > 0) {
+	    all_files[handle_table[slot].file].buffered_handles--;
+    }
+    free(handle_table[slot].wbuf);
+    handle_table[slot].wbuf = NULL;
+    handle_table[slot].wbuf_len = 0;
+    handle_table[slot].buffered = 0;
+
+    // The slot goes to the back of the free ring, so every other free slot is handed out before it comes
+    // back with its next generation, and a stale handle only matches again after all of its generations
+    handle_table[slot].file = -1;
+    handle_table[slot].generation = (handle_table[slot].generation + 1) & BLOCK_HANDLE_GENERATION_MASK;
+    free_handle_slots[(first_free_handle_slot + num_free_handle_slots) % BLOCK_MAX_OPEN_FILES] = slot;
+    num_free_handle_slots++;
+}
 
-    // On BLOCK_OP_POWOFF, the state of the filesystem is stored to block_memsys.bck in our directory.
-    // When shutting down place metadata of our data structures in the first frame, which should have been skipped when reading/writing
-    
-    // Create a temporary buffer that will store the metadata for the frame
-    char *temp_buf = malloc(BLOCK_FRAME_SIZE);
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: lookup_handle
+// Description	: Map a file handle to its file with a bounds check and one table access
+//
+// Inputs	: fd - the file handle
+// Outputs	: index of the open file in all_files, -1 if the handle is invalid or stale
 
-    // Keep track of how many bytes we've written since the start of the buffer
-    int bytes_written;
+static int32_t lookup_handle(int16_t fd)
+{
+    uint16_t slot;
 
-    // First we need to store the number of files, which is a uint16_t
-    memcpy(temp_buf, &num_files, sizeof(uint16_t));
-    bytes_written = 2;
+    if (fd < 0) {
+	    return (-1);
+    }
 
-    // Now go through each file and write bytes regarding that file's metadata
-    for (int i = 0; i < num_files; i++) {
-	    // First copy over the path
-	    memcpy(temp_buf + bytes_written, &all_files[i].path, BLOCK_MAX_PATH_LENGTH);
-	    bytes_written += BLOCK_MAX_PATH_LENGTH;
+    slot = fd & (BLOCK_MAX_OPEN_FILES - 1);
+    if ((handle_table[slot].file == -1) ||
+	(handle_table[slot].generation != (fd >> BLOCK_HANDLE_SLOT_BITS))) {
+	    return (-1);
+    }
 
-	    // Jot down the file handle
-	    memcpy(temp_buf + bytes_written, &all_files[i].handle, sizeof(int16_t));
-	    bytes_written += 2;
+    return (handle_table[slot].file);
+}
 
-	    // Jot down the file length
-	    memcpy(temp_buf + bytes_written, &all_files[i].length, sizeof(uint32_t));
-	    bytes_written += 4;
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: rebind_handles
+// Description	: Point every open file description of a file at another index, or release them all
+//
+// Inputs	: from - the index of the file in all_files
+//		  to - the new index of the file, -1 to release the handles
+// Outputs	: none
 
-	    // We do not need to jot down the status nor the seek position b/c when we restart the block system, these files will be closed
-	    // Jot down the number of frames that the file uses
-	    memcpy(temp_buf + bytes_written, &all_files[i].num_frames, sizeof(uint16_t));
-	    bytes_written += 2;
+static void rebind_handles(int32_t from, int32_t to)
+{
+    // Nothing to scan for if the file is not open
+    if (all_files[from].open_count == 0) {
+	    return;
+    }
 
-	    // Now we need to jot down which frames correspond with this file
-	    for (int j = 0; j < all_files[i].num_frames; j++) {
-		   memcpy(temp_buf + bytes_written, &all_files[i].frames[j], sizeof(uint16_t));
-		   bytes_written += 2;
+    for (uint16_t slot = 0; slot < BLOCK_MAX_OPEN_FILES; slot++) {
+	    if (handle_table[slot].file != from) {
+		    continue;
 	    }
 
-	    // All file data for the current file has been stored!
-    }
-
-    // All file data is stored in the buffer!
-    // Populate the rest of the buffer with bytes of 0, to get rid of garbage data and signify the end of my metadata
-    for (int i = bytes_written; i < BLOCK_FRAME_SIZE; i++) {
-	    temp_buf[i] = 0;
+	    if (to == -1) {
+		    // The slot is also the low bits of the handle
+		    release_handle(slot);
+	    }
+	    else {
+		    handle_table[slot].file = to;
+	    }
     }
+}
 
-    // Alright! Metadata should now correctly be stored in the first frame of the block system.
-
-    // Write to the block system...
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: generate_register
+// Description	: Take in kr1, fm1, cs1, rt1 to generate the register to communicate with hardware device
+//
+// Inputs	: kr1, fm1, cs1, rt1
+// Outputs	: int64_t type register
 
-    // Create a pointer to store the checksum of the received framedata
-    uint32_t *fr_checksum = malloc(sizeof(uint32_t));
+uint64_t generate_register(uint8_t kr1, uint16_t fm1, uint32_t cs1, uint8_t rt1)
+{
+	uint64_t reg = 0x0, tempkr1, tempfm1, tempcs1, temprt1;
 
-    // Create a variable to store the value at the pointer
-    uint32_t fr_checksum_value;
+	// Shift each variable to its designated spot in the 64-bit register
+	tempkr1 = ((uint64_t)kr1) << 56;
+	tempfm1 = ((uint64_t)fm1) << 40;
+	tempcs1 = ((uint64_t)cs1) << 32;
+	tempcs1 = tempcs1 >> 24;
+	tempcs1 = tempcs1 & 0x000000ffffffffff;
+	temprt1 = ((uint64_t)rt1);
+	
+	// Combine all variables into one 64-bit register
+	reg = tempkr1|tempfm1|tempcs1|temprt1;
 
-    compute_frame_checksum(temp_buf, fr_checksum);
-    fr_checksum_value = (uint32_t) *fr_checksum;
+	return reg;
+}
 
-    opcode = BLOCK_OP_WRFRME;
-    reg = generate_register(opcode, 0, fr_checksum_value, 0);
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: flush_write_buffer
+// Description	: Write out what the write buffer of a handle holds and empty it
+//
+// Inputs	: slot - the slot of the handle in the handle table
+// Outputs	: 0 if successful, -1 if failure
 
-    return_reg = block_io_bus(reg, temp_buf);
+static int flush_write_buffer(uint16_t slot)
+{
+    struct file_handle *desc = &handle_table[slot];
+    uint32_t len = desc->wbuf_len;
 
-    uint64_t rt_temp = return_reg << 56;
-    rt_temp = rt_temp >> 56;
-    int8_t rt1 = rt_temp;
+    if (len == 0) {
+	    return (0);
+    }
 
-    if (rt1 == -1) {
+    // Empty the buffer before writing, so the write does not try to flush it again
+    desc->wbuf_len = 0;
+    all_files[desc->file].buffered_handles--;
+    if (file_writev(desc->file, &(struct iovec) {desc->wbuf, len}, 1, desc->wbuf_pos) != len) {
 	    return (-1);
     }
 
-    while (rt1 == 2) {
-	    // Invalid checksum
-	    return_reg = block_io_bus(reg, temp_buf);
-
-	    rt_temp = return_reg << 56;
-	    rt_temp = rt_temp >> 56;
-	    rt1 = rt_temp;
-    }
+    return (0);
+}
 
-    // The filesystem metadata for my data structures has been written to the block system!
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: flush_file_buffers
+// Description	: Write out every write buffer holding data for a file, so that reads and other writes see it
+//
+// Inputs	: index - the index of the file in all_files
+// Outputs	: 0 if successful, -1 if failure
 
+static int flush_file_buffers(int32_t index)
+{
+    // Skip the scan when no handle has anything buffered for the file
+    for (uint16_t slot = 0; (slot < BLOCK_MAX_OPEN_FILES) && (all_files[index].buffered_handles > 0); slot++) {
+	    if ((handle_table[slot].file == index) && (flush_write_buffer(slot) == -1)) {
+		    return (-1);
+	    }
+    }
 
-    // Power off the filesystem
-    opcode = BLOCK_OP_POWOFF;
-    reg = generate_register(opcode, 0, 0, 0);
-    return_reg = block_io_bus(reg, 0);
+    return (0);
+}
 
-    return_reg = return_reg << 56;
-    return_reg = return_reg >> 56;
-    rt1 = return_reg;
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: flush_all_buffers
+// Description	: Write out the write buffer of every open handle
+//
+// Inputs	: none
+// Outputs	: 0 if successful, -1 if failure
 
-    if (rt1 == -1) {
-	return (-1);
+static int flush_all_buffers(void)
+{
+    for (uint16_t slot = 0; slot < BLOCK_MAX_OPEN_FILES; slot++) {
+	    if ((handle_table[slot].file != -1) && (flush_write_buffer(slot) == -1)) {
+		    return (-1);
+	    }
     }
 
-    free(temp_buf);
-    temp_buf = NULL;
-    free(fr_checksum);
-    fr_checksum = NULL;
-
-    // Return successfully
     return (0);
-
-    // Close cache
-    close_block_cache();
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : block_open
-// Description  : This function opens the file and returns a file handle
+// Function	: buffer_write
+// Description	: Collect a write at the seek position of a handle in its write buffer, writing the buffer
+//		  out whenever it reaches the end of a frame
 //
-// Inputs       : path - filename of the file to open
-// Outputs      : file handle if successful, -1 if failure
+// Inputs	: slot - the slot of the handle in the handle table
+//		  buf - pointer to buffer to write from
+//		  count - number of bytes to write
+// Outputs	: bytes written if successful, -1 if failure
 
-int16_t block_open(char* path)
+static int64_t buffer_write(uint16_t slot, const char *buf, uint64_t count)
 {
-    int index;
-    int dif;
-    index = -1;
+    struct file_handle *desc = &handle_table[slot];
+    uint64_t done = 0;
+    uint64_t room;
 
-    // Go through each file and observe if file path exists
-    for (int i = 0; i < num_files; i++) {
-	    // Compare the path in the list vs. the specified path
-	    dif = strcmp(all_files[i].path, (char *) path);
-	    if (dif == 0) {
-		    // We found the file!
-		    index = i;
-		    break;
-	    }
+    // The file can not grow past BLOCK_MAX_FILE_SIZE
+    if ((count > BLOCK_MAX_FILE_SIZE) || (desc->seek_pos + count > BLOCK_MAX_FILE_SIZE)) {
+	    return (-1);
     }
 
-    if (index == -1) {
-	    // This means we never found a matching file, so let's start a new file
-	    index = num_files;
-	    if (num_files > BLOCK_MAX_TOTAL_FILES) {
+    // Only sequential writes are collected, anything else writes out what came before it
+    if ((desc->wbuf_len > 0) && (desc->seek_pos != desc->wbuf_pos + desc->wbuf_len)) {
+	    if (flush_write_buffer(slot) == -1) {
 		    return (-1);
 	    }
+    }
 
-	    all_files = (struct file*) realloc(all_files, sizeof(struct file) * (num_files + 1));
-	    
-	    strcpy(all_files[index].path, path);
+    if ((desc->wbuf == NULL) && ((desc->wbuf = malloc(BLOCK_FRAME_SIZE)) == NULL)) {
+	    return (-1);
+    }
 
-	    // Open the file
-	    all_files[index].status = OPEN;
+    while (done < count) {
+	    // Whole frames gain nothing from the buffer, so once it is empty the rest goes straight to the file
+	    if ((desc->wbuf_len == 0) && (count - done >= BLOCK_FRAME_SIZE)) {
+		    if (file_writev(desc->file, &(struct iovec) {(char *) buf + done, count - done}, 1, desc->seek_pos + done) == -1) {
+			    return (-1);
+		    }
+		    break;
+	    }
 
-	    // Set length to 0
-	    all_files[index].length = 0;
+	    if (desc->wbuf_len == 0) {
+		    desc->wbuf_pos = desc->seek_pos + done;
+		    all_files[desc->file].buffered_handles++;
+	    }
 
-	    // Set seek position to 0
-	    all_files[index].seek_pos = 0;
-		    
-	    // Establish a file handle
-	    int32_t randomNum;
-	    randomNum = getRandomValue(0, UINT32_MAX);
-	    randomNum = randomNum >> 16;
-	    int16_t fd = (int16_t) randomNum;
-	    all_files[index].handle = fd;
-
-	    // Assign a frame to this new file
-	    all_files[index].frames = malloc(sizeof(uint16_t));
-	    printf("Error: %s\n", strerror(errno));
-
-	    // Reference the number of frames used overall to determine which frame can be used to represent the beginning of this file
-	    // If 0 frames have been used thus far, then this file can start from frame 0
-	    all_files[index].frames[0] = num_frames_used + 1; // (num_frames_used + 1 b/c we need to reserve frame 0 for file metadata)
-	    
-	    all_files[index].num_frames = 1;
-	    num_frames_used++;
-	    num_files++;
-    }
-    
-    // Return the file handle
-    return (all_files[index].handle);
+	    // The buffer only ever holds bytes of one frame
+	    room = BLOCK_FRAME_SIZE - (desc->wbuf_pos % BLOCK_FRAME_SIZE) - desc->wbuf_len;
+	    if (room > count - done) {
+		    room = count - done;
+	    }
+	    memcpy(desc->wbuf + desc->wbuf_len, buf + done, room);
+	    desc->wbuf_len += room;
+	    done += room;
+
+	    // Reaching the end of the frame writes it out
+	    if ((desc->wbuf_pos + desc->wbuf_len) % BLOCK_FRAME_SIZE == 0) {
+		    if (flush_write_buffer(slot) == -1) {
+			    return (-1);
+		    }
+	    }
+    }
+
+    return (count);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : block_close
-// Description  : This function closes the file
+// Function	: frame_in_use
+// Description	: Check the frame map to see if a frame is in use
 //
-// Inputs       : fd - the file descriptor
-// Outputs      : 0 if successful, -1 if failure
+// Inputs	: addr - the block and frame to check
+// Outputs	: 1 if the frame is in use, 0 if it is free
 
-int16_t block_close(int16_t fd)
+static int frame_in_use(BlockAddress addr)
 {
-    int index;
-    index = -1;
+    uint64_t *map = frame_map[BLOCK_ADDRESS_BLOCK(addr)];
+    BlockFrameIndex frm = BLOCK_ADDRESS_FRAME(addr);
 
-    // Go through each file and observe if the file handle exists
-    for (int i = 0; i < num_files; i++) {
-	    // Compare the path in the list vs. the specified path
-	    if (fd == all_files[i].handle) {
-		    // We found the file!
-		    index = i;
-		    break;
-	    }
-    }
+    return ((map[frm / 64] >> (frm % 64)) & 1);
+}
 
-    if (index == -1) {
-	    // This means we never found a matching file, so return -1
-	    return (-1);
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: pick_block
+// Description	: Choose the block to allocate a frame from when the caller has no preference. The
+//		  current block wins while it has room so the controller is not switched needlessly,
+//		  after that the emptiest block is used.
+//
+// Inputs	: none
+// Outputs	: the block to allocate from, -1 if every block is full
+
+static int32_t pick_block(void)
+{
+    int32_t best = -1;
+
+    if (block_frames_used[current_block] < BLOCK_BLOCK_SIZE) {
+	    return (current_block);
     }
-    else if (all_files[index].status == CLOSED) {
-	    // This means the file was already closed
-	    return (-1);
+
+    for (int32_t blk = 0; blk < BLOCK_NUM_BLOCKS; blk++) {
+	    if ((block_frames_used[blk] < BLOCK_BLOCK_SIZE) &&
+		((best == -1) || (block_frames_used[blk] < block_frames_used[best]))) {
+		    best = blk;
+	    }
     }
-    
-    all_files[index].status = CLOSED;
 
-    // Return successfully
-    return (0);
+    return (best);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : block_read
-// Description  : Reads "count" bytes from the file handle "fh" into the
-//                buffer "buf"
+// Function	: allocate_frame
+// Description	: Take a free frame from the frame map, preferring the hinted frame so files stay
+//		  contiguous, and the hinted block so files stay within one block
 //
-// Inputs       : fd - filename of the file to read from
-//                buf - pointer to buffer to read into
-//                count - number of bytes to read
-// Outputs      : bytes read if successful, -1 if failure
+// Inputs	: hint - the frame the caller would like (usually the one after the file's last frame), 0 for none
+// Outputs	: the address of the frame, 0 if the block system is full
 
-int32_t block_read(int16_t fd, void* buf, int32_t count)
+static BlockAddress allocate_frame(BlockAddress hint)
 {
-    // First check to see if the file exists
-    int index;
-    index = -1;
-    // Go through each file and observe if the file handle exists
-    for (int i = 0; i < num_files; i++) {
-	    //  Compare the path in the list vs. the specified path
-	    if (fd == all_files[i].handle) {
-		    // We found the file!
-		    index = i;
-		    break;
-	    }
+    int32_t blk;
+    uint32_t word;
+    uint64_t *map;
+    BlockAddress addr = 0;
+
+    if ((hint != 0) && (BLOCK_ADDRESS_BLOCK(hint) < BLOCK_NUM_BLOCKS) && !frame_in_use(hint)) {
+	    addr = hint;
     }
+    else {
+	    // Stay in the block of the hint if it has room
+	    blk = -1;
+	    if ((hint != 0) && (BLOCK_ADDRESS_BLOCK(hint) < BLOCK_NUM_BLOCKS) &&
+		(block_frames_used[BLOCK_ADDRESS_BLOCK(hint)] < BLOCK_BLOCK_SIZE)) {
+		    blk = BLOCK_ADDRESS_BLOCK(hint);
+	    }
+	    else {
+		    blk = pick_block();
+	    }
 
-    if (index == -1) {
-	    // This means we never found a matching file, so return -1
-	    return (-1);
+	    // Continue from the last word that had room, so the search is O(1) amortized
+	    if (blk != -1) {
+		    map = frame_map[blk];
+		    for (uint32_t i = 0; i < BLOCK_FRAME_MAP_WORDS; i++) {
+			    word = (frame_map_cursor[blk] + i) % BLOCK_FRAME_MAP_WORDS;
+			    if (map[word] != UINT64_MAX) {
+				    frame_map_cursor[blk] = word;
+				    addr = BLOCK_ADDRESS(blk, word * 64 + __builtin_ctzll(~map[word]));
+				    break;
+			    }
+		    }
+	    }
     }
 
-    // Second, check to see if the file is open
-    else if (all_files[index].status == CLOSED) {
-	    // This means the file is not open
-	    return (-1);
+    // Frame 0 of block 0 is the superblock, so it doubles as the "no frame" value
+    if (addr == 0) {
+	    return (0);
     }
 
-    // Third determine how many bytes can be read, factoring in the end of the file
-    uint32_t seek = all_files[index].seek_pos;
-    uint32_t length = all_files[index].length;
+    mark_frame_used(addr);
 
-    // If we will reach the end of the file within count bytes, then reduce count bytes so we don't go past the end of the file
-    if (length - seek < count) {
-	    count = length - seek;
+    return (addr);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: allocate_run
+// Description	: Take a run of free frames within one block. The run continues the hinted frame if it is
+//		  free, otherwise it is the first free run of "want" frames, or the longest run if none is
+//		  that long, looking at the hinted block first
+//
+// Inputs	: hint - the frame the caller would like the run to start at, 0 for none
+//		  want - the number of frames the caller would like
+//		  got - set to the number of frames in the run, at most "want"
+// Outputs	: the address of the first frame of the run, 0 if the block system is full
+
+static BlockAddress allocate_run(BlockAddress hint, uint32_t want, uint32_t *got)
+{
+    BlockAddress best = 0;
+    uint32_t best_len = 0;
+    uint32_t len;
+    int32_t first;
+    int32_t blk;
+
+    // An extent can not describe more frames than this
+    if (want > UINT16_MAX) {
+	    want = UINT16_MAX;
     }
 
-    // Fourth, determine which frame we need to read from, factoring in seek_pos
-    int16_t frame_index;
-    
-    // Use floor division to figure out which frame we want to look at
-    frame_index = seek / BLOCK_FRAME_SIZE;
+    if ((hint != 0) && (BLOCK_ADDRESS_BLOCK(hint) < BLOCK_NUM_BLOCKS) && !frame_in_use(hint)) {
+	    // Continue the caller's run for as long as the frames after it are free
+	    best = hint;
+	    while ((best_len < want) && (BLOCK_ADDRESS_FRAME(hint) + best_len < BLOCK_BLOCK_SIZE) && !frame_in_use(hint + best_len)) {
+		    best_len++;
+	    }
+    }
+    else {
+	    first = ((hint != 0) && (BLOCK_ADDRESS_BLOCK(hint) < BLOCK_NUM_BLOCKS)) ? BLOCK_ADDRESS_BLOCK(hint) : pick_block();
+	    if (first == -1) {
+		    return (0);
+	    }
 
-    // Use modulo to figure out the seek position relative to the beginning of the frame
-    seek = seek % BLOCK_FRAME_SIZE;
+	    for (int32_t i = 0; (i < BLOCK_NUM_BLOCKS) && (best_len < want); i++) {
+		    blk = (first + i) % BLOCK_NUM_BLOCKS;
+		    if (block_frames_used[blk] == BLOCK_BLOCK_SIZE) {
+			    continue;
+		    }
 
-    // Now the seek position correctly positions us in the given frame
-    // frame_index tells us the correct frame index to start looking at within all_files[index].frames
+		    // Scan the block's map for free runs, stepping over full words at once
+		    len = 0;
+		    for (uint32_t frm = 0; (frm < BLOCK_BLOCK_SIZE) && (best_len < want); frm++) {
+			    if ((frm % 64 == 0) && (frame_map[blk][frm / 64] == UINT64_MAX)) {
+				    len = 0;
+				    frm += 63;
+				    continue;
+			    }
+			    if (frame_in_use(BLOCK_ADDRESS(blk, frm))) {
+				    len = 0;
+				    continue;
+			    }
 
-    // Keep track of the number of bytes left to write
-    uint32_t count_remaining;
-    count_remaining = count;
+			    len++;
+			    if (len > best_len) {
+				    best_len = len;
+				    best = BLOCK_ADDRESS(blk, frm + 1 - len);
+			    }
+		    }
+	    }
+    }
 
-    // Create a temporary array to store the content of a frame
-    char *read = malloc(BLOCK_FRAME_SIZE);
+    // The superblock is always in use, so a run never starts at address 0
+    if (best_len == 0) {
+	    return (0);
+    }
 
-    // Create a variable to store the checksum of the received framedata
-    uint32_t fr_checksum;
+    for (uint32_t i = 0; i < best_len; i++) {
+	    mark_frame_used(best + i);
+    }
+    *got = best_len;
 
-    // Make it easier to observe what the current frame we're reading from is
-    uint16_t cur_frame;
-    
-    // Track how many bytes to read from current frame
-    uint32_t bytes_to_read_in_cur_frame;
-    bytes_to_read_in_cur_frame = 0;
+    return (best);
+}
 
-    // Track how many bytes have been read so far for the file
-    uint32_t bytes_so_far;
-    bytes_so_far = 0;
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: mark_frame_used
+// Description	: Set a frame's bit in the frame map and count it as used
+//
+// Inputs	: addr - the block and frame to take
+// Outputs	: none
 
-    // The number of frames associated with the current file
-    uint16_t num_frames;
-    num_frames = all_files[index].num_frames;
+static void mark_frame_used(BlockAddress addr)
+{
+    frame_map[BLOCK_ADDRESS_BLOCK(addr)][BLOCK_ADDRESS_FRAME(addr) / 64] |= (uint64_t) 1 << (BLOCK_ADDRESS_FRAME(addr) % 64);
+    block_frames_used[BLOCK_ADDRESS_BLOCK(addr)]++;
+    frame_map_dirty = 1;
+    num_frames_used++;
+}
 
-    // Declare a variable to keep track of the checksum returned by the frame
-    uint32_t frame_checksum;
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: free_frame
+// Description	: Return a frame to the frame map
+//
+// Inputs	: addr - the block and frame to free
+// Outputs	: none
 
-    // Variable to hold the return code of block_io_bus
-    int8_t rt;
+static void free_frame(BlockAddress addr)
+{
+    struct pending_frame *p;
 
-    // Declare read opcode
-    BlockOpCodes opcode = BLOCK_OP_RDFRME;
+    // Writes still waiting on the frame must not land on whoever gets it next
+    if ((p = find_pending(addr)) != NULL) {
+	    drop_pending(p);
+    }
+    // A clean copy must go too, the next file to get the frame would be served the old contents
+    invalidate_block_cache(BLOCK_ADDRESS_BLOCK(addr), BLOCK_ADDRESS_FRAME(addr));
 
-    // Create a register
-    BlockXferRegister reg;
+    frame_map[BLOCK_ADDRESS_BLOCK(addr)][BLOCK_ADDRESS_FRAME(addr) / 64] &= ~((uint64_t) 1 << (BLOCK_ADDRESS_FRAME(addr) % 64));
+    block_frames_used[BLOCK_ADDRESS_BLOCK(addr)]--;
+    frame_map_dirty = 1;
+    num_frames_used--;
+}
 
-    // Create a variable to hold return reg
-    BlockXferRegister return_reg;
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: next_frame_hint
+// Description	: The frame right after a file's last frame, which would keep the file contiguous
+//
+// Inputs	: index - the index of the file in all_files
+// Outputs	: the address of the frame, 0 if the file has no frames or ends in a hole
 
-    // Create a buffer for cache data
-    void *cache_data;
+static BlockAddress next_frame_hint(int32_t index)
+{
+    struct file *f = &all_files[index];
 
-    for (; frame_index < num_frames && count_remaining > 0; frame_index++) {
-	    // Iterate through frames in the list, reading content from each frame at a time
-	    cur_frame = all_files[index].frames[frame_index];
+    if ((f->num_extents == 0) || (f->extents[f->num_extents - 1].start == BLOCK_HOLE)) {
+	    return (0);
+    }
 
-	    // If we are reading fewer bytes than the entire frame, adjust bytes_to_read_in_cur_frame to reflect that
-	    if (count_remaining < BLOCK_FRAME_SIZE) {
-		    bytes_to_read_in_cur_frame = count_remaining;
-	    }
+    return (f->extents[f->num_extents - 1].start + f->extents[f->num_extents - 1].count);
+}
 
-	    // Otherwise set bytes_to_read_in_cur_frame equal to the entire length of the frame
-	    else {
-		    bytes_to_read_in_cur_frame = BLOCK_FRAME_SIZE;
-	    }
-	    
-	    // Attempt to read from cache
-	    cache_data = get_block_cache(0, cur_frame);
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: grow_file
+// Description	: Allocate a frame and add it to the end of a file, right after the file's last frame if possible
+//
+// Inputs	: index - the index of the file in all_files
+// Outputs	: 0 if successful, -1 if failure
 
-	    if (cache_data == NULL) {
-		    // Generate register
-		    reg = generate_register(opcode, cur_frame, 0, 0);
+static int grow_file(int32_t index)
+{
+    BlockAddress frm;
 
-		    // Pass through io bus
-		    return_reg = block_io_bus(reg, read);
-	    
-		    uint64_t rt_temp = return_reg << 56;
-		    rt_temp = rt_temp >> 56;
-		    rt = rt_temp;
+    frm = allocate_frame(next_frame_hint(index));
+    if (frm == 0) {
+	    return (-1);
+    }
 
-		    if (rt == -1) {
-			    return (-1);
-		    }
+    if (append_frame(index, frm) == -1) {
+	    free_frame(frm);
+	    return (-1);
+    }
 
-		    // Observe the checksum of the frame returned by block_io_bus
-		    return_reg = return_reg << 24;
-		    return_reg = return_reg >> 32;
-		    frame_checksum = return_reg;
+    return (0);
+}
 
-		    // Calculate the checksum of the received framedata
-		    compute_frame_checksum(read, &fr_checksum);
-	    
-		    while (frame_checksum != fr_checksum) {
-			    // Checksums do not match! Call block_io_bus until they match
-			    reg = generate_register(opcode, cur_frame, 0, 0);
-			    return_reg = block_io_bus(reg, read);
-		    
-			    rt_temp = return_reg << 56;
-			    rt_temp = rt_temp >> 56;
-			    rt = rt_temp;
-
-			    if (rt == -1) {
-				    return (-1);
-			    }
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: reserve_frames
+// Description	: Allocate frames at the end of a file until it has the given number of frames, taking
+//		  them in as few contiguous runs as the frame map allows
+//
+// Inputs	: index - the index of the file in all_files
+//		  frames - the number of frames the file should have
+// Outputs	: 0 if successful, -1 if failure (the frames added so far stay with the file)
 
-			    compute_frame_checksum(read, &fr_checksum);
+static int reserve_frames(int32_t index, uint32_t frames)
+{
+    struct file *f = &all_files[index];
+    BlockAddress start;
+    uint32_t got;
+
+    while (f->num_frames < frames) {
+	    // A single frame comes from the allocator's cursor, there is no run to look for
+	    if (frames - f->num_frames == 1) {
+		    if (grow_file(index) == -1) {
+			    return (-1);
 		    }
-
-	    	// Copy bytes_to_read_in_cur_frame bytes from read to the buf
-	    	memcpy(buf + bytes_so_far, read+seek, bytes_to_read_in_cur_frame); // Copy bytes_to_read_in_cur_frame bytes from read to buf + offset
+		    continue;
 	    }
-	    else {
-	    	    memcpy(buf + bytes_so_far, cache_data + seek, bytes_to_read_in_cur_frame);
+
+	    start = allocate_run(next_frame_hint(index), frames - f->num_frames, &got);
+	    if (start == 0) {
+		    return (-1);
 	    }
-	    
-	    seek = 0;
 
-	    bytes_so_far += bytes_to_read_in_cur_frame;
-	    count_remaining -= bytes_to_read_in_cur_frame;
+	    for (uint32_t i = 0; i < got; i++) {
+		    if (append_frame(index, start + i) == -1) {
+			    // Give back the part of the run the file could not take
+			    while (i < got) {
+				    free_frame(start + i++);
+			    }
+			    return (-1);
+		    }
+	    }
     }
-    
-    all_files[index].seek_pos += count;
-    free(read);
-    read = NULL;
 
-    // Return successfully
-    return (count);
+    return (0);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : block_write
-// Description  : Writes "count" bytes to the file handle "fh" from the
-//                buffer  "buf"
+// Function	: shrink_file
+// Description	: Free the frames at the end of a file until it has the given number of frames
 //
-// Inputs       : fd - filename of the file to write to
-//                buf - pointer to buffer to write from
-//                count - number of bytes to write
-// Outputs      : bytes written if successful, -1 if failure
+// Inputs	: index - the index of the file in all_files
+//		  keep - the number of frames the file keeps
+// Outputs	: none
 
-int32_t block_write(int16_t fd, void* buf, int32_t count)
+static void shrink_file(int32_t index, uint32_t keep)
 {
-    // First check to see if the file exists
-    int index;
-    index = -1;
-    //Go through eaach file and observe if the file handle exists
-    for (int i = 0; i < num_files; i++) {
-	    // Compare the path in the list vs. the specified path
-	    if (fd == all_files[i].handle) {
-		    // We found the file!
-		    index = i;
-		    break;
+    struct file *f = &all_files[index];
+    struct extent *last;
+
+    while (f->num_frames > keep) {
+	    // Free frames off the end of the last extent, dropping it once it is empty, holes have nothing to free
+	    last = &f->extents[f->num_extents - 1];
+	    last->count--;
+	    f->num_frames--;
+	    if (last->start != BLOCK_HOLE) {
+		    free_frame(last->start + last->count);
+	    }
+
+	    if (last->count == 0) {
+		    f->num_extents--;
 	    }
     }
+}
 
-    if (index == -1) {
-	    // This means we never found a matching file, so return -1
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: reserve_extents
+// Description	: Make room for a number of extents in a file's list, doubling the list when it is full so
+//		  adding extents one at a time stays linear
+//
+// Inputs	: index - the index of the file in all_files
+//		  count - the number of extents the list needs room for
+// Outputs	: 0 if successful, -1 if failure
+
+static int reserve_extents(int32_t index, uint32_t count)
+{
+    struct file *f = &all_files[index];
+    struct extent *grown;
+    uint32_t capacity;
+
+    // The record stores the number of extents in 16 bits, and the largest count marks an inline record
+    if (count > BLOCK_MAX_EXTENTS) {
 	    return (-1);
     }
+    if (count <= f->extents_capacity) {
+	    return (0);
+    }
 
-    // Second, check to see if the file is open
-    else if (all_files[index].status == CLOSED) {
-	    // This means the file is not open
+    capacity = (f->extents_capacity == 0) ? BLOCK_MIN_EXTENT_CAPACITY : f->extents_capacity * 2;
+    if (capacity < count) {
+	    capacity = count;
+    }
+    grown = realloc(f->extents, sizeof(struct extent) * capacity);
+    if (grown == NULL) {
 	    return (-1);
     }
+    f->extents = grown;
+    f->extents_capacity = capacity;
 
-    // Third, determine if we need to allocate additional frames to accomodate for a larger file
-    // Check to see if seek_pos + count > length
-    uint32_t length;
-    length = all_files[index].length;
-    uint32_t seek;
-    seek = all_files[index].seek_pos;
-
-    if (seek + count > length) {
-	    // We will need to adjust the length of the file
-	    all_files[index].length = seek + count;
-	    length = all_files[index].length;
+    return (0);
+}
 
-   	    // Determine if we need to allocate additional frames
-  	    while (length >= all_files[index].num_frames * BLOCK_FRAME_SIZE) {
-    	    	// We take up more than num_frames frames, so assign a new frame to the file
-  	    	all_files[index].num_frames++;
-	    	all_files[index].frames = (uint16_t *) realloc(all_files[index].frames, sizeof(uint16_t) * all_files[index].num_frames);	
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: append_frame
+// Description	: Add a frame to the end of a file, growing its last extent when the frame continues it
+//
+// Inputs	: index - the index of the file in all_files
+//		  addr - the block and frame to add
+// Outputs	: 0 if successful, -1 if failure
 
-		// Example: if num_frames == 2, then metadata is in frame 0, this file takes up indices 1 and 2, so assign index 1 to a new frame 3
-		all_files[index].frames[all_files[index].num_frames-1] = num_frames_used + 1;
-		
-		num_frames_used++;
-		length -= BLOCK_FRAME_SIZE;
+static int append_frame(int32_t index, BlockAddress addr)
+{
+    struct file *f = &all_files[index];
+    struct extent *last;
+
+    // Frames are mostly handed out in order, so the frame usually just makes the last run longer
+    // Runs never span two blocks, so walking a run never switches the controller
+    if (f->num_extents > 0) {
+	    last = &f->extents[f->num_extents - 1];
+	    if ((last->start != BLOCK_HOLE) && (last->start + last->count == addr) && (last->count < UINT16_MAX) &&
+		(BLOCK_ADDRESS_BLOCK(last->start) == BLOCK_ADDRESS_BLOCK(addr))) {
+		    last->count++;
+		    f->num_frames++;
+		    return (0);
 	    }
     }
 
-    // Now that additional frames have been allocated, let's begin writing to a frames
-    // Find the first frame that we need to write to, factoring in seek_pos
-    uint16_t frame_index;
-    
-    // Floor division to get frame index
-    frame_index = seek / BLOCK_FRAME_SIZE;
+    // Otherwise the file is fragmented here, so start a new extent
+    if (reserve_extents(index, f->num_extents + 1) == -1) {
+	    return (-1);
+    }
+    f->extents[f->num_extents].logical = f->num_frames;
+    f->extents[f->num_extents].start = addr;
+    f->extents[f->num_extents].count = 1;
+    f->num_extents++;
+    f->num_frames++;
 
-    // Modulo to get seek relative to start of frame
-    seek = seek % BLOCK_FRAME_SIZE;
+    return (0);
+}
 
-    // Variable that stores the current frame in the memory system that we want to look at
-    uint16_t cur_frame;
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: append_hole
+// Description	: Add frames that were never written to the end of a file as a hole, which takes no
+//		  frames from the frame map
+//
+// Inputs	: index - the index of the file in all_files
+//		  frames - the number of frames to add
+// Outputs	: 0 if successful, -1 if failure
 
-    // We are now on the correct frame and at the correct seek position relative to the start of the frame
+static int append_hole(int32_t index, uint32_t frames)
+{
+    struct file *f = &all_files[index];
+    struct extent *last;
+    uint32_t count;
 
-    // Track how many bytes are left to write
-    uint32_t bytes_left_to_write;
-    bytes_left_to_write = count;
-    
-    // Track how many bytes have been written so far
-    uint32_t bytes_written;
-    bytes_written = 0;
+    while (frames > 0) {
+	    count = (frames > UINT16_MAX) ? UINT16_MAX : frames;
 
-    // Create a temporary buffer for reading/writing
-    char *temp_buf = malloc(BLOCK_FRAME_SIZE);
+	    // A hole right after another hole just makes it longer
+	    last = (f->num_extents > 0) ? &f->extents[f->num_extents - 1] : NULL;
+	    if ((last != NULL) && (last->start == BLOCK_HOLE) && (last->count + count <= UINT16_MAX)) {
+		    last->count += count;
+	    }
+	    else {
+		    if (reserve_extents(index, f->num_extents + 1) == -1) {
+			    return (-1);
+		    }
+		    f->extents[f->num_extents].logical = f->num_frames;
+		    f->extents[f->num_extents].start = BLOCK_HOLE;
+		    f->extents[f->num_extents].count = count;
+		    f->num_extents++;
+	    }
+	    f->num_frames += count;
+	    frames -= count;
+    }
 
-    // Create a variable to store the checksum of the received framedata
-    uint32_t fr_checksum;
+    return (0);
+}
 
-    // Create an opcode variable
-    BlockOpCodes opcode;
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: find_extent
+// Description	: Find the extent holding a frame of a file with a binary search of the extents
+//
+// Inputs	: index - the index of the file in all_files
+//		  logical - the frame of the file, counted from the start of the file
+// Outputs	: the position of the extent in the file's list
 
-    // Create register variable
-    BlockXferRegister reg;
+static uint32_t find_extent(int32_t index, uint32_t logical)
+{
+    struct extent *extents = all_files[index].extents;
+    uint32_t lo = 0;
+    uint32_t hi = all_files[index].num_extents;
+    uint32_t mid;
+
+    // Find the last extent that starts at or before the logical frame
+    while (hi - lo > 1) {
+	    mid = (lo + hi) / 2;
+	    if (extents[mid].logical <= logical) {
+		    lo = mid;
+	    }
+	    else {
+		    hi = mid;
+	    }
+    }
 
-    // Create return register variable
-    BlockXferRegister return_reg;
+    return (lo);
+}
 
-    // Create variable to hold the checksum returned by the io bus
-    uint32_t frame_checksum;
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: file_frame
+// Description	: Map a frame of a file to its frame on the block system
+//
+// Inputs	: index - the index of the file in all_files
+//		  logical - the frame of the file, counted from the start of the file
+//		  run - set to the number of frames left in the contiguous run (or hole), including this one
+// Outputs	: the address of the frame on the block system, BLOCK_HOLE if the frame is in a hole
 
-    // Variable to hold the return code of return_reg
-    int8_t rt;
+static BlockAddress file_frame(int32_t index, uint32_t logical, uint32_t *run)
+{
+    struct extent *e = &all_files[index].extents[find_extent(index, logical)];
 
-    // Temporary register variable before obtaining rt
-    uint64_t rt_temp;
+    *run = e->count - (logical - e->logical);
+    if (e->start == BLOCK_HOLE) {
+	    return (BLOCK_HOLE);
+    }
+    return (e->start + (logical - e->logical));
+}
 
-    // Create a buffer to store cache data
-    char *cache_data;
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: fill_hole
+// Description	: Allocate a device frame for a frame of a file that is in a hole, splitting the hole
+//		  around it and joining the frame to a neighbouring run when it continues one
+//
+// Inputs	: index - the index of the file in all_files
+//		  logical - the frame of the file, counted from the start of the file
+// Outputs	: the address of the new frame, 0 if failure
 
-    // Begin a loop that continues as long as we want to continue writing bytes
-    while (bytes_left_to_write > 0) {
-	    cur_frame = all_files[index].frames[frame_index];
+static BlockAddress fill_hole(int32_t index, uint32_t logical)
+{
+    struct file *f = &all_files[index];
+    struct extent pieces[3];
+    struct extent *prev;
+    struct extent *next;
+    uint32_t at = find_extent(index, logical);
+    uint32_t before = logical - f->extents[at].logical;
+    uint32_t after = f->extents[at].count - before - 1;
+    uint32_t num_pieces = 0;
+    BlockAddress hint = 0;
+    BlockAddress addr;
+
+    // The frame right after the previous frame of the file keeps the file contiguous
+    if ((before == 0) && (at > 0) && (f->extents[at - 1].start != BLOCK_HOLE)) {
+	    hint = f->extents[at - 1].start + f->extents[at - 1].count;
+    }
+    if (((addr = allocate_frame(hint)) == 0) || (reserve_extents(index, f->num_extents + 2) == -1)) {
+	    if (addr != 0) {
+		    free_frame(addr);
+	    }
+	    return (0);
+    }
 
-	    // There are three different scenarios when writing
-	    // 1. We are writing in the middle of a frame and preserving the beginning
-	    // 2. We are writing an entire frame
-	    // 3. We are writing the beginning of a frame and preserving the end
+    // The hole becomes up to three extents: the hole before the frame, the frame, the hole after it
+    if (before > 0) {
+	    pieces[num_pieces++] = (struct extent) {f->extents[at].logical, BLOCK_HOLE, before};
+    }
+    pieces[num_pieces++] = (struct extent) {logical, addr, 1};
+    if (after > 0) {
+	    pieces[num_pieces++] = (struct extent) {logical + 1, BLOCK_HOLE, after};
+    }
+    memmove(&f->extents[at + num_pieces], &f->extents[at + 1], sizeof(struct extent) * (f->num_extents - at - 1));
+    memcpy(&f->extents[at], pieces, sizeof(struct extent) * num_pieces);
+    f->num_extents += num_pieces - 1;
+    at += (before > 0);
+
+    // Join the frame to the run before it, then the run after it, when they are contiguous on the device
+    prev = (at > 0) ? &f->extents[at - 1] : NULL;
+    if ((prev != NULL) && (prev->start != BLOCK_HOLE) && (prev->start + prev->count == addr) &&
+	(prev->count < UINT16_MAX) && (BLOCK_ADDRESS_BLOCK(prev->start) == BLOCK_ADDRESS_BLOCK(addr))) {
+	    prev->count++;
+	    memmove(&f->extents[at], &f->extents[at + 1], sizeof(struct extent) * (f->num_extents - at - 1));
+	    f->num_extents--;
+	    at--;
+    }
+    next = (at + 1 < f->num_extents) ? &f->extents[at + 1] : NULL;
+    if ((next != NULL) && (next->start != BLOCK_HOLE) && (f->extents[at].start + f->extents[at].count == next->start) &&
+	(f->extents[at].count + next->count <= UINT16_MAX) && (BLOCK_ADDRESS_BLOCK(next->start) == BLOCK_ADDRESS_BLOCK(addr))) {
+	    f->extents[at].count += next->count;
+	    memmove(&f->extents[at + 1], &f->extents[at + 2], sizeof(struct extent) * (f->num_extents - at - 2));
+	    f->num_extents--;
+    }
+
+    mark_file_dirty(index);
+    return (addr);
+}
 
-	    // 1. We are writing in the middle
-	    if (seek > 0) {
-	    	// First read the frame
-		
-    		// Attempt to read from cache
-		cache_data = get_block_cache(0, cur_frame);
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: extend_file
+// Description	: Extend a file with zeroes up to "pos" before a write that starts past its end. Frames
+//		  the file already has there (the rest of its last frame, frames reserved by
+//		  block_fallocate) may hold stale bytes, so zeroes are written over them, whole frames
+//		  past those become a hole
+//
+// Inputs	: index - the index of the file in all_files
+//		  pos - the offset the write starts at
+// Outputs	: 0 if successful, -1 if failure
 
-		if (cache_data == NULL) {		
-			// Set read opcode
-			opcode = BLOCK_OP_RDFRME;
+static int extend_file(int32_t index, uint64_t pos)
+{
+    struct file *f = &all_files[index];
+    struct iovec zero_iov;
+    uint64_t end;
+    uint32_t run;
+
+    end = (uint64_t) f->num_frames * BLOCK_FRAME_SIZE;
+    if (end > pos) {
+	    end = pos;
+    }
+    while (f->length < end) {
+	    zero_iov.iov_base = (void *) zero_frame;
+	    zero_iov.iov_len = BLOCK_FRAME_SIZE - (f->length % BLOCK_FRAME_SIZE);
+	    if (zero_iov.iov_len > end - f->length) {
+		    zero_iov.iov_len = end - f->length;
+	    }
 
-			// Generate register
-			reg = generate_register(opcode, cur_frame, 0, 0);
+	    // A frame in a hole already reads as zeroes
+	    if (file_frame(index, f->length / BLOCK_FRAME_SIZE, &run) == BLOCK_HOLE) {
+		    f->length += zero_iov.iov_len;
+		    mark_file_dirty(index);
+	    }
+	    else if (file_writev(index, &zero_iov, 1, f->length) == -1) {
+		    return (-1);
+	    }
+    }
 
-			// Pass along io bus
-			return_reg = block_io_bus(reg, temp_buf);
+    // The frame the write starts in is built from zeroes by the write itself
+    if (pos / BLOCK_FRAME_SIZE > f->num_frames) {
+	    if (append_hole(index, pos / BLOCK_FRAME_SIZE - f->num_frames) == -1) {
+		    return (-1);
+	    }
+	    mark_file_dirty(index);
+    }
 
-			rt_temp = return_reg << 56;
-			rt_temp = rt_temp >> 56;
-			rt = rt_temp;
+    return (0);
+}
 
-			if (rt == -1) {
-			    return (-1);
-			}
-
-			// Calculate checksum of returned data
-			return_reg = return_reg << 24;
-			return_reg = return_reg >> 32;
-			frame_checksum = return_reg;
-
-			// Calculate the checksum of the received framedata
-			compute_frame_checksum(temp_buf, &fr_checksum);
-
-			while (frame_checksum != fr_checksum) {
-				// Checksums do not match! Call block_io_bus until they match
-				reg = generate_register(opcode, cur_frame, 0, 0);
-				return_reg = block_io_bus(reg, temp_buf);
-		    
-				rt_temp = return_reg << 56;
-				rt_temp = rt_temp >> 56;
-				rt = rt_temp;
-
-				if (rt == -1) {
-				 return (-1);
-				}
-
-				compute_frame_checksum(temp_buf, &fr_checksum);
-			}
-		}
-		else {
-			memcpy(temp_buf, cache_data, BLOCK_FRAME_SIZE);
-		}
-
-		// if we are not overwriting the rest of the frame, then just memcpy
-		if (bytes_left_to_write <= BLOCK_FRAME_SIZE - seek) {
-			memcpy(temp_buf + seek, buf, bytes_left_to_write);
-		  	bytes_written = bytes_left_to_write;
-			bytes_left_to_write = 0;
-	        }
-
-	        // else we're writing to the end of the current frame
-	        else {
-		        memcpy(temp_buf + seek, buf, BLOCK_FRAME_SIZE - seek);
-			bytes_written += (BLOCK_FRAME_SIZE - seek);
-		        bytes_left_to_write -= (BLOCK_FRAME_SIZE - seek);
-	        }
-	    
-	    	// Since we'll be either moving onto a new frame or ending, reset seek position
-	    	seek = 0;
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: write_inline
+// Description	: Write to a file that keeps its data in its metadata record
+//
+// Inputs	: index - the index of the file in all_files
+//		  iov - the list of buffers to write from
+//		  iovcnt - the number of buffers in the list
+//		  pos - offset in the file to start writing at
+//		  count - the number of bytes in the list
+// Outputs	: bytes written if successful, -1 if failure
+
+static int64_t write_inline(int32_t index, const struct iovec *iov, int iovcnt, uint64_t pos, uint64_t count)
+{
+    struct file *f = &all_files[index];
+    uint64_t at = pos;
+    char *grown;
 
+    if (pos + count > f->length) {
+	    grown = realloc(f->inline_data, pos + count);
+	    if (grown == NULL) {
+		    return (-1);
 	    }
+	    f->inline_data = grown;
 
-	    // 2. We are writing an entire frame
-	    else if (bytes_left_to_write >= BLOCK_FRAME_SIZE) {
-		    memcpy(temp_buf, buf + bytes_written, BLOCK_FRAME_SIZE);
-		    bytes_written += BLOCK_FRAME_SIZE;
-		    bytes_left_to_write -= BLOCK_FRAME_SIZE;
+	    // A gap left by writing past the end reads as zeroes
+	    if (pos > f->length) {
+		    memset(f->inline_data + f->length, 0, pos - f->length);
 	    }
+	    f->length = pos + count;
+    }
 
-	    // 3. We are writing to the beginning of a frame but not the whole frame
-	    else {
-		    // Read the frame
-		    
-		    // Attempt to read from cache
-		    void *cache_data = get_block_cache(0, cur_frame);
-		    if (cache_data == NULL) {
-			    // Set read opcode
-			    opcode = BLOCK_OP_RDFRME;
-
-			    // Generate register
-			    reg = generate_register(opcode, cur_frame, 0, 0);
-
-			    // Pass along io bus
-			    return_reg = block_io_bus(reg, temp_buf);
-
-			    rt_temp = return_reg << 56;
-			    rt_temp = rt_temp >> 56;
-			    rt = rt_temp;
-
-			    if (rt == -1) {
-			        return (-1);
-			    }
+    // Every buffer of the list goes in, one after the other
+    for (int i = 0; i < iovcnt; i++) {
+	    memcpy(f->inline_data + at, iov[i].iov_base, iov[i].iov_len);
+	    at += iov[i].iov_len;
+    }
+    mark_file_dirty(index);
 
-			    // Calculate checksum of returned data
-			    return_reg = return_reg << 24;
-			    return_reg = return_reg >> 32;
-			    frame_checksum = return_reg;
+    return (count);
+}
 
-			    // Calculate the checksum of the received framedata
-			    compute_frame_checksum(temp_buf, &fr_checksum);
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: promote_inline
+// Description	: Move the data of an inline file into frames, for a file that is growing past the inline threshold
+//
+// Inputs	: index - the index of the file in all_files
+// Outputs	: 0 if successful, -1 if failure (the file stays inline)
 
-			    while (frame_checksum != fr_checksum) {
-				    // Checksums do not match! Call block_io_bus until they match
-				    reg = generate_register(opcode, cur_frame, 0, 0);
-				    return_reg = block_io_bus(reg, temp_buf);
-		    
-				    rt_temp = return_reg << 56;
-				    rt_temp = rt_temp >> 56;
-				    rt = rt_temp;
+static int promote_inline(int32_t index)
+{
+    struct file *f = &all_files[index];
+    char *data = f->inline_data;
+    uint64_t length = f->length;
+
+    // Start over as an empty file with frames, then write the data into it like any other write
+    f->is_inline = 0;
+    f->inline_data = NULL;
+    f->length = 0;
+    mark_file_dirty(index);
+
+    if ((length > 0) && (file_writev(index, &(struct iovec) {data, length}, 1, 0) == -1)) {
+	    shrink_file(index, 0);
+	    f->is_inline = 1;
+	    f->inline_data = data;
+	    f->length = length;
+	    return (-1);
+    }
+    free(data);
 
-				    if (rt == -1) {
-				     return (-1);
-				    }
+    return (0);
+}
 
-				    compute_frame_checksum(temp_buf, &fr_checksum);
-			    }
-		    }
-		    else {
-			    memcpy(temp_buf, cache_data, BLOCK_FRAME_SIZE);
-		    }
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: select_block
+// Description	: Switch the controller to a block, unless it is already there
+//
+// Inputs	: blk - the block that the next frame operations act on
+// Outputs	: 0 if successful, -1 if failure
+
+static int select_block(BlockIndex blk)
+{
+    if (blk == current_block) {
+	    return (0);
+    }
+
+    if (switch_block(blk) == -1) {
+	    return (-1);
+    }
+    current_block = blk;
+
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: read_frame
+// Description	: Read a frame from the block system, retrying until the checksum matches
+//
+// Inputs	: addr - the block and frame to read
+//		  buf - BLOCK_FRAME_SIZE bytes to read the frame into
+// Outputs	: 0 if successful, -1 if failure
+
+static int read_frame(BlockAddress addr, void *buf)
+{
+    BlockXferRegister reg;
+    BlockXferRegister return_reg;
+    uint32_t fr_checksum;
+    uint32_t frame_checksum;
+    int8_t rt;
+
+    pthread_mutex_lock(&bus_lock);
+    if (select_block(BLOCK_ADDRESS_BLOCK(addr)) == -1) {
+	    pthread_mutex_unlock(&bus_lock);
+	    return (-1);
+    }
+    reg = generate_register(BLOCK_OP_RDFRME, BLOCK_ADDRESS_FRAME(addr), 0, 0);
+
+    do {
+	    return_reg = block_io_bus(reg, buf);
 
-		    memcpy(temp_buf, buf + bytes_written, bytes_left_to_write);
-		    bytes_written += bytes_left_to_write;
-		    bytes_left_to_write = 0;
+	    rt = (int8_t) (return_reg & 0xff);
+	    if (rt == -1) {
+		    pthread_mutex_unlock(&bus_lock);
+		    return (-1);
 	    }
 
-	    // In each case, temp_buf is now populated with the data that we want to write with
-	    // Calculate the checksum to submit to the BLOCK system
-	    compute_frame_checksum(temp_buf, &fr_checksum);
+	    // Compare the checksum returned by the io bus with the checksum of the received framedata
+	    frame_checksum = (uint32_t) ((return_reg << 24) >> 32);
+	    compute_frame_checksum(buf, &fr_checksum);
+    } while (frame_checksum != fr_checksum);
+    driver_stats.frames_read++;
+    pthread_mutex_unlock(&bus_lock);
 
-	    // Specify write opcode
-	    opcode = BLOCK_OP_WRFRME;
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: write_frame
+// Description	: Write a frame to the block system, retrying while the controller reports a checksum error
+//
+// Inputs	: addr - the block and frame to write
+//		  buf - BLOCK_FRAME_SIZE bytes to write
+// Outputs	: 0 if successful, -1 if failure
 
-	    // Generate register
-	    reg = generate_register(opcode, cur_frame, fr_checksum, 0);
+static int write_frame(BlockAddress addr, void *buf)
+{
+    BlockXferRegister reg;
+    BlockXferRegister return_reg;
+    uint32_t fr_checksum;
+    int8_t rt;
 
-	    return_reg = block_io_bus(reg, temp_buf);
+    pthread_mutex_lock(&bus_lock);
+    if (select_block(BLOCK_ADDRESS_BLOCK(addr)) == -1) {
+	    pthread_mutex_unlock(&bus_lock);
+	    return (-1);
+    }
+    compute_frame_checksum(buf, &fr_checksum);
+    reg = generate_register(BLOCK_OP_WRFRME, BLOCK_ADDRESS_FRAME(addr), fr_checksum, 0);
 
-	    rt_temp = return_reg << 56;
-	    rt_temp = rt_temp >> 56;
-	    rt = rt_temp;
+    do {
+	    return_reg = block_io_bus(reg, buf);
 
+	    rt = (int8_t) (return_reg & 0xff);
 	    if (rt == -1) {
+		    pthread_mutex_unlock(&bus_lock);
+		    return (-1);
+	    }
+    } while (rt == BLOCK_RET_CHECKSUM_ERROR);
+    driver_stats.frames_written++;
+    pthread_mutex_unlock(&bus_lock);
+
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: load_frame
+// Description	: Read a frame from the cache, or read it from the device and offer it to the cache, so the
+//		  replacement policies and the admission filter see read traffic as well as writes
+//
+// Inputs	: addr - the frame to read
+//		  buf - BLOCK_FRAME_SIZE bytes to read into
+// Outputs	: 0 if successful, -1 if failure
+
+static int load_frame(BlockAddress addr, void *buf)
+{
+    // Attempt to read from cache, which copies the frame out while no other thread can replace it
+    if (read_block_cache(BLOCK_ADDRESS_BLOCK(addr), BLOCK_ADDRESS_FRAME(addr), buf) == 0) {
+	    return (0);
+    }
+
+    if (read_frame(addr, buf) == -1) {
+	    return (-1);
+    }
+
+    // The cache may turn the frame away, the read succeeded either way
+    put_block_cache(BLOCK_ADDRESS_BLOCK(addr), BLOCK_ADDRESS_FRAME(addr), buf);
+
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: store_frame
+// Description	: Hand a modified frame to a write-back cache, or write it through to the device and cache it.
+//		  A frame identical to its cached copy is not written at all
+//
+// Inputs	: addr - the frame to write
+//		  buf - the new contents of the frame
+// Outputs	: 0 if successful, -1 if failure
+
+static int store_frame(BlockAddress addr, void *buf)
+{
+    // Rewriting a frame with the bytes the cache already holds changes nothing, the device has them or will get them
+    // from the cache, so skip the checksum and the bus write
+    if (match_block_cache(BLOCK_ADDRESS_BLOCK(addr), BLOCK_ADDRESS_FRAME(addr), buf)) {
+	    pthread_mutex_lock(&bus_lock);
+	    driver_stats.writes_elided++;
+	    pthread_mutex_unlock(&bus_lock);
+	    return (0);
+    }
+
+    // In write-back mode the cache keeps the frame dirty and writes it later. A frame it turns away is only written
+    // through, offering it again would count the same write twice in the admission filter
+    if (write_block_cache(BLOCK_ADDRESS_BLOCK(addr), BLOCK_ADDRESS_FRAME(addr), buf) == 1) {
+	    return (0);
+    }
+
+    if (write_frame(addr, buf) == -1) {
+	    return (-1);
+    }
+    if (block_cache_write_back()) {
+	    return (0);
+    }
+
+    // Write data to the cache
+    put_block_cache(BLOCK_ADDRESS_BLOCK(addr), BLOCK_ADDRESS_FRAME(addr), buf);
+
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: writeback_frame
+// Description	: Write a dirty frame for the cache, when it is evicted or flushed
+//
+// Inputs	: blk - the block of the frame
+//		  frm - the frame within the block
+//		  buf - the contents of the frame
+// Outputs	: 0 if successful, -1 if failure
+
+static int writeback_frame(BlockIndex blk, BlockFrameIndex frm, void *buf)
+{
+    return (write_frame(BLOCK_ADDRESS(blk, frm), buf));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: file_owns_frame
+// Description	: Check whether a device frame is one of a file's frames
+//
+// Inputs	: blk - the block of the frame
+//		  frm - the frame number of the frame
+//		  arg - points at the index of the file in all_files
+// Outputs	: 1 if the frame belongs to the file, 0 if not
+
+static int file_owns_frame(BlockIndex blk, BlockFrameIndex frm, void *arg)
+{
+    struct file *f = &all_files[*(int32_t *) arg];
+    BlockAddress addr = BLOCK_ADDRESS(blk, frm);
+
+    // Holes have no device frames
+    for (uint16_t i = 0; i < f->num_extents; i++) {
+	    if ((f->extents[i].start != BLOCK_HOLE) && (addr >= f->extents[i].start) &&
+		(addr - f->extents[i].start < f->extents[i].count)) {
+		    return (1);
+	    }
+    }
+
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: flush_file_frames
+// Description	: Write out every frame of a file that is still only in memory, as a pending frame or a dirty cache frame
+//
+// Inputs	: index - the index of the file in all_files
+// Outputs	: 0 if successful, -1 if failure
+
+static int flush_file_frames(int32_t index)
+{
+    BlockAddress addr;
+
+    // Nothing to do unless some frame is waiting to be written
+    if ((num_pending_frames == 0) && (block_cache_dirty_frames() == 0)) {
+	    return (0);
+    }
+
+    // A pending frame turns into a dirty cache frame in write-back mode, so those go first. Both the pending table
+    // and the cache's dirty frames are searched for the file's frames, rather than every frame of the file
+    for (uint16_t i = 0; (i < BLOCK_MAX_PENDING_FRAMES) && (num_pending_frames > 0); i++) {
+	    addr = pending_frames[i].addr;
+	    if ((addr != BLOCK_SUPERBLOCK_FRAME) && file_owns_frame(BLOCK_ADDRESS_BLOCK(addr), BLOCK_ADDRESS_FRAME(addr), &index) &&
+		(flush_pending(&pending_frames[i]) == -1)) {
 		    return (-1);
 	    }
+    }
+
+    return (flush_block_cache_matching(file_owns_frame, &index));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: find_pending
+// Description	: Look up the partial writes that are waiting on a frame
+//
+// Inputs	: addr - the frame to look for
+// Outputs	: the pending frame, NULL if there are no writes waiting on it
+
+static struct pending_frame *find_pending(BlockAddress addr)
+{
+    // Most of the time nothing is pending, so skip the scan
+    if (num_pending_frames == 0) {
+	    return (NULL);
+    }
+
+    for (uint16_t i = 0; i < BLOCK_MAX_PENDING_FRAMES; i++) {
+	    if (pending_frames[i].addr == addr) {
+		    return (&pending_frames[i]);
+	    }
+    }
+
+    return (NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: new_pending
+// Description	: Take a slot to collect partial writes to a frame in, flushing the next slot in turn if none are free
+//
+// Inputs	: addr - the frame the writes belong to
+// Outputs	: the pending frame, NULL if failure
 
-	    while (rt == 2) {
-		    // Invalid checksum
-		    return_reg = block_io_bus(reg, temp_buf);
+static struct pending_frame *new_pending(BlockAddress addr)
+{
+    struct pending_frame *p = NULL;
 
-		    rt_temp = return_reg << 56;
-		    rt_temp = rt_temp >> 56;
-		    rt = rt_temp;
+    // Use a free slot if there is one
+    for (uint16_t i = 0; (i < BLOCK_MAX_PENDING_FRAMES) && (p == NULL); i++) {
+	    if (pending_frames[i].addr == BLOCK_SUPERBLOCK_FRAME) {
+		    p = &pending_frames[i];
 	    }
-	    frame_index++;
+    }
 
-	    // Write data to the cache
-	    put_block_cache(0, cur_frame, temp_buf);
+    // Otherwise merge the slots in turn, which gives the others the longest to fill up
+    if (p == NULL) {
+	    p = &pending_frames[pending_cursor];
+	    pending_cursor = (pending_cursor + 1) % BLOCK_MAX_PENDING_FRAMES;
+	    if (flush_pending(p) == -1) {
+		    return (NULL);
+	    }
     }
 
-    free(temp_buf);
-    temp_buf = NULL;
-    all_files[index].seek_pos += count;
-   // Return successfully
-   return (count);
+    // The frame image stays allocated with the slot
+    if ((p->data == NULL) && ((p->data = malloc(BLOCK_FRAME_SIZE)) == NULL)) {
+	    return (NULL);
+    }
+
+    p->addr = addr;
+    p->num_ranges = 0;
+    num_pending_frames++;
+
+    return (p);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : block_seek
-// Description  : Seek to specific point in the file
+// Function	: add_pending_range
+// Description	: Add a written byte range to a pending frame, merging it with the ranges it touches
 //
-// Inputs       : fd - filename of the file to write to
-//                loc - offset of file in relation to beginning of file
-// Outputs      : 0 if successful, -1 if failure
+// Inputs	: p - the pending frame
+//		  start - first byte of the frame written
+//		  end - one past the last byte written
+// Outputs	: 1 if the frame is now fully written, 0 if not, -1 if there is no room for another range
 
-int32_t block_seek(int16_t fd, uint32_t loc)
+static int add_pending_range(struct pending_frame *p, uint16_t start, uint16_t end)
 {
-    // First, check to see if the file exists
-    int index;
-    index = -1;
-    // Go through each file and observe if the file handle exists
-    for (int i = 0; i < num_files; i++) {
-	    // Compare the path in the list vs. the specified path
-	    if (fd == all_files[i].handle) {
-		    // We found the file!
-		    index = i;
-		    break;
+    uint8_t first = 0;
+    uint8_t last;
+
+    // Skip the ranges that end before this one starts (adjacent ranges get merged)
+    while ((first < p->num_ranges) && (p->ranges[first].end < start)) {
+	    first++;
+    }
+
+    // Find the ranges that overlap or touch this one and fold them in
+    last = first;
+    while ((last < p->num_ranges) && (p->ranges[last].start <= end)) {
+	    if (p->ranges[last].start < start) {
+		    start = p->ranges[last].start;
+	    }
+	    if (p->ranges[last].end > end) {
+		    end = p->ranges[last].end;
 	    }
+	    last++;
     }
 
-    if (index == -1) {
-	    // This means we never found a matching file, so return -1
-	    return (-1);
+    if (first == last) {
+	    // Nothing to merge with, insert a new range
+	    if (p->num_ranges == BLOCK_PENDING_MAX_RANGES) {
+		    return (-1);
+	    }
+	    memmove(&p->ranges[first + 1], &p->ranges[first], (p->num_ranges - first) * sizeof(struct pending_range));
+	    p->num_ranges++;
+    }
+    else {
+	    // Replace ranges first..last-1 with the merged one
+	    memmove(&p->ranges[first + 1], &p->ranges[last], (p->num_ranges - last) * sizeof(struct pending_range));
+	    p->num_ranges -= last - first - 1;
     }
+    p->ranges[first].start = start;
+    p->ranges[first].end = end;
 
-    // Second, check to see if the file is open
-    else if (all_files[index].status == CLOSED) {
-	    // This means the file is not open
-	    return (-1);
+    return ((p->num_ranges == 1) && (p->ranges[0].start == 0) && (p->ranges[0].end == BLOCK_FRAME_SIZE));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: flush_pending
+// Description	: Write a pending frame out, reading the rest of the frame from the device only if some of it was never written
+//
+// Inputs	: p - the pending frame
+// Outputs	: 0 if successful, -1 if failure
+
+static int flush_pending(struct pending_frame *p)
+{
+    char *frame;
+    int ret = 0;
+
+    if (p->addr == BLOCK_SUPERBLOCK_FRAME) {
+	    return (0);
     }
 
-    // Third, set the seek position to loc
-    // Check to make sure loc <= length
-    // (Say file is 24 bytes. To seek to end of file you can place it after the 24th byte aka index 25)
-    if (loc <= all_files[index].length) {
-    	   all_files[index].seek_pos = loc;
+    if ((p->num_ranges == 1) && (p->ranges[0].start == 0) && (p->ranges[0].end == BLOCK_FRAME_SIZE)) {
+	    // Every byte was written, the device copy is not needed
+	    frame = p->data;
     }
     else {
-	  return (-1);
+	    // Read the frame and lay the written ranges over it
+	    if ((frame = malloc(BLOCK_FRAME_SIZE)) == NULL) {
+		    return (-1);
+	    }
+	    if (read_frame(p->addr, frame) == -1) {
+		    free(frame);
+		    return (-1);
+	    }
+	    for (uint8_t i = 0; i < p->num_ranges; i++) {
+		    memcpy(frame + p->ranges[i].start, p->data + p->ranges[i].start, p->ranges[i].end - p->ranges[i].start);
+	    }
     }
 
-    // Return successfully
+    if (store_frame(p->addr, frame) == -1) {
+	    ret = -1;
+    }
+    else {
+	    drop_pending(p);
+    }
+
+    if (frame != p->data) {
+	    free(frame);
+    }
+
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: flush_all_pending
+// Description	: Write out every frame that has partial writes waiting on it
+//
+// Inputs	: none
+// Outputs	: 0 if successful, -1 if failure
+
+static int flush_all_pending(void)
+{
+    // Go in slot order, the pending table is small
+    for (uint16_t i = 0; (i < BLOCK_MAX_PENDING_FRAMES) && (num_pending_frames > 0); i++) {
+	    if (flush_pending(&pending_frames[i]) == -1) {
+		    return (-1);
+	    }
+    }
+
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: drop_pending
+// Description	: Forget the partial writes to a frame and free the slot
+//
+// Inputs	: p - the pending frame
+// Outputs	: none
+
+static void drop_pending(struct pending_frame *p)
+{
+    p->addr = BLOCK_SUPERBLOCK_FRAME;
+    p->num_ranges = 0;
+    num_pending_frames--;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: file_record_size
+// Description	: Compute how many bytes a file's record takes up in the metadata region
+//
+// Inputs	: index - the index of the file in all_files
+// Outputs	: size of the serialized record in bytes
+
+static uint32_t file_record_size(int32_t index)
+{
+    return (BLOCK_FILE_RECORD_SIZE + BLOCK_EXTENT_RECORD_SIZE * all_files[index].meta_slots);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: reserve_record_slots
+// Description	: Make sure a file's record has a slot for each of its extents, or room in its slots for its
+//		  data if it is inline. Slots grow geometrically
+//		  so a growing file only rarely changes the size of its record, which would move every record after it.
+//
+// Inputs	: index - the index of the file in all_files
+// Outputs	: 0 if successful, -1 if the record can not hold that many slots
+
+static int reserve_record_slots(int32_t index)
+{
+    uint32_t needed;
+    uint32_t slots;
+
+    // An inline file fills its slots with its data instead
+    needed = all_files[index].num_extents;
+    if (all_files[index].is_inline) {
+	    needed = (all_files[index].length + BLOCK_EXTENT_RECORD_SIZE - 1) / BLOCK_EXTENT_RECORD_SIZE;
+    }
+    if (needed <= all_files[index].meta_slots) {
+	    return (0);
+    }
+    if (needed > BLOCK_FILE_RECORD_MAX_SLOTS) {
+	    return (-1);
+    }
+
+    // The last doubling may pass what the record's 16-bit slot count can say
+    slots = BLOCK_FILE_RECORD_MIN_SLOTS;
+    while (slots < needed) {
+	    slots *= 2;
+    }
+    if (slots > BLOCK_FILE_RECORD_MAX_SLOTS) {
+	    slots = BLOCK_FILE_RECORD_MAX_SLOTS;
+    }
+    all_files[index].meta_slots = slots;
+
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: serialize_file_record
+// Description	: Write the record of one file into a buffer
+//
+// Inputs	: index - the index of the file in all_files
+//		  record - buffer of at least file_record_size(index) bytes
+// Outputs	: number of bytes written
+
+static uint32_t serialize_file_record(int32_t index, char *record)
+{
+    // Keep track of how many bytes we've written since the start of the record
+    uint32_t bytes_written = 0;
+
+    // First copy over the path
+    memcpy(record + bytes_written, &all_files[index].path, BLOCK_MAX_PATH_LENGTH);
+    bytes_written += BLOCK_MAX_PATH_LENGTH;
+
+    // Jot down the file length
+    memcpy(record + bytes_written, &all_files[index].length, sizeof(uint64_t));
+    bytes_written += 8;
+
+    // We do not need to jot down the handle, status nor the seek position b/c when we restart the block system, these files will be closed
+    // Jot down the number of extents that make up the file, and how many slots the record has for them
+    if (all_files[index].is_inline) {
+	    memcpy(record + bytes_written, &(uint16_t) {BLOCK_INLINE_EXTENTS}, sizeof(uint16_t));
+    }
+    else {
+	    memcpy(record + bytes_written, &all_files[index].num_extents, sizeof(uint16_t));
+    }
+    bytes_written += 2;
+    memcpy(record + bytes_written, &all_files[index].meta_slots, sizeof(uint16_t));
+    bytes_written += 2;
+
+    // An inline file's data takes the place of the extents
+    if (all_files[index].is_inline) {
+	    memcpy(record + bytes_written, all_files[index].inline_data, all_files[index].length);
+	    memset(record + bytes_written + all_files[index].length, 0,
+		   BLOCK_EXTENT_RECORD_SIZE * all_files[index].meta_slots - all_files[index].length);
+	    bytes_written += BLOCK_EXTENT_RECORD_SIZE * all_files[index].meta_slots;
+	    return (bytes_written);
+    }
+
+    // Now we need to jot down the run of frames behind each extent, leaving the unused slots zeroed
+    // The logical position of each extent follows from the extents before it, so it is not stored
+    for (int i = 0; i < all_files[index].num_extents; i++) {
+	    memcpy(record + bytes_written, &all_files[index].extents[i].start, sizeof(BlockAddress));
+	    memcpy(record + bytes_written + 4, &all_files[index].extents[i].count, sizeof(uint16_t));
+	    bytes_written += BLOCK_EXTENT_RECORD_SIZE;
+    }
+    memset(record + bytes_written, 0, BLOCK_EXTENT_RECORD_SIZE * (all_files[index].meta_slots - all_files[index].num_extents));
+    bytes_written += BLOCK_EXTENT_RECORD_SIZE * (all_files[index].meta_slots - all_files[index].num_extents);
+
+    return (bytes_written);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: deserialize_metadata
+// Description	: Restore num_files file records from the metadata image
+//
+// Inputs	: image - the metadata image read from the block system
+//		  length - number of valid bytes in the image
+// Outputs	: 0 if successful, -1 if the image is malformed
+
+static int deserialize_metadata(char *image, uint32_t length)
+{
+    // Keep a variable to track how many bytes have been read from the metadata so far
+    uint32_t bytes_read = 0;
+
+    // The region starts with the frame map
+    if (length < BLOCK_FRAME_MAP_SIZE) {
+	    return (-1);
+    }
+    memcpy(frame_map, image, BLOCK_FRAME_MAP_SIZE);
+    bytes_read = BLOCK_FRAME_MAP_SIZE;
+
+    // Count the frames used in each block so allocation knows which blocks have room
+    for (int32_t blk = 0; blk < BLOCK_NUM_BLOCKS; blk++) {
+	    block_frames_used[blk] = 0;
+	    for (uint32_t word = 0; word < BLOCK_FRAME_MAP_WORDS; word++) {
+		    block_frames_used[blk] += __builtin_popcountll(frame_map[blk][word]);
+	    }
+    }
+
+    // Allocate memory for all_files based on num_files
+    if (reserve_files(num_files) == -1) {
+	    num_files = 0;
+	    return (-1);
+    }
+
+    // For num_files files, go through each file
+    for (int i = 0; i < num_files; i++) {
+	    if (bytes_read + BLOCK_FILE_RECORD_SIZE > length) {
+		    unload_files(i);
+		    return (-1);
+	    }
+
+	    // Nothing is allocated for the file yet, so a failed load only frees what it got to
+	    all_files[i].extents = NULL;
+	    all_files[i].inline_data = NULL;
+
+	    // Remember where the record lives so checkpoints can tell if it moved
+	    all_files[i].meta_offset = bytes_read;
+	    all_files[i].dirty = 0;
+
+	    // Copy over the file's path
+	    memcpy(&all_files[i].path, image + bytes_read, BLOCK_MAX_PATH_LENGTH);
+	    all_files[i].path[BLOCK_MAX_PATH_LENGTH - 1] = '\0';
+	    bytes_read += BLOCK_MAX_PATH_LENGTH;
+
+	    // Copy over the file's length
+	    memcpy(&all_files[i].length, image + bytes_read, sizeof(uint64_t));
+	    bytes_read += 8;
+
+	    // The file stays closed until it is opened again, and its seek position is 0
+	    all_files[i].open_count = 0;
+	    all_files[i].buffered_handles = 0;
+
+	    // Specify the number of extents for the file, and the number of slots its record has
+	    memcpy(&all_files[i].num_extents, image + bytes_read, sizeof(uint16_t));
+	    bytes_read += 2;
+	    memcpy(&all_files[i].meta_slots, image + bytes_read, sizeof(uint16_t));
+	    bytes_read += 2;
+
+	    if (bytes_read + BLOCK_EXTENT_RECORD_SIZE * all_files[i].meta_slots > length) {
+		    unload_files(i + 1);
+		    return (-1);
+	    }
+
+	    // An inline file has its data in its slots and no frames
+	    all_files[i].is_inline = (all_files[i].num_extents == BLOCK_INLINE_EXTENTS);
+	    if (all_files[i].is_inline) {
+		    if (all_files[i].length > BLOCK_EXTENT_RECORD_SIZE * all_files[i].meta_slots) {
+			    unload_files(i + 1);
+			    return (-1);
+		    }
+		    if ((all_files[i].length > 0) && ((all_files[i].inline_data = malloc(all_files[i].length)) == NULL)) {
+			    unload_files(i + 1);
+			    return (-1);
+		    }
+		    memcpy(all_files[i].inline_data, image + bytes_read, all_files[i].length);
+		    all_files[i].num_extents = 0;
+	    }
+	    else if (all_files[i].num_extents > all_files[i].meta_slots) {
+		    unload_files(i + 1);
+		    return (-1);
+	    }
+
+	    // Allocate memory for the extents, and rebuild the logical position of each one from the runs before it
+	    all_files[i].extents_capacity = all_files[i].num_extents + 1;
+	    all_files[i].extents = malloc(sizeof(struct extent) * all_files[i].extents_capacity);
+	    if (all_files[i].extents == NULL) {
+		    unload_files(i + 1);
+		    return (-1);
+	    }
+	    all_files[i].num_frames = 0;
+	    for (int j = 0; j < all_files[i].num_extents; j++) {
+		    all_files[i].extents[j].logical = all_files[i].num_frames;
+		    memcpy(&all_files[i].extents[j].start, image + bytes_read + BLOCK_EXTENT_RECORD_SIZE * j, sizeof(BlockAddress));
+		    memcpy(&all_files[i].extents[j].count, image + bytes_read + BLOCK_EXTENT_RECORD_SIZE * j + 4, sizeof(uint16_t));
+
+		    // A run has to lie inside one block of the device, anything else was not written by this driver
+		    if ((all_files[i].extents[j].start != BLOCK_HOLE) &&
+			((BLOCK_ADDRESS_BLOCK(all_files[i].extents[j].start) >= BLOCK_NUM_BLOCKS) ||
+			 (BLOCK_ADDRESS_FRAME(all_files[i].extents[j].start) + all_files[i].extents[j].count > BLOCK_BLOCK_SIZE))) {
+			    unload_files(i + 1);
+			    return (-1);
+		    }
+		    all_files[i].num_frames += all_files[i].extents[j].count;
+	    }
+	    bytes_read += BLOCK_EXTENT_RECORD_SIZE * all_files[i].meta_slots;
+
+	    // All data for the current file has been restored!
+    }
+
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: unload_files
+// Description	: Free the extents and inline data of the files a failed load restored, and forget the files
+//
+// Inputs	: count - number of files at the start of all_files that were restored
+// Outputs	: none
+
+static void unload_files(int32_t count)
+{
+    for (int32_t i = 0; i < count; i++) {
+	    free(all_files[i].extents);
+	    free(all_files[i].inline_data);
+    }
+    num_files = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: unload_metadata_image
+// Description	: Free the metadata image read by a failed load, so the driver does not keep a region it could not use
+//
+// Inputs	: none
+// Outputs	: none
+
+static void unload_metadata_image(void)
+{
+    free(metadata_image);
+    metadata_image = NULL;
+    metadata_length = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: load_metadata
+// Description	: Read the superblock, then read the metadata region it describes and restore the file table
+//
+// Inputs	: none
+// Outputs	: 0 if successful, -1 if failure
+
+static int load_metadata(void)
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t num_blocks;
+    uint32_t length;
+
+    if (read_frame(BLOCK_SUPERBLOCK_FRAME, superblock_image) == -1) {
+	    return (-1);
+    }
+
+    // Refuse to interpret a frame 0 that was not written by this version of the driver
+    memcpy(&magic, superblock_image, sizeof(uint32_t));
+    memcpy(&version, superblock_image + 4, sizeof(uint16_t));
+    if ((magic != BLOCK_METADATA_MAGIC) || (version != BLOCK_METADATA_VERSION)) {
+	    return (-1);
+    }
+
+    // The header describes the size of the metadata region, followed by the table of frames that hold it
+    memcpy(&num_files, superblock_image + 6, sizeof(uint16_t));
+    memcpy(&num_frames_used, superblock_image + 8, sizeof(uint32_t));
+    memcpy(&num_blocks, superblock_image + 12, sizeof(uint16_t));
+    memcpy(&num_metadata_frames, superblock_image + 14, sizeof(uint16_t));
+    memcpy(&length, superblock_image + 16, sizeof(uint32_t));
+
+    // The frame map is sized for the number of blocks, so the geometry has to match
+    if ((num_blocks != BLOCK_NUM_BLOCKS) || (num_metadata_frames > BLOCK_MAX_METADATA_FRAMES) ||
+	(length > (uint32_t) num_metadata_frames * BLOCK_FRAME_SIZE)) {
+	    return (-1);
+    }
+    memcpy(metadata_frames, superblock_image + BLOCK_SUPERBLOCK_HEADER_SIZE, sizeof(BlockAddress) * num_metadata_frames);
+    for (int i = 0; i < num_metadata_frames; i++) {
+	    if (BLOCK_ADDRESS_BLOCK(metadata_frames[i]) >= BLOCK_NUM_BLOCKS) {
+		    return (-1);
+	    }
+    }
+
+    // Read the whole region into one contiguous image, which stays around as the copy of what is on the device
+    metadata_image = calloc(num_metadata_frames + 1, BLOCK_FRAME_SIZE);
+    if (metadata_image == NULL) {
+	    return (-1);
+    }
+    metadata_length = length;
+    for (int i = 0; i < num_metadata_frames; i++) {
+	    if (read_frame(metadata_frames[i], metadata_image + (size_t) i * BLOCK_FRAME_SIZE) == -1) {
+		    unload_metadata_image();
+		    return (-1);
+	    }
+    }
+
+    if (deserialize_metadata(metadata_image, length) == -1) {
+	    unload_metadata_image();
+	    return (-1);
+    }
+
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: mark_file_dirty
+// Description	: Note that a file's record has to be written at the next checkpoint
+//
+// Inputs	: index - the index of the file in all_files
+// Outputs	: none
+
+static void mark_file_dirty(int32_t index)
+{
+    all_files[index].dirty = 1;
+
+    // Records before the first dirty file are known to be unchanged on the device
+    if ((first_dirty_file == -1) || (index < first_dirty_file)) {
+	    first_dirty_file = index;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: store_metadata_bytes
+// Description	: Copy bytes into the metadata image, flagging the frames whose contents actually change
+//
+// Inputs	: offset - where the bytes go in the image
+//		  bytes - the bytes to store, NULL to store zeroes
+//		  count - number of bytes to store
+// Outputs	: none
+
+static void store_metadata_bytes(uint32_t offset, const char *bytes, uint32_t count)
+{
+    uint32_t frame;
+    uint32_t chunk;
+
+    while (count > 0) {
+	    // Work on the part of the range that falls into a single frame of the region
+	    frame = offset / BLOCK_FRAME_SIZE;
+	    chunk = BLOCK_FRAME_SIZE - (offset % BLOCK_FRAME_SIZE);
+	    if (chunk > count) {
+		    chunk = count;
+	    }
+
+	    if (bytes == NULL) {
+		    for (uint32_t i = 0; i < chunk; i++) {
+			    if (metadata_image[offset + i] != 0) {
+				    memset(metadata_image + offset, 0, chunk);
+				    metadata_frame_dirty[frame] = 1;
+				    break;
+			    }
+		    }
+	    }
+	    else {
+		    if (memcmp(metadata_image + offset, bytes, chunk) != 0) {
+			    memcpy(metadata_image + offset, bytes, chunk);
+			    metadata_frame_dirty[frame] = 1;
+		    }
+		    bytes += chunk;
+	    }
+
+	    offset += chunk;
+	    count -= chunk;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_checkpoint
+// Description  : Write the metadata that changed since the last checkpoint to the block system
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t block_checkpoint(void)
+{
+    uint32_t offset;
+    uint32_t length;
+    uint32_t size;
+    uint32_t needed;
+    char *record;
+    char *grown;
+    uint32_t magic = BLOCK_METADATA_MAGIC;
+    uint16_t version = BLOCK_METADATA_VERSION;
+    uint16_t num_blocks = BLOCK_NUM_BLOCKS;
+
+    // File data goes out before the metadata that describes it, including partial writes still waiting on their frames
+    // and frames a write-back cache is holding
+    if ((flush_all_pending() == -1) || (flush_block_cache() == -1)) {
+	    return (-1);
+    }
+
+    if ((first_dirty_file != -1) || frame_map_dirty) {
+	    // Records before the first dirty file have not changed, so start laying out records from there
+	    if (first_dirty_file == -1) {
+		    first_dirty_file = num_files;
+	    }
+	    offset = (first_dirty_file == 0) ? BLOCK_FRAME_MAP_SIZE :
+		    all_files[first_dirty_file - 1].meta_offset + file_record_size(first_dirty_file - 1);
+
+	    length = offset;
+	    for (int32_t i = first_dirty_file; i < num_files; i++) {
+		    if (reserve_record_slots(i) == -1) {
+			    return (-1);
+		    }
+		    length += file_record_size(i);
+	    }
+
+	    // Reserve enough frames to hold the whole image
+	    needed = (length + BLOCK_FRAME_SIZE - 1) / BLOCK_FRAME_SIZE;
+	    if (needed > BLOCK_MAX_METADATA_FRAMES) {
+		    return (-1);
+	    }
+	    if (needed > num_metadata_frames) {
+		    grown = realloc(metadata_image, (size_t) needed * BLOCK_FRAME_SIZE);
+		    if (grown == NULL) {
+			    return (-1);
+		    }
+		    metadata_image = grown;
+		    memset(metadata_image + (size_t) num_metadata_frames * BLOCK_FRAME_SIZE, 0,
+			   (size_t) (needed - num_metadata_frames) * BLOCK_FRAME_SIZE);
+
+		    // Newly reserved frames hold garbage on the device, so they always get written
+		    while (num_metadata_frames < needed) {
+			    metadata_frame_dirty[num_metadata_frames] = 1;
+			    metadata_frames[num_metadata_frames] = allocate_frame(num_metadata_frames == 0 ? 0 :
+				    metadata_frames[num_metadata_frames - 1] + 1);
+			    if (metadata_frames[num_metadata_frames] == 0) {
+				    return (-1);
+			    }
+			    num_metadata_frames++;
+		    }
+	    }
+
+	    // The frame map leads the region, and is only rewritten where it changed
+	    store_metadata_bytes(0, (char *) frame_map, BLOCK_FRAME_MAP_SIZE);
+	    frame_map_dirty = 0;
+
+	    // Lay out the records, skipping clean records that have not moved
+	    for (int32_t i = first_dirty_file; i < num_files; i++) {
+		    size = file_record_size(i);
+
+		    if (all_files[i].dirty || (all_files[i].meta_offset != offset)) {
+			    // Records laid out so far stay flagged in the image, so a later checkpoint still writes them
+			    record = malloc(size);
+			    if (record == NULL) {
+				    return (-1);
+			    }
+			    serialize_file_record(i, record);
+			    store_metadata_bytes(offset, record, size);
+			    free(record);
+
+			    all_files[i].meta_offset = offset;
+			    all_files[i].dirty = 0;
+		    }
+
+		    offset += size;
+	    }
+
+	    // Clear whatever used to follow the last record
+	    if (metadata_length > length) {
+		    store_metadata_bytes(length, NULL, metadata_length - length);
+	    }
+	    metadata_length = length;
+	    first_dirty_file = -1;
+
+	    // Write the changed frames of the region first so the superblock never describes frames that were not written
+	    for (int i = 0; i < num_metadata_frames; i++) {
+		    if (metadata_frame_dirty[i]) {
+			    if (write_frame(metadata_frames[i], metadata_image + (size_t) i * BLOCK_FRAME_SIZE) == -1) {
+				    return (-1);
+			    }
+			    metadata_frame_dirty[i] = 0;
+		    }
+	    }
+    }
+
+    // Build the superblock: the header followed by the table of metadata frames
+    record = calloc(1, BLOCK_FRAME_SIZE);
+    if (record == NULL) {
+	    return (-1);
+    }
+    memcpy(record, &magic, sizeof(uint32_t));
+    memcpy(record + 4, &version, sizeof(uint16_t));
+    memcpy(record + 6, &num_files, sizeof(uint16_t));
+    memcpy(record + 8, &num_frames_used, sizeof(uint32_t));
+    memcpy(record + 12, &num_blocks, sizeof(uint16_t));
+    memcpy(record + 14, &num_metadata_frames, sizeof(uint16_t));
+    memcpy(record + 16, &metadata_length, sizeof(uint32_t));
+    memcpy(record + BLOCK_SUPERBLOCK_HEADER_SIZE, metadata_frames, sizeof(BlockAddress) * num_metadata_frames);
+
+    // Only write the superblock if it differs from what is on the device
+    if (memcmp(record, superblock_image, BLOCK_FRAME_SIZE) != 0) {
+	    if (write_frame(BLOCK_SUPERBLOCK_FRAME, record) == -1) {
+		    free(record);
+		    return (-1);
+	    }
+	    memcpy(superblock_image, record, BLOCK_FRAME_SIZE);
+    }
+    free(record);
+
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_poweron
+// Description  : Startup up the BLOCK interface, initialize filesystem
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t block_poweron(void)
+{
+    // Specify init opcode
+    BlockOpCodes opcode = BLOCK_OP_INITMS;
+   
+    // Generate register
+    BlockXferRegister reg = generate_register(opcode, 0, 0, 0);
+    
+    // Create variable to store return reg
+    BlockXferRegister return_reg;
+
+    // Pass to hardware device
+    return_reg = block_io_bus(reg, 0);
+
+    // block_io_bus returns rt1 = -1 if there was an error
+    return_reg = return_reg << 56;
+    return_reg = return_reg >> 56;
+    int8_t rt1 = return_reg;
+    
+    if (rt1 == -1) {
+	    return (-1);
+    }
+
+    // Assign global variables
+    num_frames_used = 0;
+    num_files = 0;
+    num_metadata_frames = 0;
+    metadata_length = 0;
+    memset(frame_map, 0, sizeof(frame_map));
+    memset(block_frames_used, 0, sizeof(block_frames_used));
+    memset(frame_map_cursor, 0, sizeof(frame_map_cursor));
+    frame_map[0][0] = 1; // The superblock frame is always in use
+    block_frames_used[0] = 1;
+    num_frames_used = 1;
+    frame_map_dirty = 1;
+
+    // Initializing the memory system leaves the controller on block 0
+    current_block = 0;
+    first_dirty_file = -1;
+    memset(superblock_image, 0, BLOCK_FRAME_SIZE);
+    memset(metadata_frame_dirty, 0, sizeof(metadata_frame_dirty));
+    reset_handles();
+    for (uint16_t i = 0; i < BLOCK_MAX_PENDING_FRAMES; i++) {
+	    pending_frames[i].addr = BLOCK_SUPERBLOCK_FRAME;
+    }
+    num_pending_frames = 0;
+    pending_cursor = 0;
+    memset(&driver_stats, 0, sizeof(driver_stats));
+
+    // Create a FILE *file pointer to see if block_memsys.bck exists
+    FILE *file = fopen("block_memsys.bck", "r");
+
+    if (file != NULL) {
+	    // block_memsys.bck exists! Read the superblock and the metadata region to restore my data structures
+	    fclose(file);
+
+	    if (load_metadata() == -1) {
+		    return (-1);
+	    }
+	    frame_map_dirty = 0;
+
+	    // All data for all files has been restored!
+    }
+
+    // Index the restored files by path so block_open does not have to scan them
+    if (rebuild_path_index() == -1) {
+	    return (-1);
+    }
+
+    // Initialize cache, a write-back cache writes dirty frames through the driver
+    if (init_block_cache() == -1) {
+	    return (-1);
+    }
+    set_block_cache_flusher(writeback_frame);
+
+    // Return successfully
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_poweroff
+// Description  : Shut down the BLOCK interface, close all files
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t block_poweroff(void)
+{
+    // Declare opcode
+    BlockOpCodes opcode;
+
+    // Declare register
+    BlockXferRegister reg;
+
+    // Create variable to hold return reg
+    BlockXferRegister return_reg;
+
+    // On BLOCK_OP_POWOFF, the state of the filesystem is stored to block_memsys.bck in our directory.
+    // Writes still sitting in write buffers go out first
+    if (flush_all_buffers() == -1) {
+	    return (-1);
+    }
+
+    // When shutting down write whatever metadata changed since the last checkpoint, which is nothing if no file changed
+    if (block_checkpoint() == -1) {
+	    return (-1);
+    }
+
+    // The filesystem metadata for my data structures has been written to the block system!
+
+
+    // Close cache before the controller goes down, so its flusher is stopped; the checkpoint already wrote its dirty frames
+    close_block_cache();
+
+    // Power off the filesystem
+    opcode = BLOCK_OP_POWOFF;
+    reg = generate_register(opcode, 0, 0, 0);
+    return_reg = block_io_bus(reg, 0);
+
+    return_reg = return_reg << 56;
+    return_reg = return_reg >> 56;
+    int8_t rt1 = return_reg;
+
+    if (rt1 == -1) {
+	return (-1);
+    }
+
+    // Return successfully
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_open
+// Description  : This function opens the file and returns a file handle
+//
+// Inputs       : path - filename of the file to open
+// Outputs      : file handle if successful, -1 if failure
+
+int16_t block_open(char* path)
+{
+    int index;
+    int16_t fd;
+
+    // The path has to fit in the file entry, including its terminator
+    if (strlen(path) >= BLOCK_MAX_PATH_LENGTH) {
+	    return (-1);
+    }
+
+    // Look the path up in the path index
+    index = find_file(path);
+
+    if (index == -1) {
+	    // This means we never found a matching file, so let's start a new file
+	    index = num_files;
+	    if (num_files >= BLOCK_MAX_TOTAL_FILES) {
+		    return (-1);
+	    }
+
+	    if (reserve_files(num_files + 1) == -1) {
+		    return (-1);
+	    }
+	    
+	    strcpy(all_files[index].path, path);
+
+	    // Set length to 0
+	    all_files[index].length = 0;
+
+	    // The file gets its first open file description below
+	    all_files[index].open_count = 0;
+	    all_files[index].buffered_handles = 0;
+
+	    // A new file is empty, so it starts out inline and takes no frames until it grows past the inline threshold
+	    all_files[index].extents = NULL;
+	    all_files[index].num_extents = 0;
+	    all_files[index].extents_capacity = 0;
+	    all_files[index].num_frames = 0;
+	    all_files[index].meta_slots = 0;
+	    all_files[index].is_inline = 1;
+	    all_files[index].inline_data = NULL;
+	    num_files++;
+
+	    // Make the new file visible to later opens, and queue its record for the next checkpoint. A failed rebuild
+	    // keeps the old index, which does not know the file, so the file is dropped again
+	    if (index_file(index) == -1) {
+		    num_files--;
+		    return (-1);
+	    }
+	    mark_file_dirty(index);
+    }
+
+    // Every open gets its own file description, which starts at the beginning of the file
+    fd = acquire_handle(index);
+    if (fd == -1) {
+	    return (-1);
+    }
+    all_files[index].open_count++;
+    
+    // Return the file handle
+    return (fd);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_close
+// Description  : This function closes the file
+//
+// Inputs       : fd - the file descriptor
+// Outputs      : 0 if successful, -1 if failure
+
+int16_t block_close(int16_t fd)
+{
+    int index;
+
+    // Find the file behind the handle, this fails if the file was already closed
+    index = lookup_handle(fd);
+
+    if (index == -1) {
+	    // This means we never found a matching file, so return -1
+	    return (-1);
+    }
+    
+    // Whatever the handle buffered is written before the handle goes away, along with the file's frames still in memory
+    if ((flush_write_buffer(fd & (BLOCK_MAX_OPEN_FILES - 1)) == -1) || (flush_file_frames(index) == -1)) {
+	    return (-1);
+    }
+
+    // Other opens of the same file keep their own descriptions
+    release_handle(fd);
+    all_files[index].open_count--;
+
+    // Return successfully
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: iov_length
+// Description	: Add up the lengths of a scatter/gather list
+//
+// Inputs	: iov - the list of buffers
+//		  iovcnt - the number of buffers in the list
+// Outputs	: the total number of bytes, -1 if the list is invalid or too long
+
+static int64_t iov_length(const struct iovec *iov, int iovcnt)
+{
+    uint64_t total = 0;
+
+    if ((iovcnt < 0) || ((iovcnt > 0) && (iov == NULL))) {
+	    return (-1);
+    }
+
+    for (int i = 0; i < iovcnt; i++) {
+	    // Make sure the sum still fits in the return value of the call
+	    if (iov[i].iov_len > INT64_MAX - total) {
+		    return (-1);
+	    }
+	    total += iov[i].iov_len;
+    }
+
+    return ((int64_t) total);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: iov_scatter
+// Description	: Copy bytes into a scatter/gather list, continuing from a cursor
+//
+// Inputs	: iov - the list of buffers
+//		  seg - the buffer the cursor is in, advanced past what was copied
+//		  off - the offset into that buffer, advanced past what was copied
+//		  src - the bytes to copy
+//		  count - the number of bytes to copy
+// Outputs	: none
+
+static void iov_scatter(const struct iovec *iov, int *seg, uint64_t *off, const char *src, uint32_t count)
+{
+    uint64_t chunk;
+
+    while (count > 0) {
+	    // Step over buffers that are full (or empty to begin with)
+	    if (*off == iov[*seg].iov_len) {
+		    (*seg)++;
+		    *off = 0;
+		    continue;
+	    }
+
+	    chunk = iov[*seg].iov_len - *off;
+	    if (chunk > count) {
+		    chunk = count;
+	    }
+	    memcpy((char *) iov[*seg].iov_base + *off, src, chunk);
+	    src += chunk;
+	    *off += chunk;
+	    count -= chunk;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: iov_gather
+// Description	: Copy bytes out of a scatter/gather list, continuing from a cursor
+//
+// Inputs	: iov - the list of buffers
+//		  seg - the buffer the cursor is in, advanced past what was copied
+//		  off - the offset into that buffer, advanced past what was copied
+//		  dst - where to copy the bytes to
+//		  count - the number of bytes to copy
+// Outputs	: none
+
+static void iov_gather(const struct iovec *iov, int *seg, uint64_t *off, char *dst, uint32_t count)
+{
+    uint64_t chunk;
+
+    while (count > 0) {
+	    // Step over buffers that are used up (or empty to begin with)
+	    if (*off == iov[*seg].iov_len) {
+		    (*seg)++;
+		    *off = 0;
+		    continue;
+	    }
+
+	    chunk = iov[*seg].iov_len - *off;
+	    if (chunk > count) {
+		    chunk = count;
+	    }
+	    memcpy(dst, (const char *) iov[*seg].iov_base + *off, chunk);
+	    dst += chunk;
+	    *off += chunk;
+	    count -= chunk;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: iov_span
+// Description	: Take the next "count" bytes of a scatter/gather list if they sit in a single buffer
+//
+// Inputs	: iov - the list of buffers
+//		  seg - the buffer the cursor is in, advanced past the span if there is one
+//		  off - the offset into that buffer, advanced past the span if there is one
+//		  count - the size of the span, there must be at least this many bytes left in the list
+// Outputs	: pointer to the span, NULL if it is split across buffers
+
+static char *iov_span(const struct iovec *iov, int *seg, uint64_t *off, uint32_t count)
+{
+    char *span;
+
+    // Step over buffers that are used up (or empty to begin with)
+    while (*off == iov[*seg].iov_len) {
+	    (*seg)++;
+	    *off = 0;
+    }
+
+    if (iov[*seg].iov_len - *off < count) {
+	    return (NULL);
+    }
+
+    span = (char *) iov[*seg].iov_base + *off;
+    *off += count;
+
+    return (span);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: file_readv
+// Description	: Reads a file starting at "pos" into a scatter/gather list, reading each frame once
+//
+// Inputs	: index - the index of the file in all_files
+//		  iov - the list of buffers to read into
+//		  iovcnt - the number of buffers in the list
+//		  pos - offset in the file to start reading at
+// Outputs	: bytes read if successful, -1 if failure
+
+static int64_t file_readv(int32_t index, const struct iovec *iov, int iovcnt, uint64_t pos)
+{
+    // First, determine how many bytes can be read, factoring in the end of the file
+    int64_t total = iov_length(iov, iovcnt);
+    uint64_t count;
+    uint64_t seek = pos;
+    uint64_t length;
+
+    // Writes buffered by any handle on the file have to be visible to the read
+    if ((total == -1) || (flush_file_buffers(index) == -1)) {
+	    return (-1);
+    }
+    length = all_files[index].length;
+    count = total;
+
+    // Nothing can be read from the end of the file onwards
+    if (seek >= length) {
+	    return (0);
+    }
+
+    // If we will reach the end of the file within count bytes, then reduce count bytes so we don't go past the end of the file
+    if (length - seek < count) {
+	    count = length - seek;
+    }
+
+    // A small file is read straight out of its record in memory
+    if (all_files[index].is_inline) {
+	    int seg = 0;
+	    uint64_t seg_off = 0;
+
+	    iov_scatter(iov, &seg, &seg_off, all_files[index].inline_data + seek, count);
+	    return (count);
+    }
+
+    // Second, determine which frame we need to read from, factoring in the position
+    uint32_t frame_index;
+    
+    // Use floor division to figure out which frame we want to look at
+    frame_index = seek / BLOCK_FRAME_SIZE;
+
+    // Use modulo to figure out the seek position relative to the beginning of the frame
+    seek = seek % BLOCK_FRAME_SIZE;
+
+    // Now the seek position correctly positions us in the given frame
+    // frame_index tells us the correct logical frame of the file to start looking at
+
+    // Keep track of the number of bytes left to read
+    uint64_t count_remaining;
+    count_remaining = count;
+
+    // Staging buffer for frames that are not read whole into one buffer, only allocated if one comes up
+    char *read = NULL;
+
+    // Whole frame of the caller's buffers that the bus reads into directly
+    char *direct;
+
+    // Make it easier to observe what the current frame we're reading from is
+    BlockAddress cur_frame = 0;
+
+    // Number of frames left in the contiguous run that cur_frame belongs to
+    uint32_t run = 0;
+    
+    // Track how many bytes to read from current frame
+    uint32_t bytes_to_read_in_cur_frame;
+
+    // Cursor into the list of buffers being filled
+    int seg = 0;
+    uint64_t seg_off = 0;
+
+    // Partial writes waiting on the current frame
+    struct pending_frame *pending;
+
+    while (count_remaining > 0) {
+	    // Look the frame up in the extent map once per contiguous run, then walk the run
+	    if (run == 0) {
+		    cur_frame = file_frame(index, frame_index, &run);
+	    }
+
+	    // Read up to the end of the frame, or fewer bytes if that is all that is left
+	    bytes_to_read_in_cur_frame = BLOCK_FRAME_SIZE - seek;
+	    if (count_remaining < bytes_to_read_in_cur_frame) {
+		    bytes_to_read_in_cur_frame = count_remaining;
+	    }
+	    
+	    // A frame in a hole was never written, it reads as zeroes without going to the device
+	    if (cur_frame == BLOCK_HOLE) {
+		    iov_scatter(iov, &seg, &seg_off, zero_frame + seek, bytes_to_read_in_cur_frame);
+		    seek = 0;
+		    count_remaining -= bytes_to_read_in_cur_frame;
+		    frame_index++;
+		    run--;
+		    continue;
+	    }
+
+	    // Partial writes still waiting on the frame are merged first, which leaves the frame in the cache
+	    if (((pending = find_pending(cur_frame)) != NULL) && (flush_pending(pending) == -1)) {
+		    free(read);
+		    return (-1);
+	    }
+
+	    // A whole frame that lands in a single buffer goes straight from the cache or the bus into it
+	    direct = NULL;
+	    if (bytes_to_read_in_cur_frame == BLOCK_FRAME_SIZE) {
+		    direct = iov_span(iov, &seg, &seg_off, BLOCK_FRAME_SIZE);
+	    }
+
+	    if (direct != NULL) {
+		    // Read from the cache, or from the block system into the cache
+		    if (load_frame(cur_frame, direct) == -1) {
+			    free(read);
+			    return (-1);
+		    }
+	    }
+	    else {
+		    // Partial frames are staged, then only the bytes asked for are copied out
+		    if ((read == NULL) && ((read = malloc(BLOCK_FRAME_SIZE)) == NULL)) {
+			    return (-1);
+		    }
+
+		    // Read the frame from the cache, or from the block system into the cache
+		    if (load_frame(cur_frame, read) == -1) {
+			    free(read);
+			    return (-1);
+		    }
+
+		    // Copy bytes_to_read_in_cur_frame bytes from read into the buffers
+		    iov_scatter(iov, &seg, &seg_off, read + seek, bytes_to_read_in_cur_frame);
+	    }
+	    
+	    seek = 0;
+
+	    count_remaining -= bytes_to_read_in_cur_frame;
+	    frame_index++;
+	    cur_frame++;
+	    run--;
+    }
+    
+    free(read);
+    read = NULL;
+
+    // Return successfully
+    return (count);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_read64
+// Description  : Reads "count" bytes from the file handle "fh" into the
+//                buffer "buf", with 64-bit sizes
+//
+// Inputs       : fd - filename of the file to read from
+//                buf - pointer to buffer to read into
+//                count - number of bytes to read
+// Outputs      : bytes read if successful, -1 if failure
+
+int64_t block_read64(int16_t fd, void* buf, uint64_t count)
+{
+    int index;
+    int64_t bytes_read;
+    struct file_handle *desc;
+
+    // Find the file behind the handle, this fails if the handle is stale or the file is not open
+    index = lookup_handle(fd);
+
+    if ((index == -1) || (count > INT64_MAX)) {
+	    // This means we never found a matching file, so return -1
+	    return (-1);
+    }
+
+    // Read at the position of this open, then move it past what was read
+    desc = &handle_table[fd & (BLOCK_MAX_OPEN_FILES - 1)];
+    bytes_read = file_readv(index, &(struct iovec) {buf, count}, 1, desc->seek_pos);
+    if (bytes_read > 0) {
+	    desc->seek_pos += bytes_read;
+    }
+
+    return (bytes_read);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_read
+// Description  : Reads "count" bytes from the file handle "fh" into the
+//                buffer "buf"
+//
+// Inputs       : fd - filename of the file to read from
+//                buf - pointer to buffer to read into
+//                count - number of bytes to read
+// Outputs      : bytes read if successful, -1 if failure
+
+int32_t block_read(int16_t fd, void* buf, int32_t count)
+{
+    if (count < 0) {
+	    return (-1);
+    }
+
+    return ((int32_t) block_read64(fd, buf, count));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: file_writev
+// Description	: Writes a scatter/gather list to a file starting at "pos", writing each frame once
+//
+// Inputs	: index - the index of the file in all_files
+//		  iov - the list of buffers to write from
+//		  iovcnt - the number of buffers in the list
+//		  pos - offset in the file to start writing at
+// Outputs	: bytes written if successful, -1 if failure
+
+static int64_t file_writev(int32_t index, const struct iovec *iov, int iovcnt, uint64_t pos)
+{
+    // First, determine if we need to allocate additional frames to accomodate for a larger file
+    // Check to see if pos + count > length
+    int64_t total = iov_length(iov, iovcnt);
+    uint64_t count;
+    uint64_t seek;
+    seek = pos;
+
+    // Writes buffered by other handles on the file land first, they were made earlier
+    if ((total == -1) || (flush_file_buffers(index) == -1)) {
+	    return (-1);
+    }
+
+    count = total;
+
+    // The file can not grow past BLOCK_MAX_FILE_SIZE
+    if ((count > BLOCK_MAX_FILE_SIZE) || (seek > BLOCK_MAX_FILE_SIZE) || (seek + count > BLOCK_MAX_FILE_SIZE)) {
+	    return (-1);
+    }
+
+    // Writing nothing changes nothing, not even the length when it starts past the end
+    if (count == 0) {
+	    return (0);
+    }
+
+    // A small file is written in its record, and only moves to frames once it would grow past the inline threshold
+    if (all_files[index].is_inline) {
+	    if ((seek + count <= inline_threshold) || (seek + count <= all_files[index].length)) {
+		    return (write_inline(index, iov, iovcnt, seek, count));
+	    }
+	    if (promote_inline(index) == -1) {
+		    return (-1);
+	    }
+    }
+
+    // A write past the end of the file fills the gap with zeroes, mostly as a hole
+    if ((seek > all_files[index].length) && (extend_file(index, seek) == -1)) {
+	    return (-1);
+    }
+
+    // Nothing at or past the current end of the file has ever been written, the frames there need no read-modify-write
+    uint64_t written_length;
+    written_length = all_files[index].length;
+
+    // Frames the file had before this write grew it
+    uint32_t had_frames;
+
+    if (seek + count > all_files[index].length) {
+	    // Assign new frames until the file has enough frames to hold its new length, in contiguous runs. If the
+	    // frame map runs out, the file is left with the frames and length it had
+	    had_frames = all_files[index].num_frames;
+	    if (reserve_frames(index, (seek + count + BLOCK_FRAME_SIZE - 1) / BLOCK_FRAME_SIZE) == -1) {
+		    shrink_file(index, had_frames);
+		    return (-1);
+	    }
+
+	    // We will need to adjust the length of the file, which changes its metadata
+	    all_files[index].length = seek + count;
+	    mark_file_dirty(index);
+    }
+
+    // Now that additional frames have been allocated, let's begin writing to a frames
+    // Find the first frame that we need to write to, factoring in the position
+    uint32_t frame_index;
+    
+    // Floor division to get frame index
+    frame_index = seek / BLOCK_FRAME_SIZE;
+
+    // Modulo to get seek relative to start of frame
+    seek = seek % BLOCK_FRAME_SIZE;
+
+    // Variable that stores the current frame in the memory system that we want to look at
+    BlockAddress cur_frame = 0;
+
+    // Number of frames left in the contiguous run that cur_frame belongs to
+    uint32_t run = 0;
+
+    // We are now on the correct frame and at the correct seek position relative to the start of the frame
+
+    // Track how many bytes are left to write
+    uint64_t bytes_left_to_write;
+    bytes_left_to_write = count;
+    
+    // Cursor into the list of buffers being written
+    int seg = 0;
+    uint64_t seg_off = 0;
+
+    // Track how many bytes go into the current frame
+    uint32_t bytes_in_cur_frame;
+
+    // Staging buffer for partial frames, only allocated if one comes up
+    char *temp_buf = NULL;
+
+    // The frame image handed to the bus, either the staging buffer or a whole frame of the caller's buffers
+    char *frame_data;
+
+    // Whether temp_buf holds the frame as the cache had it
+    int cached;
+
+    // Partial writes waiting on the current frame
+    struct pending_frame *pending;
+
+    // Whether the current frame holds nothing written yet
+    int unwritten;
+
+    // Begin a loop that continues as long as we want to continue writing bytes
+    while (bytes_left_to_write > 0) {
+	    // Look the frame up in the extent map once per contiguous run, then walk the run
+	    if (run == 0) {
+		    cur_frame = file_frame(index, frame_index, &run);
+	    }
+
+	    // Nothing at or past the end of the file before this write has been written, and neither has a hole
+	    unwritten = ((uint64_t) frame_index * BLOCK_FRAME_SIZE >= written_length);
+	    if (cur_frame == BLOCK_HOLE) {
+		    // The frame gets a device frame of its own, and the rest of the hole is looked up again after it
+		    if ((cur_frame = fill_hole(index, frame_index)) == 0) {
+			    free(temp_buf);
+			    return (-1);
+		    }
+		    run = 1;
+		    unwritten = 1;
+	    }
+
+	    // Write up to the end of the frame, or fewer bytes if that is all that is left
+	    bytes_in_cur_frame = BLOCK_FRAME_SIZE - seek;
+	    if (bytes_left_to_write < bytes_in_cur_frame) {
+		    bytes_in_cur_frame = bytes_left_to_write;
+	    }
+
+	    // There are three different scenarios when writing
+	    // 1. We are writing in the middle of a frame and preserving the beginning
+	    // 2. We are writing an entire frame
+	    // 3. We are writing the beginning of a frame and preserving the end
+	    // In cases 1 and 3 we have to preserve the bytes we are not writing. If the frame is not cached, the write waits
+	    // in a pending frame instead of reading it, and the read is skipped entirely if later writes fill the frame
+	    // In case 2 the bus takes the frame straight from the caller's buffer if it is not split across buffers
+	    pending = find_pending(cur_frame);
+	    cached = 0;
+	    frame_data = NULL;
+	    if (bytes_in_cur_frame == BLOCK_FRAME_SIZE) {
+		    // A whole frame replaces whatever was waiting on it
+		    if (pending != NULL) {
+			    drop_pending(pending);
+			    pending = NULL;
+		    }
+		    frame_data = iov_span(iov, &seg, &seg_off, BLOCK_FRAME_SIZE);
+	    }
+	    else if ((pending == NULL) && !unwritten) {
+		    if ((temp_buf == NULL) && ((temp_buf = malloc(BLOCK_FRAME_SIZE)) == NULL)) {
+			    return (-1);
+		    }
+
+		    // Attempt to read from cache (the write below is what counts as a use of the frame), and only wait for the rest
+		    // of the frame if it is not there
+		    cached = (peek_block_cache(BLOCK_ADDRESS_BLOCK(cur_frame), BLOCK_ADDRESS_FRAME(cur_frame), temp_buf) == 0);
+		    if (!cached && ((pending = new_pending(cur_frame)) == NULL)) {
+			    free(temp_buf);
+			    return (-1);
+		    }
+	    }
+
+	    // A pending frame that has run out of ranges is merged now, and this write goes through the cache
+	    if ((pending != NULL) && (pending->num_ranges == BLOCK_PENDING_MAX_RANGES)) {
+		    if (flush_pending(pending) == -1) {
+			    free(temp_buf);
+			    return (-1);
+		    }
+		    pending = NULL;
+		    if ((temp_buf == NULL) && ((temp_buf = malloc(BLOCK_FRAME_SIZE)) == NULL)) {
+			    return (-1);
+		    }
+		    cached = (peek_block_cache(BLOCK_ADDRESS_BLOCK(cur_frame), BLOCK_ADDRESS_FRAME(cur_frame), temp_buf) == 0);
+	    }
+
+	    if (pending != NULL) {
+		    // Collect the bytes in the pending frame, which goes out as soon as every byte of it has been written
+		    iov_gather(iov, &seg, &seg_off, pending->data + seek, bytes_in_cur_frame);
+		    if ((add_pending_range(pending, seek, seek + bytes_in_cur_frame) == 1) && (flush_pending(pending) == -1)) {
+			    free(temp_buf);
+			    return (-1);
+		    }
+	    }
+	    else {
+		    if ((frame_data == NULL) && (temp_buf == NULL) && ((temp_buf = malloc(BLOCK_FRAME_SIZE)) == NULL)) {
+			    return (-1);
+		    }
+
+		    if ((bytes_in_cur_frame < BLOCK_FRAME_SIZE) && unwritten) {
+			    // The frame was never written (it was just allocated, filled a hole, or only held bytes past the end
+			    // of the file), so build it from zeroes instead of reading it back
+			    memset(temp_buf, 0, BLOCK_FRAME_SIZE);
+		    }
+		    else if ((bytes_in_cur_frame < BLOCK_FRAME_SIZE) && !cached) {
+			    // The cache copied the frame into temp_buf already if it had it
+			    if (read_frame(cur_frame, temp_buf) == -1) {
+				    free(temp_buf);
+				    return (-1);
+			    }
+		    }
+
+		    if (frame_data == NULL) {
+			    // Gather this frame's share of the buffers, which may span several of them
+			    iov_gather(iov, &seg, &seg_off, temp_buf + seek, bytes_in_cur_frame);
+			    frame_data = temp_buf;
+		    }
+
+		    // In each case, frame_data now holds the data that we want to write with
+		    if (store_frame(cur_frame, frame_data) == -1) {
+			    free(temp_buf);
+			    return (-1);
+		    }
+	    }
+	    bytes_left_to_write -= bytes_in_cur_frame;
+
+	    // Since we'll be either moving onto a new frame or ending, reset seek position
+	    seek = 0;
+
+	    frame_index++;
+	    cur_frame++;
+	    run--;
+    }
+
+    free(temp_buf);
+    temp_buf = NULL;
+   // Return successfully
+   return (count);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_write64
+// Description  : Writes "count" bytes to the file handle "fh" from the
+//                buffer  "buf", with 64-bit sizes
+//
+// Inputs       : fd - filename of the file to write to
+//                buf - pointer to buffer to write from
+//                count - number of bytes to write
+// Outputs      : bytes written if successful, -1 if failure
+
+int64_t block_write64(int16_t fd, void* buf, uint64_t count)
+{
+    int index;
+    int64_t bytes_written;
+    struct file_handle *desc;
+
+    // Find the file behind the handle, this fails if the handle is stale or the file is not open
+    index = lookup_handle(fd);
+
+    if (index == -1) {
+	    // This means we never found a matching file, so return -1
+	    return (-1);
+    }
+
+    // Write at the position of this open, then move it past what was written
+    desc = &handle_table[fd & (BLOCK_MAX_OPEN_FILES - 1)];
+    if (desc->buffered) {
+	    bytes_written = buffer_write(fd & (BLOCK_MAX_OPEN_FILES - 1), buf, count);
+    }
+    else {
+	    bytes_written = file_writev(index, &(struct iovec) {buf, count}, 1, desc->seek_pos);
+    }
+    if (bytes_written > 0) {
+	    desc->seek_pos += bytes_written;
+    }
+
+    return (bytes_written);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_write
+// Description  : Writes "count" bytes to the file handle "fh" from the
+//                buffer  "buf"
+//
+// Inputs       : fd - filename of the file to write to
+//                buf - pointer to buffer to write from
+//                count - number of bytes to write
+// Outputs      : bytes written if successful, -1 if failure
+
+int32_t block_write(int16_t fd, void* buf, int32_t count)
+{
+    if (count < 0) {
+	    return (-1);
+    }
+
+    return ((int32_t) block_write64(fd, buf, count));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_seek64
+// Description  : Seek to specific point in the file, with a 64-bit offset
+//
+// Inputs       : fd - filename of the file to write to
+//                loc - offset of file in relation to beginning of file
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t block_seek64(int16_t fd, uint64_t loc)
+{
+    // First, check to see if the file exists
+    int index;
+
+    // Find the file behind the handle, this fails if the handle is stale or the file is not open
+    index = lookup_handle(fd);
+
+    if (index == -1) {
+	    // This means we never found a matching file, so return -1
+	    return (-1);
+    }
+
+    // Buffered writes are written out first, the buffer only holds writes made at the seek position
+    if (flush_write_buffer(fd & (BLOCK_MAX_OPEN_FILES - 1)) == -1) {
+	    return (-1);
+    }
+
+    // Second, set the seek position to loc
+    // Seeking past the end is allowed, a write there leaves a hole that reads as zeroes
+    if (loc <= BLOCK_MAX_FILE_SIZE) {
+    	   handle_table[fd & (BLOCK_MAX_OPEN_FILES - 1)].seek_pos = loc;
+    }
+    else {
+	  return (-1);
+    }
+
+    // Return successfully
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_seek
+// Description  : Seek to specific point in the file
+//
+// Inputs       : fd - filename of the file to write to
+//                loc - offset of file in relation to beginning of file
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t block_seek(int16_t fd, uint32_t loc)
+{
+    return (block_seek64(fd, loc));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_pread
+// Description  : Reads "count" bytes at "offset" into the buffer "buf",
+//                leaving the seek position of the handle alone
+//
+// Inputs       : fd - the file handle to read from
+//                buf - pointer to buffer to read into
+//                count - number of bytes to read
+//                offset - offset in the file to start reading at
+// Outputs      : bytes read if successful (0 at or past the end of the
+//                file), -1 if failure
+
+int64_t block_pread(int16_t fd, void* buf, uint64_t count, uint64_t offset)
+{
+    int index;
+
+    // One handle lookup covers the whole call. The end of the file is checked by file_readv once buffered writes
+    // are in, and reading from it onwards reads nothing
+    index = lookup_handle(fd);
+    if ((index == -1) || (count > INT64_MAX)) {
+	    return (-1);
+    }
+
+    return (file_readv(index, &(struct iovec) {buf, count}, 1, offset));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_pwrite
+// Description  : Writes "count" bytes at "offset" from the buffer "buf",
+//                leaving the seek position of the handle alone
+//
+// Inputs       : fd - the file handle to write to
+//                buf - pointer to buffer to write from
+//                count - number of bytes to write
+//                offset - offset in the file to start writing at
+// Outputs      : bytes written if successful, -1 if failure
+
+int64_t block_pwrite(int16_t fd, void* buf, uint64_t count, uint64_t offset)
+{
+    int index;
+
+    // One handle lookup covers the whole call
+    index = lookup_handle(fd);
+    if (index == -1) {
+	    return (-1);
+    }
+
+    return (file_writev(index, &(struct iovec) {buf, count}, 1, offset));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_readv
+// Description  : Reads from the seek position into a list of buffers, filling
+//                each buffer in turn, with every frame read at most once
+//
+// Inputs       : fd - the file handle to read from
+//                iov - the list of buffers to read into
+//                iovcnt - the number of buffers in the list
+// Outputs      : bytes read if successful, -1 if failure
+
+int64_t block_readv(int16_t fd, const struct iovec* iov, int iovcnt)
+{
+    int index;
+    int64_t bytes_read;
+    struct file_handle *desc;
+
+    // One handle lookup covers the whole list
+    index = lookup_handle(fd);
+    if (index == -1) {
+	    return (-1);
+    }
+
+    desc = &handle_table[fd & (BLOCK_MAX_OPEN_FILES - 1)];
+    bytes_read = file_readv(index, iov, iovcnt, desc->seek_pos);
+    if (bytes_read > 0) {
+	    desc->seek_pos += bytes_read;
+    }
+
+    return (bytes_read);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_writev
+// Description  : Writes a list of buffers at the seek position as one
+//                contiguous run, with every frame written at most once
+//
+// Inputs       : fd - the file handle to write to
+//                iov - the list of buffers to write from
+//                iovcnt - the number of buffers in the list
+// Outputs      : bytes written if successful, -1 if failure
+
+int64_t block_writev(int16_t fd, const struct iovec* iov, int iovcnt)
+{
+    int index;
+    int64_t bytes_written;
+    struct file_handle *desc;
+
+    // One handle lookup covers the whole list
+    index = lookup_handle(fd);
+    if (index == -1) {
+	    return (-1);
+    }
+
+    desc = &handle_table[fd & (BLOCK_MAX_OPEN_FILES - 1)];
+    bytes_written = file_writev(index, iov, iovcnt, desc->seek_pos);
+    if (bytes_written > 0) {
+	    desc->seek_pos += bytes_written;
+    }
+
+    return (bytes_written);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_buffer_writes
+// Description  : Turn the write buffer of a file handle on or off. While it is
+//                on, small sequential block_write calls are collected and
+//                written one frame at a time, when the writes reach the end
+//                of a frame or on block_flush, block_seek or block_close
+//
+// Inputs       : fd - the file handle
+//                enable - non-zero to buffer writes, zero to stop
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t block_buffer_writes(int16_t fd, int enable)
+{
+    uint16_t slot;
+
+    if (lookup_handle(fd) == -1) {
+	    return (-1);
+    }
+
+    // Turning the buffer off writes out what it holds
+    slot = fd & (BLOCK_MAX_OPEN_FILES - 1);
+    if (!enable) {
+	    if (flush_write_buffer(slot) == -1) {
+		    return (-1);
+	    }
+	    free(handle_table[slot].wbuf);
+	    handle_table[slot].wbuf = NULL;
+    }
+    handle_table[slot].buffered = (enable != 0);
+
+    // Return successfully
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_flush
+// Description  : Write out the writes a file handle is holding on to, and
+//                every frame of the file that is only in memory (partial
+//                writes waiting on their frame, dirty write-back frames)
+//
+// Inputs       : fd - the file handle
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t block_flush(int16_t fd)
+{
+    int32_t index;
+
+    if ((index = lookup_handle(fd)) == -1) {
+	    return (-1);
+    }
+
+    if (flush_write_buffer(fd & (BLOCK_MAX_OPEN_FILES - 1)) == -1) {
+	    return (-1);
+    }
+
+    return (flush_file_frames(index));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_delete
+// Description  : Remove a file from the filesystem and free its frames
+//
+// Inputs       : path - filename of the file to delete
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t block_delete(char* path)
+{
+    int32_t index;
+    int32_t last;
+
+    // First check to see if the file exists
+    index = find_file(path);
+    if (index == -1) {
+	    return (-1);
+    }
+
+    // Every handle to the file goes stale
+    rebind_handles(index, -1);
+    all_files[index].open_count = 0;
+
+    // Give the file's frames back to the frame map
+    shrink_file(index, 0);
+    free(all_files[index].extents);
+    free(all_files[index].inline_data);
+    unlink_file(index);
+
+    // Keep the file table dense by moving the last file into the hole
+    last = num_files - 1;
+    if (index != last) {
+	    unlink_file(last);
+
+	    // Point the moved file's handles at its new position
+	    rebind_handles(last, index);
+	    all_files[index] = all_files[last];
+	    index_file_at(index);
+    }
+    num_files--;
+
+    // Every record from the hole onwards changed (or went away)
+    if (index < num_files) {
+	    mark_file_dirty(index);
+    }
+    else if ((first_dirty_file == -1) || (first_dirty_file > num_files)) {
+	    first_dirty_file = num_files;
+    }
+
+    // Return successfully
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_truncate
+// Description  : Shorten a file to "len" bytes, freeing the frames past the new end
+//
+// Inputs       : fd - the file handle of the file to truncate
+//                len - the new length of the file
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t block_truncate(int16_t fd, uint64_t len)
+{
+    int32_t index;
+    uint32_t keep;
+
+    // First check to see if the file exists
+    index = lookup_handle(fd);
+    if (index == -1) {
+	    return (-1);
+    }
+
+    // Buffered writes land before the file is cut
+    if (flush_file_buffers(index) == -1) {
+	    return (-1);
+    }
+
+    // Files only get longer by writing to them
+    if (len > all_files[index].length) {
+	    return (-1);
+    }
+
+    // Keep the frames that still hold data, an inline file just forgets the bytes past the new end
+    keep = (len + BLOCK_FRAME_SIZE - 1) / BLOCK_FRAME_SIZE;
+    shrink_file(index, keep);
+
+    all_files[index].length = len;
+    mark_file_dirty(index);
+
+    // Pull back every open of the file that now points past the end
+    for (uint16_t slot = 0; slot < BLOCK_MAX_OPEN_FILES; slot++) {
+	    if ((handle_table[slot].file == index) && (handle_table[slot].seek_pos > len)) {
+		    handle_table[slot].seek_pos = len;
+	    }
+    }
+
+    // Return successfully
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_get_stats
+// Description  : Copy the driver's transfer counters since poweron
+//
+// Inputs       : stats - where to copy the counters
+// Outputs      : none
+
+void block_get_stats(struct block_stats* stats)
+{
+    // The cache's flusher may be writing frames at the same time
+    pthread_mutex_lock(&bus_lock);
+    *stats = driver_stats;
+    pthread_mutex_unlock(&bus_lock);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_fallocate
+// Description  : Reserve frames for the first "len" bytes of a file up front, in
+//                contiguous runs where the frame map allows, so later writes do
+//                not have to allocate. The length of the file does not change,
+//                and truncating the file gives the reserved frames back
+//
+// Inputs       : fd - the file handle of the file
+//                len - the number of bytes to reserve frames for
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t block_fallocate(int16_t fd, uint64_t len)
+{
+    int32_t index;
+    uint32_t had;
+
+    // First check to see if the file exists
+    index = lookup_handle(fd);
+    if (index == -1) {
+	    return (-1);
+    }
+
+    // The file can not grow past BLOCK_MAX_FILE_SIZE
+    if (len > BLOCK_MAX_FILE_SIZE) {
+	    return (-1);
+    }
+
+    // Reserving frames means the file stops being inline
+    if ((len > 0) && all_files[index].is_inline && (promote_inline(index) == -1)) {
+	    return (-1);
+    }
+
+    // If the frame map runs out, leave the file the way it was
+    had = all_files[index].num_frames;
+    if (reserve_frames(index, (len + BLOCK_FRAME_SIZE - 1) / BLOCK_FRAME_SIZE) == -1) {
+	    shrink_file(index, had);
+	    return (-1);
+    }
+
+    // The extents are part of the file's record
+    if (all_files[index].num_frames != had) {
+	    mark_file_dirty(index);
+    }
+
+    // Return successfully
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_set_inline_threshold
+// Description  : Set the size up to which files keep their data in the
+//                metadata region instead of frames. Files already inline stay
+//                that way until a write takes them past the new threshold
+//
+// Inputs       : bytes - the largest file kept inline, 0 to give every file
+//                frames as soon as it is written
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t block_set_inline_threshold(uint32_t bytes)
+{
+    // The data has to fit in the slots of a metadata record
+    if (bytes > BLOCK_MAX_INLINE_THRESHOLD) {
+	    return (-1);
+    }
+
+    inline_threshold = bytes;
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: unit_check
+// Description	: Log a check of the unit test that failed
+//
+// Inputs	: ok - non-zero if the check passed
+//		  what - what was checked
+// Outputs	: 0 if the check passed, -1 if not
+
+static int unit_check(int ok, const char *what)
+{
+    if (!ok) {
+	    logMessage(LOG_ERROR_LEVEL, "Driver unit test failed: %s", what);
+	    return (-1);
+    }
+
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: unit_make_files
+// Description	: Make a set of test files named after a prefix and a number, each holding its own path
+//
+// Inputs	: prefix - the start of the paths
+//		  count - the number of files
+// Outputs	: 0 if successful, -1 if failure
+
+static int unit_make_files(const char *prefix, int count)
+{
+    char path[BLOCK_MAX_PATH_LENGTH];
+    int32_t len;
+    int16_t fd;
+    int ret = 0;
+
+    for (int i = 0; i < count; i++) {
+	    len = snprintf(path, sizeof(path), "%s_%d", prefix, i);
+	    fd = block_open(path);
+	    ret |= unit_check((fd != -1) && (find_file(path) == lookup_handle(fd)), "a new file is indexed by its path");
+	    ret |= unit_check(block_write(fd, path, len) == len, "write to a new file");
+	    block_close(fd);
+    }
+
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: unit_delete_files
+// Description	: Delete the test files unit_make_files made
+//
+// Inputs	: prefix - the start of the paths
+//		  count - the number of files
+// Outputs	: 0 if successful, -1 if failure
+
+static int unit_delete_files(const char *prefix, int count)
+{
+    char path[BLOCK_MAX_PATH_LENGTH];
+    int ret = 0;
+
+    for (int i = 0; i < count; i++) {
+	    snprintf(path, sizeof(path), "%s_%d", prefix, i);
+	    ret |= unit_check((block_delete(path) == 0) && (find_file(path) == -1), "a deleted file leaves the path index");
+    }
+
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: unit_test_paths
+// Description	: Check that files are found by their path, also after the file table and the path index grew and
+//		  after other files were deleted
+//
+// Inputs	: none
+// Outputs	: 0 if successful, -1 if failure
+
+static int unit_test_paths(void)
+{
+    char path[BLOCK_MAX_PATH_LENGTH];
+    char buf[BLOCK_MAX_PATH_LENGTH];
+    int32_t len;
+    int16_t fd;
+    int ret = 0;
+
+    // More files than the file table and the path index start out with room for
+    ret |= unit_make_files("unit_path", BLOCK_UNIT_TEST_FILES);
+    ret |= unit_check(path_index_buckets >= num_files, "the path index grows with the file table");
+    for (int i = 0; i < BLOCK_UNIT_TEST_FILES; i++) {
+	    len = snprintf(path, sizeof(path), "unit_path_%d", i);
+	    fd = block_open(path);
+	    ret |= unit_check((block_seek(fd, 0) == 0) && (block_read(fd, buf, sizeof(buf)) == len) && (memcmp(buf, path, len) == 0), "a reopened file is the same file");
+	    block_close(fd);
+    }
+
+    // Deleting a file moves another one into its place, which the next delete has to find
+    ret |= unit_delete_files("unit_path", BLOCK_UNIT_TEST_FILES);
+
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: unit_test_handles
+// Description	: Check that handles are unique while open and go stale when closed, and that they keep working
+//		  after more opens than there are handle values
+//
+// Inputs	: none
+// Outputs	: 0 if successful, -1 if failure
+
+static int unit_test_handles(void)
+{
+    int16_t first, fd, other, last;
+    char byte = 'h';
+    int failed = 0;
+    int ret = 0;
+
+    first = block_open("unit_handles");
+    other = block_open("unit_handles");
+    ret |= unit_check((first != -1) && (other != -1) && (first != other), "two opens of a file get different handles");
+    ret |= unit_check(lookup_handle(first) == lookup_handle(other), "two opens of a file share the file");
+    block_close(other);
+    ret |= unit_check(lookup_handle(other) == -1, "a closed handle is stale");
+    ret |= unit_check(block_write(other, &byte, 1) == -1, "a write through a closed handle fails");
+    block_close(first);
+
+    // Every slot wraps its generation on the way, and a closed slot waits behind the other free ones. The loop
+    // stops at the first failure so a broken table does not log thousands of them
+    last = other;
+    for (int32_t i = 0; (i < (BLOCK_HANDLE_GENERATION_MASK + 2) * BLOCK_MAX_OPEN_FILES) && !failed; i++) {
+	    fd = block_open("unit_handles");
+	    failed |= unit_check((fd != -1) && (fd != last), "a reopened file gets a handle other than the one just closed");
+	    failed |= unit_check((fd == first) || (lookup_handle(first) == -1), "an old handle stays stale");
+	    block_close(fd);
+	    last = fd;
+    }
+    ret |= failed;
+    ret |= unit_check(block_close(first) == -1, "closing a stale handle fails");
+
+    ret |= unit_check(block_delete("unit_handles") == 0, "delete the handle test file");
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: unit_test_metadata_region
+// Description	: Check that a checkpoint spreads the metadata over as many frames as it needs, and that the
+//		  superblock and every frame of the region on the device match the image in memory
+//
+// Inputs	: none
+// Outputs	: 0 if successful, -1 if failure
+
+static int unit_test_metadata_region(void)
+{
+    char frame[BLOCK_FRAME_SIZE];
+    uint16_t frames;
+    int ret = 0;
+
+    ret |= unit_make_files("unit_meta", BLOCK_UNIT_TEST_FILES);
+    ret |= unit_check(block_checkpoint() == 0, "checkpoint many files");
+
+    // The records of all the files do not fit in the frame after the frame map
+    frames = num_metadata_frames;
+    ret |= unit_check(metadata_length > BLOCK_FRAME_MAP_SIZE + BLOCK_FRAME_SIZE, "the records take more than one frame");
+    ret |= unit_check(frames == (metadata_length + BLOCK_FRAME_SIZE - 1) / BLOCK_FRAME_SIZE, "the region has the frames its length needs");
+
+    ret |= unit_check((read_frame(BLOCK_SUPERBLOCK_FRAME, frame) == 0) && (memcmp(frame, superblock_image, BLOCK_FRAME_SIZE) == 0),
+		      "the superblock on the device is the last one written");
+    for (uint16_t i = 0; i < frames; i++) {
+	    ret |= unit_check(frame_in_use(metadata_frames[i]), "a metadata frame is marked in use");
+	    ret |= unit_check((read_frame(metadata_frames[i], frame) == 0) &&
+			      (memcmp(frame, metadata_image + (size_t) i * BLOCK_FRAME_SIZE, BLOCK_FRAME_SIZE) == 0),
+			      "a metadata frame on the device matches the image");
+    }
+
+    ret |= unit_delete_files("unit_meta", BLOCK_UNIT_TEST_FILES);
+    ret |= unit_check((block_checkpoint() == 0) && (metadata_length < BLOCK_FRAME_MAP_SIZE + BLOCK_FRAME_SIZE),
+		      "the region gets shorter when files go");
+
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: unit_test_incremental_checkpoint
+// Description	: Check that a checkpoint only writes the frames of the metadata that changed since the last one
+//
+// Inputs	: none
+// Outputs	: 0 if successful, -1 if failure
+
+static int unit_test_incremental_checkpoint(void)
+{
+    char path[BLOCK_MAX_PATH_LENGTH];
+    struct block_stats before, after;
+    int32_t len;
+    int16_t fd;
+    int ret = 0;
+
+    ret |= unit_make_files("unit_checkpoint", BLOCK_UNIT_TEST_FILES);
+    ret |= unit_check((block_checkpoint() == 0) && (first_dirty_file == -1), "a checkpoint leaves no dirty files");
+
+    // Nothing changed, so nothing is written
+    block_get_stats(&before);
+    ret |= unit_check(block_checkpoint() == 0, "checkpoint without changes");
+    block_get_stats(&after);
+    ret |= unit_check(after.frames_written == before.frames_written, "a checkpoint without changes writes nothing");
+
+    // Growing one file rewrites its record, and its data frame if it has one, but not the rest of the region
+    len = snprintf(path, sizeof(path), "unit_checkpoint_%d", BLOCK_UNIT_TEST_FILES / 2);
+    fd = block_open(path);
+    block_get_stats(&before);
+    ret |= unit_check((block_seek(fd, len) == 0) && (block_write(fd, path, 2) == 2), "grow a checkpoint test file");
+    ret |= unit_check(first_dirty_file == find_file(path), "growing a file marks its record dirty");
+    ret |= unit_check(block_checkpoint() == 0, "checkpoint one changed file");
+    block_get_stats(&after);
+    block_close(fd);
+    ret |= unit_check(num_metadata_frames > 4, "the checkpoint test region is large");
+    ret |= unit_check(after.frames_written - before.frames_written <= 3, "a checkpoint writes only the frames that changed");
+
+    ret |= unit_delete_files("unit_checkpoint", BLOCK_UNIT_TEST_FILES);
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: unit_test_extents
+// Description	: Check that a file written in order is one extent, and that the extents of files written in turns
+//		  cover every frame of each file once and lead to the right data
+//
+// Inputs	: none
+// Outputs	: 0 if successful, -1 if failure
+
+static int unit_test_extents(void)
+{
+    char frame[BLOCK_FRAME_SIZE];
+    int16_t fd[2];
+    int32_t index[2];
+    uint32_t run, logical;
+    uint16_t slots;
+    int ret = 0;
+
+    // One file written a frame at a time grows one run
+    fd[0] = block_open("unit_extents_0");
+    for (int i = 0; i < 16; i++) {
+	    memset(frame, 'a' + i, BLOCK_FRAME_SIZE);
+	    ret |= unit_check(block_write(fd[0], frame, BLOCK_FRAME_SIZE) == BLOCK_FRAME_SIZE, "write a frame of an extent test file");
+    }
+    index[0] = lookup_handle(fd[0]);
+    ret |= unit_check((all_files[index[0]].num_extents == 1) && (all_files[index[0]].num_frames == 16),
+		      "a file written in order is one extent");
+    ret |= unit_check((file_frame(index[0], 0, &run) != BLOCK_HOLE) && (run == 16), "the extent covers the whole file");
+
+    // Past 32768 extents the next doubling of the record's slots would not fit its 16-bit count
+    slots = all_files[index[0]].meta_slots;
+    all_files[index[0]].num_extents = 40000;
+    ret |= unit_check((reserve_record_slots(index[0]) == 0) && (all_files[index[0]].meta_slots == BLOCK_FILE_RECORD_MAX_SLOTS),
+		      "record slots stop at the most a record can hold");
+    ret |= unit_check(reserve_extents(index[0], BLOCK_INLINE_EXTENTS) == -1, "a file can not have the extent count that marks an inline record");
+    all_files[index[0]].num_extents = 1;
+    all_files[index[0]].meta_slots = slots;
+    block_close(fd[0]);
+
+    // Two files written in turns interleave on the device
+    fd[0] = block_open("unit_extents_1");
+    fd[1] = block_open("unit_extents_2");
+    for (int i = 0; i < 16; i++) {
+	    for (int f = 0; f < 2; f++) {
+		    memset(frame, 'a' + i + f, BLOCK_FRAME_SIZE);
+		    ret |= unit_check(block_write(fd[f], frame, BLOCK_FRAME_SIZE) == BLOCK_FRAME_SIZE, "write a frame of an extent test file");
+	    }
+    }
+    for (int f = 0; f < 2; f++) {
+	    index[f] = lookup_handle(fd[f]);
+	    logical = 0;
+	    for (uint16_t e = 0; e < all_files[index[f]].num_extents; e++) {
+		    ret |= unit_check(all_files[index[f]].extents[e].logical == logical, "extents follow each other");
+		    logical += all_files[index[f]].extents[e].count;
+	    }
+	    ret |= unit_check(logical == all_files[index[f]].num_frames, "the extents cover the file");
+	    ret |= unit_check(block_seek(fd[f], 0) == 0, "seek to the start of an extent test file");
+	    for (int i = 0; i < 16; i++) {
+		    ret |= unit_check((block_read(fd[f], frame, BLOCK_FRAME_SIZE) == BLOCK_FRAME_SIZE) &&
+				      (frame[0] == 'a' + i + f) && (frame[BLOCK_FRAME_SIZE - 1] == 'a' + i + f), "read back a frame through the extents");
+	    }
+	    block_close(fd[f]);
+    }
+    ret |= unit_check((block_delete("unit_extents_0") == 0) && (block_delete("unit_extents_1") == 0) && (block_delete("unit_extents_2") == 0),
+		      "delete the extent test files");
+
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: unit_test_free_frames
+// Description	: Check that truncating and deleting a file give its frames back to the frame map
+//
+// Inputs	: none
+// Outputs	: 0 if successful, -1 if failure
+
+static int unit_test_free_frames(void)
+{
+    char frame[BLOCK_FRAME_SIZE];
+    BlockAddress addrs[8];
+    uint32_t used = num_frames_used;
+    uint32_t run;
+    int32_t index;
+    int16_t fd;
+    int ret = 0;
+
+    fd = block_open("unit_free");
+    memset(frame, 'f', BLOCK_FRAME_SIZE);
+    for (int i = 0; i < 8; i++) {
+	    ret |= unit_check(block_write(fd, frame, BLOCK_FRAME_SIZE) == BLOCK_FRAME_SIZE, "write a frame of the free test file");
+    }
+    ret |= unit_check(num_frames_used == used + 8, "writing a file uses frames");
+    index = lookup_handle(fd);
+    for (uint32_t i = 0; i < 8; i++) {
+	    addrs[i] = file_frame(index, i, &run);
+	    ret |= unit_check(frame_in_use(addrs[i]), "a frame of a file is marked in use");
+    }
+
+    // Cutting the file into its fourth frame keeps four frames, and pulls the seek position back to the new end
+    ret |= unit_check(block_truncate(fd, 3 * BLOCK_FRAME_SIZE + 1) == 0, "truncate the free test file");
+    ret |= unit_check((num_frames_used == used + 4) && (all_files[index].num_frames == 4), "truncating a file frees its last frames");
+    for (int i = 4; i < 8; i++) {
+	    ret |= unit_check(!frame_in_use(addrs[i]), "a truncated frame is free");
+    }
+    ret |= unit_check(block_read(fd, frame, 1) == 0, "the seek position is at the new end");
+    ret |= unit_check(block_truncate(fd, 4 * BLOCK_FRAME_SIZE) == -1, "truncate does not grow a file");
+
+    block_close(fd);
+    ret |= unit_check(block_delete("unit_free") == 0, "delete the free test file");
+    ret |= unit_check(num_frames_used == used, "deleting a file frees its frames");
+    for (int i = 0; i < 4; i++) {
+	    ret |= unit_check(!frame_in_use(addrs[i]), "a deleted frame is free");
+    }
+    ret |= unit_check(block_delete("unit_free") == -1, "a deleted file is gone");
+
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: unit_test_block_addresses
+// Description	: Check that addresses split back into their block and frame, and that the frame map and the
+//		  per-block counts agree with each other across every block
+//
+// Inputs	: none
+// Outputs	: 0 if successful, -1 if failure
+
+static int unit_test_block_addresses(void)
+{
+    BlockAddress last = BLOCK_ADDRESS(BLOCK_NUM_BLOCKS - 1, BLOCK_BLOCK_SIZE - 1);
+    uint32_t counted = 0;
+    uint32_t used;
+    int ret = 0;
+
+    for (int32_t blk = 0; blk < BLOCK_NUM_BLOCKS; blk++) {
+	    ret |= unit_check((BLOCK_ADDRESS_BLOCK(BLOCK_ADDRESS(blk, BLOCK_BLOCK_SIZE - 1)) == blk) &&
+			      (BLOCK_ADDRESS_FRAME(BLOCK_ADDRESS(blk, BLOCK_BLOCK_SIZE - 1)) == BLOCK_BLOCK_SIZE - 1),
+			      "an address splits into its block and frame");
+
+	    used = 0;
+	    for (uint32_t word = 0; word < BLOCK_FRAME_MAP_WORDS; word++) {
+		    used += __builtin_popcountll(frame_map[blk][word]);
+	    }
+	    ret |= unit_check(used == block_frames_used[blk], "a block's count matches its frame map");
+	    counted += used;
+    }
+    ret |= unit_check(counted == num_frames_used, "the block counts add up to the frames used");
+
+    // The last frame of the last block is counted against that block
+    if (!frame_in_use(last)) {
+	    used = block_frames_used[BLOCK_NUM_BLOCKS - 1];
+	    mark_frame_used(last);
+	    ret |= unit_check(frame_in_use(last) && (block_frames_used[BLOCK_NUM_BLOCKS - 1] == used + 1), "mark the last frame of the device");
+	    free_frame(last);
+	    ret |= unit_check(!frame_in_use(last) && (block_frames_used[BLOCK_NUM_BLOCKS - 1] == used), "free the last frame of the device");
+    }
+
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: unit_test_large_offsets
+// Description	: Check that a file grows past 4GiB, with a 64-bit length and seek position, and stops at the
+//		  largest size its extents can describe
+//
+// Inputs	: none
+// Outputs	: 0 if successful, -1 if failure
+
+static int unit_test_large_offsets(void)
+{
+    uint64_t far = ((uint64_t) 5 << 30) + 3;
+    char buf[8];
+    int32_t index;
+    int16_t fd;
+    int ret = 0;
+
+    fd = block_open("unit_large");
+    index = lookup_handle(fd);
+    ret |= unit_check(block_pwrite(fd, "large", 5, far) == 5, "write past 4GiB");
+    ret |= unit_check(all_files[index].length == far + 5, "the length of a file passes 4GiB");
+    ret |= unit_check((block_pread(fd, buf, sizeof(buf), far) == 5) && (memcmp(buf, "large", 5) == 0), "read back past 4GiB");
+
+    // The same bytes through the 64-bit seek position
+    ret |= unit_check(block_seek64(fd, far + 1) == 0, "seek past 4GiB");
+    ret |= unit_check((block_read64(fd, buf, sizeof(buf)) == 4) && (memcmp(buf, "arge", 4) == 0), "read past 4GiB at the seek position");
+    ret |= unit_check(block_seek64(fd, BLOCK_MAX_FILE_SIZE + 1) == -1, "seek past the largest file fails");
+
+    // A 32-bit position would have wrapped to the start of the file
+    ret |= unit_check((block_pread(fd, buf, 1, far - ((uint64_t) 1 << 32)) == 1) && (buf[0] == 0), "the start of the file is untouched");
+    ret |= unit_check(block_pwrite(fd, "x", 2, BLOCK_MAX_FILE_SIZE - 1) == -1, "write past the largest file fails");
+    ret |= unit_check(all_files[index].length == far + 5, "a failed write leaves the length");
+
+    block_close(fd);
+    ret |= unit_check(block_delete("unit_large") == 0, "delete the large offset test file");
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: unit_test_positions
+// Description	: Check that every open of a file has its own seek position, and that positional reads and
+//		  writes leave it where it was
+//
+// Inputs	: none
+// Outputs	: 0 if successful, -1 if failure
+
+static int unit_test_positions(void)
+{
+    char buf[8];
+    int16_t fd1, fd2;
+    int ret = 0;
+
+    fd1 = block_open("unit_positions");
+    fd2 = block_open("unit_positions");
+    ret |= unit_check(block_write(fd1, "abcdef", 6) == 6, "write through the first open");
+    ret |= unit_check((block_read(fd2, buf, 3) == 3) && (memcmp(buf, "abc", 3) == 0), "the second open reads from its own position");
+
+    ret |= unit_check((block_pread(fd1, buf, 2, 1) == 2) && (memcmp(buf, "bc", 2) == 0), "positional read");
+    ret |= unit_check(block_read(fd1, buf, 1) == 0, "a positional read leaves the seek position");
+    ret |= unit_check(block_pwrite(fd2, "XY", 2, 0) == 2, "positional write");
+    ret |= unit_check((block_read(fd2, buf, 3) == 3) && (memcmp(buf, "def", 3) == 0), "a positional write leaves the seek position");
+    ret |= unit_check((block_pread(fd1, buf, 6, 0) == 6) && (memcmp(buf, "XYcdef", 6) == 0), "both opens see every write");
+
+    // Closing one open leaves the other one working
+    block_close(fd1);
+    ret |= unit_check((block_seek(fd2, 1) == 0) && (block_read(fd2, buf, 2) == 2) && (memcmp(buf, "Yc", 2) == 0),
+		      "an open outlives another open of its file");
+    block_close(fd2);
+
+    ret |= unit_check(block_delete("unit_positions") == 0, "delete the position test file");
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: unit_test_vectors
+// Description	: Check that a scatter/gather list is written and read in order, with buffers that do not line up
+//		  with frames or with the buffers of the other call
+//
+// Inputs	: none
+// Outputs	: 0 if successful, -1 if failure
+
+static int unit_test_vectors(void)
+{
+    size_t size = 100 + 5000 + 3000;
+    char *data = malloc(size);
+    char *back = calloc(1, size);
+    struct iovec iov[3];
+    int16_t fd;
+    int ret = 0;
+
+    for (size_t i = 0; i < size; i++) {
+	    data[i] = (char) (i * 7 + i / 251);
+    }
+
+    fd = block_open("unit_vectors");
+    iov[0] = (struct iovec) {data, 100};
+    iov[1] = (struct iovec) {data + 100, 5000};
+    iov[2] = (struct iovec) {data + 5100, 3000};
+    ret |= unit_check(block_writev(fd, iov, 3) == (int64_t) size, "gather write");
+    ret |= unit_check(block_seek(fd, 0) == 0, "seek to the start of the vector test file");
+
+    // Read it back split in other places, with an empty buffer in between
+    iov[0] = (struct iovec) {back, 1};
+    iov[1] = (struct iovec) {back + 1, 0};
+    iov[2] = (struct iovec) {back + 1, size - 1};
+    ret |= unit_check(block_readv(fd, iov, 3) == (int64_t) size, "scatter read");
+    ret |= unit_check(memcmp(data, back, size) == 0, "a scatter read returns what a gather write wrote");
+    ret |= unit_check(block_readv(fd, iov, 3) == 0, "a scatter read at the end returns nothing");
+    block_close(fd);
+
+    free(data);
+    free(back);
+    ret |= unit_check(block_delete("unit_vectors") == 0, "delete the vector test file");
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: unit_test_full_frames
+// Description	: Check that whole, aligned frames are written without reading them first and read with one device
+//		  read each
+//
+// Inputs	: none
+// Outputs	: 0 if successful, -1 if failure
+
+static int unit_test_full_frames(void)
+{
+    char *data = malloc(4 * BLOCK_FRAME_SIZE);
+    struct block_stats before, after;
+    BlockAddress addr;
+    uint32_t run;
+    int32_t index;
+    int16_t fd;
+    int ret = 0;
+
+    fd = block_open("unit_full_frames");
+    index = lookup_handle(fd);
+    block_get_stats(&before);
+    for (int pass = 0; pass < 2; pass++) {
+	    memset(data, 'A' + pass, 4 * BLOCK_FRAME_SIZE);
+	    ret |= unit_check(block_pwrite(fd, data, 4 * BLOCK_FRAME_SIZE, 0) == 4 * BLOCK_FRAME_SIZE, "write whole frames");
+    }
+    block_get_stats(&after);
+    ret |= unit_check(after.frames_read == before.frames_read, "writing whole frames reads nothing");
+
+    // Push the frames out of memory so the read has to go to the device
+    ret |= unit_check(block_flush(fd) == 0, "flush the full frame test file");
+    for (uint32_t i = 0; i < 4; i++) {
+	    addr = file_frame(index, i, &run);
+	    invalidate_block_cache(BLOCK_ADDRESS_BLOCK(addr), BLOCK_ADDRESS_FRAME(addr));
+    }
+    memset(data, 0, 4 * BLOCK_FRAME_SIZE);
+    block_get_stats(&before);
+    ret |= unit_check(block_pread(fd, data, 4 * BLOCK_FRAME_SIZE, 0) == 4 * BLOCK_FRAME_SIZE, "read whole frames");
+    block_get_stats(&after);
+    ret |= unit_check(after.frames_read == before.frames_read + 4, "reading whole frames reads each frame once");
+    ret |= unit_check((data[0] == 'B') && (data[4 * BLOCK_FRAME_SIZE - 1] == 'B'), "whole frames read back");
+
+    // The read misses went into the cache, so reading the frames again stays off the device
+    block_get_stats(&before);
+    ret |= unit_check(block_pread(fd, data, 4 * BLOCK_FRAME_SIZE, 0) == 4 * BLOCK_FRAME_SIZE, "read whole frames again");
+    block_get_stats(&after);
+    ret |= unit_check(after.frames_read == before.frames_read, "read misses are cached");
+    block_close(fd);
+
+    free(data);
+    ret |= unit_check(block_delete("unit_full_frames") == 0, "delete the full frame test file");
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: unit_test_unwritten_frames
+// Description	: Check that a partial write to a frame that was never written builds the frame from zeroes
+//		  instead of reading it from the device
+//
+// Inputs	: none
+// Outputs	: 0 if successful, -1 if failure
+
+static int unit_test_unwritten_frames(void)
+{
+    char data[BLOCK_MAX_INLINE_THRESHOLD + 1];
+    char back[BLOCK_FRAME_SIZE];
+    struct block_stats before, after;
+    int16_t fd;
+    int ret = 0;
+
+    // Too long to be kept inline
+    memset(data, 'u', sizeof(data));
+    fd = block_open("unit_unwritten");
+    block_get_stats(&before);
+    ret |= unit_check(block_pwrite(fd, data, sizeof(data), 100) == sizeof(data), "partial write to a new frame");
+    ret |= unit_check(block_pwrite(fd, data, 10, 3 * BLOCK_FRAME_SIZE + 5) == 10, "partial write past the end");
+    block_get_stats(&after);
+    ret |= unit_check(after.frames_read == before.frames_read, "partial writes to unwritten frames read nothing");
+
+    // The bytes nobody wrote read as zeroes
+    ret |= unit_check((block_pread(fd, back, BLOCK_FRAME_SIZE, 0) == BLOCK_FRAME_SIZE) && (back[99] == 0) &&
+		      (back[100] == 'u') && (back[100 + sizeof(data)] == 0), "an unwritten frame is built from zeroes");
+    ret |= unit_check((block_pread(fd, back, BLOCK_FRAME_SIZE, 3 * BLOCK_FRAME_SIZE) == 15) && (back[4] == 0) &&
+		      (back[5] == 'u'), "the frame past the end is built from zeroes");
+    block_close(fd);
+
+    ret |= unit_check(block_delete("unit_unwritten") == 0, "delete the unwritten frame test file");
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: unit_test_pending_frames
+// Description	: Check that partial writes to a frame on the device wait for the rest of the frame, skip the read
+//		  when they fill it, and are merged with the device when they do not
+//
+// Inputs	: none
+// Outputs	: 0 if successful, -1 if failure
+
+static int unit_test_pending_frames(void)
+{
+    char *data = malloc(2 * BLOCK_FRAME_SIZE);
+    struct block_stats before, after;
+    BlockAddress addr[2];
+    uint32_t run;
+    int32_t index;
+    int16_t fd;
+    int ret = 0;
+
+    memset(data, 'o', 2 * BLOCK_FRAME_SIZE);
+    fd = block_open("unit_pending");
+    index = lookup_handle(fd);
+    ret |= unit_check(block_write(fd, data, 2 * BLOCK_FRAME_SIZE) == 2 * BLOCK_FRAME_SIZE, "write the pending test file");
+
+    // Only the device has the frames now
+    ret |= unit_check(block_flush(fd) == 0, "flush the pending test file");
+    for (uint32_t i = 0; i < 2; i++) {
+	    addr[i] = file_frame(index, i, &run);
+	    invalidate_block_cache(BLOCK_ADDRESS_BLOCK(addr[i]), BLOCK_ADDRESS_FRAME(addr[i]));
+    }
+
+    // Two halves of the first frame make a whole one, which never has to be read
+    memset(data, 'n', 2 * BLOCK_FRAME_SIZE);
+    block_get_stats(&before);
+    ret |= unit_check(block_pwrite(fd, data, BLOCK_FRAME_SIZE / 2, BLOCK_FRAME_SIZE / 2) == BLOCK_FRAME_SIZE / 2, "write the second half of a frame");
+    ret |= unit_check(find_pending(addr[0]) != NULL, "a partial write to a frame on the device waits");
+    ret |= unit_check(block_pwrite(fd, data, BLOCK_FRAME_SIZE / 2, 0) == BLOCK_FRAME_SIZE / 2, "write the first half of a frame");
+    ret |= unit_check(find_pending(addr[0]) == NULL, "a frame stops waiting once it is whole");
+    block_get_stats(&after);
+    ret |= unit_check(after.frames_read == before.frames_read, "a frame written in parts is not read");
+
+    // A part of the second frame is merged with the rest of it from the device
+    ret |= unit_check(block_pwrite(fd, data, 10, BLOCK_FRAME_SIZE + 10) == 10, "write a part of a frame");
+    ret |= unit_check(find_pending(addr[1]) != NULL, "a part of a frame waits");
+    ret |= unit_check(block_flush(fd) == 0, "flush a waiting frame");
+    ret |= unit_check(find_pending(addr[1]) == NULL, "a flushed frame stops waiting");
+    memset(data, 0, 2 * BLOCK_FRAME_SIZE);
+    ret |= unit_check(block_pread(fd, data, 2 * BLOCK_FRAME_SIZE, 0) == 2 * BLOCK_FRAME_SIZE, "read the pending test file");
+    ret |= unit_check((data[0] == 'n') && (data[BLOCK_FRAME_SIZE - 1] == 'n'), "a frame written in parts reads back");
+    ret |= unit_check((data[BLOCK_FRAME_SIZE + 9] == 'o') && (data[BLOCK_FRAME_SIZE + 10] == 'n') &&
+		      (data[BLOCK_FRAME_SIZE + 19] == 'n') && (data[BLOCK_FRAME_SIZE + 20] == 'o'), "a merged frame keeps the bytes around the write");
+    block_close(fd);
+
+    free(data);
+    ret |= unit_check(block_delete("unit_pending") == 0, "delete the pending test file");
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: unit_test_write_buffer
+// Description	: Check that small sequential writes are collected a frame at a time, and that reads through any
+//		  open of the file see them before they are written out
+//
+// Inputs	: none
+// Outputs	: 0 if successful, -1 if failure
+
+static int unit_test_write_buffer(void)
+{
+    struct block_stats before, after;
+    char *back = malloc(200 * 30);
+    char piece[30];
+    uint16_t slot;
+    int16_t fd, reader;
+    int ret = 0;
+
+    fd = block_open("unit_write_buffer");
+    reader = block_open("unit_write_buffer");
+    slot = fd & (BLOCK_MAX_OPEN_FILES - 1);
+    ret |= unit_check(block_buffer_writes(fd, 1) == 0, "turn on the write buffer");
+
+    // 200 writes of 30 bytes fill one frame and part of the next
+    block_get_stats(&before);
+    for (int i = 0; i < 200; i++) {
+	    memset(piece, 'a' + i % 26, sizeof(piece));
+	    ret |= unit_check(block_write(fd, piece, sizeof(piece)) == sizeof(piece), "buffered write");
+    }
+    block_get_stats(&after);
+    ret |= unit_check(after.frames_written - before.frames_written <= 1, "buffered writes go out a frame at a time");
+    ret |= unit_check(handle_table[slot].wbuf_len > 0, "the tail of the writes stays buffered");
+
+    // Another open of the file reads every byte written so far
+    ret |= unit_check((block_pread(reader, back, 200 * 30, 0) == 200 * 30) && (back[0] == 'a') &&
+		      (back[199 * 30] == 'a' + 199 % 26) && (back[200 * 30 - 1] == 'a' + 199 % 26), "reads see buffered writes");
+    ret |= unit_check(block_pread(reader, back, 1, 200 * 30) == 0, "a read at the end of the file returns nothing");
+    ret |= unit_check(block_pread(reader, back, 1, 200 * 30 + 1) == 0, "a read past the end of the file returns nothing");
+
+    ret |= unit_check((block_flush(fd) == 0) && (handle_table[slot].wbuf_len == 0), "flush empties the write buffer");
+    ret |= unit_check(block_buffer_writes(fd, 0) == 0, "turn off the write buffer");
+    block_close(reader);
+    block_close(fd);
+
+    free(back);
+    ret |= unit_check(block_delete("unit_write_buffer") == 0, "delete the write buffer test file");
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: unit_restart_cache
+// Description	: Write out everything the cache holds and start it again in write-back or write-through mode
+//
+// Inputs	: write_back - non-zero for a write-back cache
+// Outputs	: 0 if successful, -1 if failure
+
+static int unit_restart_cache(int write_back)
+{
+    if ((block_checkpoint() == -1) || (close_block_cache() == -1) ||
+	(set_block_cache_write_back(write_back) == -1) || (init_block_cache() == -1)) {
+	    return (-1);
+    }
+    set_block_cache_flusher(writeback_frame);
+
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: unit_test_write_back
+// Description	: Check that a write-back cache holds written frames until they are flushed, and that the frames
+//		  of a deleted file are dropped instead of written
+//
+// Inputs	: none
+// Outputs	: 0 if successful, -1 if failure
+
+static int unit_test_write_back(void)
+{
+    char *data = malloc(2 * BLOCK_FRAME_SIZE);
+    struct block_stats before, after;
+    int write_back = block_cache_write_back();
+    BlockAddress addr[2];
+    uint32_t run;
+    int32_t index;
+    int16_t fd;
+    int ret = 0;
+
+    ret |= unit_check(unit_restart_cache(1) == 0, "start a write-back cache");
+
+    memset(data, 'w', 2 * BLOCK_FRAME_SIZE);
+    fd = block_open("unit_write_back");
+    index = lookup_handle(fd);
+    block_get_stats(&before);
+    ret |= unit_check(block_write(fd, data, 2 * BLOCK_FRAME_SIZE) == 2 * BLOCK_FRAME_SIZE, "write to a write-back cache");
+    ret |= unit_check(block_cache_dirty_frames() > 0, "written frames stay dirty in the cache");
+    ret |= unit_check(block_flush(fd) == 0, "flush the write-back test file");
+    block_get_stats(&after);
+    ret |= unit_check((block_cache_dirty_frames() == 0) && (after.frames_written - before.frames_written == 2),
+		      "flush writes each dirty frame once");
+
+    // The device has the flushed frames
+    for (uint32_t i = 0; i < 2; i++) {
+	    addr[i] = file_frame(index, i, &run);
+	    invalidate_block_cache(BLOCK_ADDRESS_BLOCK(addr[i]), BLOCK_ADDRESS_FRAME(addr[i]));
+    }
+    memset(data, 0, 2 * BLOCK_FRAME_SIZE);
+    ret |= unit_check((block_pread(fd, data, 2 * BLOCK_FRAME_SIZE, 0) == 2 * BLOCK_FRAME_SIZE) && (data[0] == 'w') &&
+		      (data[2 * BLOCK_FRAME_SIZE - 1] == 'w'), "flushed frames are on the device");
+
+    // Deleting a file drops its dirty frames, they must not reach the frames' next owner
+    memset(data, 'd', BLOCK_FRAME_SIZE);
+    ret |= unit_check(block_pwrite(fd, data, BLOCK_FRAME_SIZE, 0) == BLOCK_FRAME_SIZE, "dirty a frame of the write-back test file");
+    block_close(fd);
+    block_get_stats(&before);
+    ret |= unit_check(block_delete("unit_write_back") == 0, "delete the write-back test file");
+    block_get_stats(&after);
+    ret |= unit_check((peek_block_cache(BLOCK_ADDRESS_BLOCK(addr[0]), BLOCK_ADDRESS_FRAME(addr[0]), data) == -1) &&
+		      (block_cache_dirty_frames() == 0) && (after.frames_written == before.frames_written),
+		      "a deleted file's frames leave the cache unwritten");
+
+    ret |= unit_check(unit_restart_cache(write_back) == 0, "restore the cache mode");
+    free(data);
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: unit_test_write_elision
+// Description	: Check that writing a cached frame with the bytes it already holds does not write it again
+//
+// Inputs	: none
+// Outputs	: 0 if successful, -1 if failure
+
+static int unit_test_write_elision(void)
+{
+    char frame[BLOCK_FRAME_SIZE];
+    char cached[BLOCK_FRAME_SIZE];
+    struct block_stats before, after;
+    BlockAddress addr;
+    uint32_t run;
+    int16_t fd;
+    int ret = 0;
+
+    memset(frame, 'e', BLOCK_FRAME_SIZE);
+    fd = block_open("unit_elision");
+    ret |= unit_check(block_write(fd, frame, BLOCK_FRAME_SIZE) == BLOCK_FRAME_SIZE, "write the elision test file");
+    addr = file_frame(lookup_handle(fd), 0, &run);
+
+    // The admission filter may have kept the frame out of the cache, then there is nothing to compare with
+    if (peek_block_cache(BLOCK_ADDRESS_BLOCK(addr), BLOCK_ADDRESS_FRAME(addr), cached) == 0) {
+	    block_get_stats(&before);
+	    ret |= unit_check(block_pwrite(fd, frame, BLOCK_FRAME_SIZE, 0) == BLOCK_FRAME_SIZE, "rewrite the same bytes");
+	    block_get_stats(&after);
+	    ret |= unit_check((after.writes_elided == before.writes_elided + 1) && (after.frames_written == before.frames_written),
+			      "rewriting the same bytes is skipped");
+
+	    frame[0] = 'E';
+	    ret |= unit_check(block_pwrite(fd, frame, BLOCK_FRAME_SIZE, 0) == BLOCK_FRAME_SIZE, "write different bytes");
+	    block_get_stats(&before);
+	    ret |= unit_check(before.writes_elided == after.writes_elided, "writing different bytes is not skipped");
+	    ret |= unit_check((block_pread(fd, cached, 1, 0) == 1) && (cached[0] == 'E'), "the changed frame reads back");
+    }
+    block_close(fd);
+
+    ret |= unit_check(block_delete("unit_elision") == 0, "delete the elision test file");
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: unit_test_fallocate
+// Description	: Check that reserved frames leave the length alone and are used by later writes, and that a
+//		  write or a reservation the device has no room for leaves the file the way it was
+//
+// Inputs	: none
+// Outputs	: 0 if successful, -1 if failure
+
+static int unit_test_fallocate(void)
+{
+    char *data = calloc(4, BLOCK_FRAME_SIZE);
+    uint64_t length = BLOCK_MAX_INLINE_THRESHOLD + 1;
+    uint32_t used;
+    uint64_t filled;
+    int32_t index;
+    int16_t fd, filler;
+    int ret = 0;
+
+    fd = block_open("unit_fallocate");
+    index = lookup_handle(fd);
+    ret |= unit_check(block_pwrite(fd, data, length, 0) == (int64_t) length, "write the fallocate test file");
+    used = num_frames_used;
+    ret |= unit_check(block_fallocate(fd, 8 * BLOCK_FRAME_SIZE) == 0, "reserve frames");
+    ret |= unit_check((all_files[index].num_frames == 8) && (num_frames_used == used + 7), "reserving frames gives them to the file");
+    ret |= unit_check((all_files[index].length == length) && (block_pread(fd, data, 1, length) == 0), "reserving frames leaves the length");
+    ret |= unit_check((block_fallocate(fd, BLOCK_FRAME_SIZE) == 0) && (all_files[index].num_frames == 8), "a smaller reservation keeps the frames");
+    ret |= unit_check((block_pwrite(fd, data, BLOCK_FRAME_SIZE, BLOCK_FRAME_SIZE) == BLOCK_FRAME_SIZE) && (num_frames_used == used + 7),
+		      "a write into reserved frames allocates nothing");
+    ret |= unit_check((block_truncate(fd, length) == 0) && (num_frames_used == used), "truncating gives reserved frames back");
+
+    // Reserve every frame that is left, first in large steps, then one at a time
+    filler = block_open("unit_fallocate_filler");
+    filled = 64;
+    while (block_fallocate(filler, filled * BLOCK_FRAME_SIZE) == 0) {
+	    filled += 64;
+    }
+    filled -= 63;
+    while (block_fallocate(filler, filled * BLOCK_FRAME_SIZE) == 0) {
+	    filled++;
+    }
+    used = num_frames_used;
+
+    ret |= unit_check(block_pwrite(fd, data, 3 * BLOCK_FRAME_SIZE, length) == -1, "a write to a full device fails");
+    ret |= unit_check((all_files[index].length == length) && (all_files[index].num_frames == 1) && (num_frames_used == used),
+		      "a write that failed for room leaves the file");
+    ret |= unit_check(block_fallocate(fd, 2 * BLOCK_FRAME_SIZE) == -1, "a reservation on a full device fails");
+    ret |= unit_check((all_files[index].num_frames == 1) && (num_frames_used == used), "a reservation that failed leaves the file");
+
+    block_close(filler);
+    ret |= unit_check(block_delete("unit_fallocate_filler") == 0, "delete the filler file");
+    ret |= unit_check(block_pwrite(fd, data, 3 * BLOCK_FRAME_SIZE, length) == 3 * BLOCK_FRAME_SIZE, "write once there is room again");
+    block_close(fd);
+
+    free(data);
+    ret |= unit_check(block_delete("unit_fallocate") == 0, "delete the fallocate test file");
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: unit_test_holes
+// Description	: Check that a write past the end of a file leaves a hole that uses no frames and reads as zeroes,
+//		  and that a write into the hole gives only the written frame a device frame
+//
+// Inputs	: none
+// Outputs	: 0 if successful, -1 if failure
+
+static int unit_test_holes(void)
+{
+    char *data = malloc(BLOCK_FRAME_SIZE);
+    uint32_t used = num_frames_used;
+    uint32_t run;
+    int32_t index;
+    int16_t fd;
+    int ret = 0;
+
+    fd = block_open("unit_holes");
+    index = lookup_handle(fd);
+    ret |= unit_check(block_pwrite(fd, "hole", 4, 100 * BLOCK_FRAME_SIZE) == 4, "write past the end of a new file");
+    ret |= unit_check((num_frames_used == used + 1) && (all_files[index].num_frames == 101), "a hole uses no frames");
+    ret |= unit_check((file_frame(index, 0, &run) == BLOCK_HOLE) && (run == 100), "the skipped frames are a hole");
+
+    memset(data, 'x', BLOCK_FRAME_SIZE);
+    ret |= unit_check(block_pread(fd, data, BLOCK_FRAME_SIZE, 50 * BLOCK_FRAME_SIZE + 7) == BLOCK_FRAME_SIZE, "read across a hole");
+    ret |= unit_check((data[0] == 0) && (data[BLOCK_FRAME_SIZE - 1] == 0), "a hole reads as zeroes");
+
+    // Filling a frame in the middle splits the hole around it
+    ret |= unit_check(block_pwrite(fd, "fill", 4, 50 * BLOCK_FRAME_SIZE + 10) == 4, "write into a hole");
+    ret |= unit_check(num_frames_used == used + 2, "a write into a hole uses one frame");
+    ret |= unit_check((file_frame(index, 49, &run) == BLOCK_HOLE) && (run == 1) && (file_frame(index, 50, &run) != BLOCK_HOLE) &&
+		      (file_frame(index, 51, &run) == BLOCK_HOLE) && (run == 49), "the hole is split around the written frame");
+    ret |= unit_check((block_pread(fd, data, 16, 50 * BLOCK_FRAME_SIZE) == 16) && (data[9] == 0) && (memcmp(data + 10, "fill", 4) == 0) &&
+		      (data[14] == 0), "a filled frame reads back with zeroes around the write");
+    block_close(fd);
+
+    free(data);
+    ret |= unit_check((block_delete("unit_holes") == 0) && (num_frames_used == used), "delete the hole test file");
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: unit_test_inline_files
+// Description	: Check that a small file keeps its data in its record without frames, also when written from a
+//		  scatter/gather list, and moves it into a frame once it grows past the threshold
+//
+// Inputs	: none
+// Outputs	: 0 if successful, -1 if failure
+
+static int unit_test_inline_files(void)
+{
+    uint32_t threshold = inline_threshold;
+    uint32_t used = num_frames_used;
+    char back[BLOCK_DEFAULT_INLINE_THRESHOLD * 2];
+    char grow[BLOCK_DEFAULT_INLINE_THRESHOLD * 2];
+    struct iovec iov[3];
+    int32_t index;
+    int16_t fd;
+    int ret = 0;
+
+    ret |= unit_check(block_set_inline_threshold(BLOCK_MAX_INLINE_THRESHOLD + 1) == -1, "a threshold past the record slots fails");
+    ret |= unit_check(block_set_inline_threshold(BLOCK_DEFAULT_INLINE_THRESHOLD) == 0, "set the inline threshold");
+
+    fd = block_open("unit_inline");
+    index = lookup_handle(fd);
+    ret |= unit_check(block_write(fd, "0123456789", 10) == 10, "write a small file");
+    ret |= unit_check(all_files[index].is_inline && (all_files[index].num_frames == 0) && (num_frames_used == used),
+		      "a small file uses no frames");
+
+    // Every buffer of the list lands in the file
+    iov[0] = (struct iovec) {"ab", 2};
+    iov[1] = (struct iovec) {"cd", 2};
+    iov[2] = (struct iovec) {"ef", 2};
+    ret |= unit_check(block_writev(fd, iov, 3) == 6, "gather write to a small file");
+    iov[0] = (struct iovec) {back, 9};
+    iov[1] = (struct iovec) {back + 9, 7};
+    ret |= unit_check((block_seek(fd, 0) == 0) && (block_readv(fd, iov, 2) == 16) && (memcmp(back, "0123456789abcdef", 16) == 0),
+		      "a small file written from a list reads back");
+    ret |= unit_check(all_files[index].is_inline && (all_files[index].length == 16), "a gather write keeps a small file inline");
+
+    // Growing past the threshold moves the data into a frame
+    memset(grow, 'g', sizeof(grow));
+    ret |= unit_check(block_write(fd, grow, sizeof(grow)) == sizeof(grow), "grow a small file past the threshold");
+    ret |= unit_check(!all_files[index].is_inline && (all_files[index].num_frames == 1) && (num_frames_used == used + 1),
+		      "a file past the threshold moves into a frame");
+    ret |= unit_check((block_pread(fd, back, sizeof(back), 0) == sizeof(back)) && (memcmp(back, "0123456789abcdef", 16) == 0) &&
+		      (back[16] == 'g'), "a moved file keeps its data");
+    block_close(fd);
+
+    ret |= unit_check((block_delete("unit_inline") == 0) && (num_frames_used == used), "delete the inline test file");
+    inline_threshold = threshold;
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : blockDriverUnitTest
+// Description  : Run a UNIT test checking the driver implementation. It runs
+//                in one power cycle of the block system and deletes the files
+//                it makes
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int blockDriverUnitTest(void)
+{
+    int ret = 0;
+
+    if (block_poweron() == -1) {
+	    logMessage(LOG_ERROR_LEVEL, "Driver unit test failed: power on");
+	    return (-1);
+    }
+
+    // Every check runs even if an earlier one failed, so one run reports all of the failures
+    ret |= unit_test_paths();
+    ret |= unit_test_handles();
+    ret |= unit_test_metadata_region();
+    ret |= unit_test_incremental_checkpoint();
+    ret |= unit_test_extents();
+    ret |= unit_test_free_frames();
+    ret |= unit_test_block_addresses();
+    ret |= unit_test_large_offsets();
+    ret |= unit_test_positions();
+    ret |= unit_test_vectors();
+    ret |= unit_test_full_frames();
+    ret |= unit_test_unwritten_frames();
+    ret |= unit_test_pending_frames();
+    ret |= unit_test_write_buffer();
+    ret |= unit_test_write_back();
+    ret |= unit_test_write_elision();
+    ret |= unit_test_fallocate();
+    ret |= unit_test_holes();
+    ret |= unit_test_inline_files();
+
+    if ((block_poweroff() == -1) || (ret == -1)) {
+	    logMessage(LOG_ERROR_LEVEL, "Driver unit test failed.");
+	    return (-1);
+    }
+
+    logMessage(LOG_OUTPUT_LEVEL, "Driver unit test completed successfully.");
     return (0);
 }
@@ -12,26 +12,118 @@
 
 // Include files
 #include <stdint.h>
+#include <sys/uio.h>
+#include <block_controller.h>
 
 // Defines
+#define BLOCK_NUM_BLOCKS 1 // Number of blocks the driver spreads files over (the controller in this tree has one)
 #define BLOCK_MAX_TOTAL_FILES 1024 // Maximum number of files ever
 #define BLOCK_MAX_PATH_LENGTH 128 // Maximum length of filename length
+#define BLOCK_PATH_INDEX_MIN_BUCKETS 64 // Smallest number of buckets in the path index
+#define BLOCK_FILES_MIN_CAPACITY 16 // Smallest number of entries allocated for the file table
+#define BLOCK_HANDLE_SLOT_BITS 10 // Low bits of a file handle that select its slot in the handle table
+#define BLOCK_MAX_OPEN_FILES (1 << BLOCK_HANDLE_SLOT_BITS) // Number of slots in the handle table
+#define BLOCK_HANDLE_GENERATION_MASK 0x1f // Generation bits kept above the slot index (handle stays positive)
+#define BLOCK_MAX_FILE_SIZE ((uint64_t) UINT32_MAX * BLOCK_FRAME_SIZE) // Largest file the extent map can describe
+#define BLOCK_MAX_PENDING_FRAMES 16 // Uncached frames whose partial writes can wait for the rest of the frame
+#define BLOCK_PENDING_MAX_RANGES 8 // Separate byte ranges a pending frame holds before it is merged with the device
+#define BLOCK_DEFAULT_INLINE_THRESHOLD 64 // Files up to this many bytes keep their data in their metadata record
+#define BLOCK_MAX_INLINE_THRESHOLD 1024 // Largest inline threshold that can be configured
+#define BLOCK_UNIT_TEST_FILES 200 // Files the unit test makes, enough for the file table and the path index to grow
+
+// Metadata layout: frame 0 holds the superblock, a header followed by the table of frames that make up the metadata region
+#define BLOCK_METADATA_MAGIC 0x4d4b4c42 // "BLKM", marks a superblock written by this driver
+#define BLOCK_METADATA_VERSION 7 // Version of the on-device metadata format
+#define BLOCK_SUPERBLOCK_FRAME BLOCK_ADDRESS(0, 0) // Frame holding the superblock
+#define BLOCK_SUPERBLOCK_HEADER_SIZE 20 // magic, version, num_files, num_frames_used, num_blocks, num_metadata_frames, length
+#define BLOCK_FRAME_MAP_WORDS (BLOCK_BLOCK_SIZE / 64) // 64-bit words in the bitmap of used frames of one block
+#define BLOCK_FRAME_MAP_SIZE (BLOCK_NUM_BLOCKS * BLOCK_FRAME_MAP_WORDS * 8) // Bytes of frame map at the start of the metadata region
+#define BLOCK_MAX_METADATA_FRAMES ((BLOCK_FRAME_SIZE - BLOCK_SUPERBLOCK_HEADER_SIZE) / sizeof(BlockAddress)) // Frames the superblock can list
+#define BLOCK_FILE_RECORD_SIZE (BLOCK_MAX_PATH_LENGTH + 12) // path, 64-bit length, num_extents, slots (the extent list follows)
+#define BLOCK_EXTENT_RECORD_SIZE 6 // start address, frame count
+#define BLOCK_INLINE_EXTENTS UINT16_MAX // num_extents of a record whose slots hold the file's data instead of extents
+#define BLOCK_MAX_EXTENTS (BLOCK_INLINE_EXTENTS - 1) // Most extents a file can have, so its count never reads as inline
+#define BLOCK_FILE_RECORD_MIN_SLOTS 4 // Smallest number of extent slots in a file record
+#define BLOCK_FILE_RECORD_MAX_SLOTS UINT16_MAX // Most extent slots a file record can have, its slot count is 16-bit
+#define BLOCK_MIN_EXTENT_CAPACITY 4 // Extents the in-memory list of a file starts out with room for
+
+// The address of a frame anywhere on the block system: the block in the high 16 bits, the frame within it in the low 16 bits
+typedef uint32_t BlockAddress;
+#define BLOCK_ADDRESS(blk, frm) (((BlockAddress) (blk) << 16) | (BlockFrameIndex) (frm))
+#define BLOCK_ADDRESS_BLOCK(addr) ((BlockIndex) ((addr) >> 16))
+#define BLOCK_ADDRESS_FRAME(addr) ((BlockFrameIndex) ((addr) & 0xffff))
+
+// The superblock frame never belongs to a file, so an extent starting there is a hole
+#define BLOCK_HOLE BLOCK_SUPERBLOCK_FRAME // Start of an extent whose frames were never written, read as zeroes and use no device frames
+
+// A run of contiguous frames within one block that holds part of a file, or a hole in the file
+struct extent {
+	uint32_t logical; // Frame of the file the run starts at, counted from the start of the file
+	BlockAddress start; // First frame of the run on the block system, BLOCK_HOLE for a hole
+	uint16_t count; // Number of frames in the run
+};
 
 struct file {
 	char path[BLOCK_MAX_PATH_LENGTH];
-	int16_t handle;
-	uint32_t length;
-	enum status {
-		OPEN = 1,
-		CLOSED = 0
-	}status;
-	uint32_t seek_pos;
-
-	// To avoid excessive memory consumption, point to an area of memory to store an array of frame numbers
-	uint16_t *frames;
-	uint16_t num_frames;
+	uint64_t length;
+	uint16_t open_count; // Number of open file descriptions on the file
+	uint16_t buffered_handles; // Number of those holding writes in their write buffer
+
+	// The frames of the file, described as contiguous runs of frames on the block system
+	// Frames past the end of the file stay reserved for it (block_fallocate) until it is truncated
+	struct extent *extents;
+	uint16_t num_extents;
+	uint32_t extents_capacity; // Room in extents, grown geometrically
+	uint32_t num_frames;
+
+	// A small file keeps its data in its metadata record and has no frames, until it grows past the inline threshold
+	uint8_t is_inline;
+	char *inline_data; // The file's "length" bytes while it is inline
+
+	// Index of the next file in the same path index bucket (-1 ends the chain)
+	int32_t hash_next;
+
+	// Where the file's record starts in the metadata region, how many frames it has room for,
+	// and whether it changed since the last checkpoint
+	uint32_t meta_offset;
+	uint16_t meta_slots;
+	uint8_t dirty;
 }file;
 
+// A slot in the file handle table. A handle is (generation << BLOCK_HANDLE_SLOT_BITS) | slot,
+// and is only accepted while the slot still holds the same generation. Freed slots are reused in
+// FIFO order, so a handle value only comes back after its slot went through every generation.
+struct file_handle {
+	int32_t file; // Index into the file table, -1 if the slot is free
+	uint16_t generation; // Bumped every time the slot is released, wrapping at BLOCK_HANDLE_GENERATION_MASK
+	uint64_t seek_pos; // Position of this open file description, independent of other opens
+	uint8_t buffered; // Small sequential writes are collected in wbuf instead of going straight to the file
+	char *wbuf; // Write buffer, covering at most the rest of one frame
+	uint64_t wbuf_pos; // File offset of the first byte in wbuf
+	uint32_t wbuf_len; // Bytes waiting in wbuf
+};
+
+// Partial writes to a frame that was not cached, kept until the frame is read, flushed or fully covered,
+// so that the frame only has to be read back from the device if something is still missing by then
+struct pending_range {
+	uint16_t start; // First byte of the frame written
+	uint16_t end; // One past the last byte written
+};
+
+struct pending_frame {
+	BlockAddress addr; // Frame the writes belong to, BLOCK_SUPERBLOCK_FRAME if the slot is free
+	uint8_t num_ranges;
+	struct pending_range ranges[BLOCK_PENDING_MAX_RANGES]; // Sorted, disjoint, non-adjacent ranges written so far
+	char *data; // Frame image, only meaningful inside the ranges
+};
+
+// Counts of the frame transfers the driver made since poweron
+struct block_stats {
+	uint64_t frames_read; // Frames read from the device
+	uint64_t frames_written; // Frames written to the device
+	uint64_t writes_elided; // Frame writes skipped because the cached frame already held the same bytes
+};
+
 //
 // Interface functions
 
@@ -47,6 +139,9 @@ int32_t block_poweron(void);
 int32_t block_poweroff(void);
 // Shut down the BLOCK interface, close all files
 
+int32_t block_checkpoint(void);
+// Write the metadata that changed since the last checkpoint to the block system
+
 int16_t block_open(char* path);
 // This function opens the file and returns a file handle
 
@@ -62,4 +157,52 @@ int32_t block_write(int16_t fd, void* buf, int32_t count);
 int32_t block_seek(int16_t fd, uint32_t loc);
 // Seek to specific point in the file
 
+int64_t block_read64(int16_t fd, void* buf, uint64_t count);
+// Reads "count" bytes from the file handle "fh" into the buffer "buf", with 64-bit sizes
+
+int64_t block_write64(int16_t fd, void* buf, uint64_t count);
+// Writes "count" bytes to the file handle "fh" from the buffer "buf", with 64-bit sizes
+
+int32_t block_seek64(int16_t fd, uint64_t loc);
+// Seek to specific point in the file, with a 64-bit offset
+
+int64_t block_pread(int16_t fd, void* buf, uint64_t count, uint64_t offset);
+// Reads "count" bytes at "offset" into the buffer "buf" without moving the seek position
+
+int64_t block_pwrite(int16_t fd, void* buf, uint64_t count, uint64_t offset);
+// Writes "count" bytes at "offset" from the buffer "buf" without moving the seek position
+
+int64_t block_readv(int16_t fd, const struct iovec* iov, int iovcnt);
+// Reads into the "iovcnt" buffers of "iov" in order, in a single pass over the file's frames
+
+int64_t block_writev(int16_t fd, const struct iovec* iov, int iovcnt);
+// Writes the "iovcnt" buffers of "iov" in order, writing each frame at most once
+
+int32_t block_buffer_writes(int16_t fd, int enable);
+// Turn the write buffer of a file handle on or off
+
+int32_t block_flush(int16_t fd);
+// Write out whatever a file handle has buffered
+
+int32_t block_delete(char* path);
+// Remove a file from the filesystem and free its frames
+
+int32_t block_truncate(int16_t fd, uint64_t len);
+// Shorten a file to "len" bytes, freeing the frames past the new end
+
+int32_t block_fallocate(int16_t fd, uint64_t len);
+// Reserve frames for the first "len" bytes of a file, contiguously where possible, without changing its length
+
+int32_t block_set_inline_threshold(uint32_t bytes);
+// Set the size up to which files keep their data in the metadata instead of frames
+
+void block_get_stats(struct block_stats* stats);
+// Copy the driver's transfer counters into "stats"
+
+//
+// Unit test
+
+int blockDriverUnitTest(void);
+// Run a UNIT test checking the driver implementation
+
 #endif
@@ -28,15 +28,21 @@
 // Defines
 #define BLOCK_WORKLOAD_DIR "workload"
 #define BLOCK_SIM_MAX_OPEN_FILES 128
-#define BLOCK_ARGUMENTS "huvl:c:"
+#define BLOCK_ARGUMENTS "huvwbal:c:i:p:"
 #define USAGE                                                                    \
-    "USAGE: block_sim [-h] [-v] [-l <logfile>] [-c <sz>] <workload-file>\n"      \
+    "USAGE: block_sim [-h] [-v] [-w] [-b] [-a] [-l <logfile>] [-c <sz>] "        \
+    "[-i <sz>] [-p <policy>] <workload-file>\n"                                  \
     "\n"                                                                         \
     "where:\n"                                                                   \
     "    -h - help mode (display this message)\n"                                \
     "    -v - verbose output\n"                                                  \
+    "    -w - buffer small sequential writes on every open file\n"               \
+    "    -b - write-back cache, modified frames are written on eviction/flush\n" \
+    "    -a - only cache a frame over a victim if it is used more often\n"       \
     "    -l - write log messages to the filename <logfile>\n"                    \
     "    -c - set the block block cache to size <sz> (disabled for assign #2)\n" \
+    "    -i - keep files of up to <sz> bytes inline in the metadata\n"           \
+    "    -p - cache replacement <policy>: lru, clock, 2q, arc or s3fifo\n"       \
     "\n"                                                                         \
     "    <workload-file> - file contain the workload to simulate\n"              \
     "\n"
@@ -51,6 +57,7 @@ typedef struct {
 // Global Data
 int verbose;
 uint32_t cache_size = 0;
+int buffer_writes = 0;
 
 //
 // Functional Prototypes
@@ -75,6 +82,7 @@ int main(int argc, char* argv[])
 
     // Local variables
     int ch, verbose = 0, log_initialized = 0, unit_tests = 0;
+    uint32_t inline_size;
     // uint32_t cache_size = 0;
 
     // Process the command line parameters
@@ -93,6 +101,18 @@ int main(int argc, char* argv[])
             unit_tests = 1;
             break;
 
+        case 'w': // Write buffer Flag
+            buffer_writes = 1;
+            break;
+
+        case 'b': // Write-back cache Flag
+            set_block_cache_write_back(1);
+            break;
+
+        case 'a': // Cache admission filter Flag
+            set_block_cache_admission(1);
+            break;
+
         case 'l': // Set the log filename
             initializeLogWithFilename(optarg);
             log_initialized = 1;
@@ -104,6 +124,18 @@ int main(int argc, char* argv[])
             }
             break;
 
+        case 'p': // Set the cache replacement policy
+            if (set_block_cache_policy(optarg) == -1) {
+                logMessage(LOG_ERROR_LEVEL, "Bad cache policy [%s]", optarg);
+            }
+            break;
+
+        case 'i': // Set the inline file threshold
+            if ((sscanf(optarg, "%u", &inline_size) != 1) || (block_set_inline_threshold(inline_size) == -1)) {
+                logMessage(LOG_ERROR_LEVEL, "Bad inline threshold [%s]", optarg);
+            }
+            break;
+
         default: // Default (unknown)
             fprintf(stderr, "Unknown command line option (%c), aborting.\n", ch);
             return (-1);
@@ -136,7 +168,7 @@ int main(int argc, char* argv[])
         enableLogLevels(LOG_INFO_LEVEL);
         logMessage(LOG_INFO_LEVEL, "Running unit tests ....\n\n");
         // if ((block_unit_test() == 0) && (blockCacheUnitTest() == 0) && (blockCacheUnitTest() == 0)) {
-        if ((blockCacheUnitTest() == 0) && (blockCacheUnitTest() == 0)) {
+        if ((blockDriverUnitTest() == 0) && (blockCacheUnitTest() == 0) && (blockCacheUnitTest() == 0)) {
             logMessage(LOG_INFO_LEVEL, "Unit tests completed successfully.\n\n");
         } else {
             logMessage(LOG_ERROR_LEVEL, "Unit tests failed, aborting.\n\n");
@@ -181,6 +213,7 @@ int simulate_BLOCK(char* wload)
     FILE* fhandle = NULL;
     int32_t err = 0, len, off, fields, linecount;
     BlockSimulationTable ftable[BLOCK_SIM_MAX_OPEN_FILES];
+    struct block_stats stats;
     int idx, i;
 
     // Setup the file table
@@ -252,6 +285,12 @@ int simulate_BLOCK(char* wload)
                     logMessage(LOG_ERROR_LEVEL, "Open of new file [%s] failed, aborting simulation.", fname);
                     return (-1);
                 }
+
+                // Collect small sequential writes if asked to
+                if (buffer_writes && (block_buffer_writes(ftable[idx].fhandle, 1) == -1)) {
+                    logMessage(LOG_ERROR_LEVEL, "Write buffering of file [%s] failed, aborting simulation.", fname);
+                    return (-1);
+                }
             }
 
             // Now execute the specific command
@@ -380,6 +419,14 @@ int simulate_BLOCK(char* wload)
     }
     logMessage(LOG_OUTPUT_LEVEL, "=======================================");
 
+    // Report the frame transfers the driver made, and the writes it could skip
+    block_get_stats(&stats);
+    logMessage(LOG_OUTPUT_LEVEL, "========== Driver Transfers ===========");
+    logMessage(LOG_OUTPUT_LEVEL, "Frames read    : %lu", (unsigned long) stats.frames_read);
+    logMessage(LOG_OUTPUT_LEVEL, "Frames written : %lu", (unsigned long) stats.frames_written);
+    logMessage(LOG_OUTPUT_LEVEL, "Writes elided  : %lu", (unsigned long) stats.writes_elided);
+    logMessage(LOG_OUTPUT_LEVEL, "=======================================");
+
     // Close the workload file, successfully
     fclose(fhandle);
     return (0);